@@ -76,6 +76,13 @@ if [[ "$1" =~ ^[0-9]+$ ]] && [ "$1" -ge 0 -a "$1" -le 64 ]; then
 		exit -1
 	fi
 	
+	# Checking that the bulk rule installer is there
+	INSTALL_SCRIPT=$DIR/install-rules.py
+	if [ ! -f "$INSTALL_SCRIPT" ]; then
+		echo "The rule installer script does not exist, cannot create VM!"
+		exit -1
+	fi
+
 	# Checking that the MAC advertisement script is there
 	MAC_SCRIPT=$DIR/send-mac-advertisement.py
 	if [ ! -f "$MAC_SCRIPT" ]; then
@@ -131,6 +138,7 @@ if [[ "$1" =~ ^[0-9]+$ ]] && [ "$1" -ge 0 -a "$1" -le 64 ]; then
 	cat $VAGRANT_TEMPLATE | perl -p -e 's/\$HOSTNAME/$ENV{HOSTNAME}/eg' | perl -p -e 's/\$VM_ID/$ENV{VM_ID}/eg' | perl -p -e 's/\$SSH_PORT/$ENV{SSH_PORT}/eg' | perl -p -e 's/\$MAC/$ENV{MAC}/eg' > /vagrant/$1/Vagrantfile
 	cp $BOOT_SCRIPT /vagrant/$1
 	cp $UPDATE_SCRIPT /vagrant/$1
+	cp $INSTALL_SCRIPT /vagrant/$1
 	cp $MAC_SCRIPT /vagrant/$1
 	cd /vagrant/$1
 	vagrant up
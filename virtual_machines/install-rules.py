@@ -0,0 +1,132 @@
+#!/usr/bin/python3
+
+"""
+This script, to be used by VM 0, installs the rules of a file in the
+virtual switch. Many rules are packed in each batched control frame,
+frames are streamed on a raw socket with up to WINDOW of them waiting
+for their ack, and unacked frames are sent again. The switch acks the
+copies of a frame it already applied without applying them again; the
+sequence numbers start at a random value so that they differ from those
+of the previous runs.
+
+Each line of the file holds the arguments of update-matching-table for
+one rule, or "del vm_id rule_id". Empty lines and lines starting with #
+are skipped.
+"""
+
+import importlib.util
+import os
+import random
+import select
+import socket
+import struct
+import sys
+import time
+
+# Rule messages are built by update-matching-table.py, next to this script
+spec = importlib.util.spec_from_file_location("update_matching_table",
+        os.path.join(os.path.dirname(os.path.realpath(__file__)), "update-matching-table.py"))
+update_matching_table = importlib.util.module_from_spec(spec)
+spec.loader.exec_module(update_matching_table)
+
+ETHER_TYPE_BATCH = 0xbebf
+MAX_FRAME_PAYLOAD = 1500
+WINDOW = 32 # frames waiting for their ack
+TIMEOUT = 0.5 # seconds before a frame is sent again
+MAX_RETRIES = 5
+
+ACK_STATUS = ["ok", "partial", "malformed", "bad version"]
+
+def read_ops(path):
+    """ Operations of a rules file: list of (op, data, line number) """
+    ops = []
+    with open(path) as rules:
+        for (line_number, line) in enumerate(rules, 1):
+            args = line.split()
+            if len(args) == 0 or args[0].startswith("#"):
+                continue
+            try:
+                if args[0] == "del":
+                    ops.append((2, bytes([int(args[1]), int(args[2])]), line_number))
+                else:
+                    ops.append((1, update_matching_table.parse_rule(args), line_number))
+            except (ValueError, IndexError) as e:
+                print("%s:%u: %s" % (path, line_number, e))
+                sys.exit(-1)
+    return ops
+
+def split_batches(ops):
+    """ Groups the operations in batches that fit in a frame """
+    batches = [[]]
+    size = 6
+    for op in ops:
+        op_size = 4 + len(op[1])
+        if size + op_size > MAX_FRAME_PAYLOAD and len(batches[-1]) > 0:
+            batches.append([])
+            size = 6
+        batches[-1].append(op)
+        size += op_size
+    return [batch for batch in batches if len(batch) > 0]
+
+if len(sys.argv) < 2:
+    print("Usage: %s rules_file [interface]" % sys.argv[0])
+    sys.exit(-1)
+
+batches = split_batches(read_ops(sys.argv[1]))
+iface = sys.argv[2] if len(sys.argv) > 2 else "eth1"
+
+sock = socket.socket(socket.AF_PACKET, socket.SOCK_RAW, socket.htons(ETHER_TYPE_BATCH))
+sock.bind((iface, 0))
+header = b"\xff" * 6 + sock.getsockname()[4][:6] + struct.pack(">H", ETHER_TYPE_BATCH)
+
+# seq -> [batch index, frame, send time, retries]
+pending = {}
+next_batch = 0
+first_seq = random.randrange(65536)
+n_applied = 0
+n_failed = 0
+start = time.time()
+
+def handle_ack(ack):
+    global n_applied, n_failed
+    if len(ack) < 12:
+        return
+    (version, flags, seq, n_ops, status, n_batch_applied, n_batch_failed) = struct.unpack_from("<BBHHBxHH", ack)
+    if not (flags & 1) or seq not in pending:
+        return
+    batch = batches[pending.pop(seq)[0]]
+    n_applied += n_batch_applied
+    n_failed += n_ops - n_batch_applied
+    if status != 0:
+        print("Frame %u: %s, %u/%u operations applied" % (seq, ACK_STATUS[status] if status < len(ACK_STATUS) else status, n_batch_applied, n_ops))
+        for i in range(min(n_batch_failed, (len(ack) - 12) // 2)):
+            (index,) = struct.unpack_from("<H", ack, 12 + 2 * i)
+            print("Failed: %s line %u" % (sys.argv[1], batch[index][2]))
+
+while next_batch < len(batches) or len(pending) > 0:
+    # Fill the window
+    while next_batch < len(batches) and len(pending) < WINDOW:
+        seq = (first_seq + next_batch) % 65536
+        frame = header + update_matching_table.batch_frame(seq, [(op, data) for (op, data, _) in batches[next_batch]])
+        sock.send(frame)
+        pending[seq] = [next_batch, frame, time.time(), 0]
+        next_batch += 1
+
+    # Collect an ack, the lost frames are sent again even while others are acked
+    if len(select.select([sock], [], [], TIMEOUT / 10)[0]) > 0:
+        handle_ack(sock.recv(65536)[14:])
+
+    # Send again the frames without ack
+    now = time.time()
+    for (seq, entry) in pending.items():
+        if now - entry[2] < TIMEOUT:
+            continue
+        if entry[3] == MAX_RETRIES:
+            print("No ack from the virtual switch")
+            sys.exit(-1)
+        sock.send(entry[1])
+        entry[2] = now
+        entry[3] += 1
+
+print("%u operations applied, %u failed, in %.3f s" % (n_applied, n_failed, time.time() - start))
+sys.exit(0 if n_failed == 0 else -1)
@@ -9,6 +9,10 @@ Author: Amaury Van Bemten <amaury.van-bemten@tum.de>
 """
 
 from scapy.all import *
+import ipaddress
+import random
+import socket
+import struct
 import sys
 
 # import scapy config
@@ -16,14 +20,51 @@ from scapy.all import conf as scapyconf
 # disable scapy promiscuous mode since it is already in this mode
 scapyconf.sniff_promisc = 0
 
-def update_matching_rule(kni_id, rule_id, protocol, source_ip, destination_ip, source_port, destination_port, tags, rate_bps, burst_bits):
+# Management socket of the virtual switch (--mgmt-socket), used instead of the control frames
+mgmt_socket = None
+
+def mgmt_request(op, data):
+    """ Sends a request on the management socket, returns (status, reply data) """
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+    sock.connect(mgmt_socket)
+    sock.send(struct.pack("<BBH", op, 0, len(data)) + bytes(data))
+    reply = sock.recv(65536)
+    sock.close()
+    (status, length) = struct.unpack_from("<iI", reply)
+    return (status, reply[8:8 + length])
+
+def print_rules(data):
+    """ Prints the rules listed by the virtual switch, as SET_RULE requests """
+    offset = 0
+    while offset < len(data):
+        (_, _, length) = struct.unpack_from("<BBH", data, offset)
+        rule = data[offset + 4:offset + 4 + length]
+        (protocol, source_ip, destination_ip) = struct.unpack_from("<B3x4s4s", rule, 2)
+        (source_port, destination_port) = struct.unpack_from(">HH", rule, 14)
+        (rate_bps, burst_bits) = struct.unpack_from("<QQ", rule, 18)
+        (n_tags,) = struct.unpack_from("<H", rule, 50)
+        tags = [struct.unpack_from(">H", rule, 54 + 4 * i)[0] for i in range(n_tags)]
+        extended = " (extended)" if length > 52 + 4 * n_tags else ""
+        print("vm %u rule %u: %u %s %s %u %u tags %s rate %u burst %u%s" % (rule[0], rule[1], protocol,
+            ipaddress.IPv4Address(source_ip), ipaddress.IPv4Address(destination_ip), source_port, destination_port,
+            ",".join(str(tag) for tag in tags), rate_bps, burst_bits, extended))
+        offset += 4 + length
+
+def print_stats(data):
+    """ Prints the device statistics of the virtual switch """
+    for offset in range(0, len(data), 88):
+        fields = struct.unpack_from("<IHHH6s9Q", data, offset)
+        print("vid %u vlan %u tx_core %u rx_core %u mac %s rx %u/%u tx %u/%u tagged %u dropped %u vm_dropped %u paced %u pacing_dropped %u" %
+            (fields[:4] + (":".join("%02x" % b for b in fields[4]),) + fields[5:]))
+
+def rule_payload(kni_id, rule_id, protocol, source_ip, destination_ip, source_port, destination_port, tags, rate_bps, burst_bits, wildcard=None, ipv6=None, meter=None, aggregate=False):
+    """ Rule message of a rule, as carried by the control frames """
     payload = list(kni_id.to_bytes(1, byteorder = 'big'))
     payload += list(rule_id.to_bytes(1, byteorder = 'big'))
     payload += list(protocol.to_bytes(1, byteorder = 'big'))
     payload += list(int(0).to_bytes(3, byteorder = 'big'))
     if len(source_ip) != 4 or len(destination_ip) != 4:
-        print("Source and destination IPs should be arrays of size 4")
-        sys.exit(-1)
+        raise ValueError("Source and destination IPs should be arrays of size 4")
     for ip_elem in list(source_ip) + list(destination_ip):
         payload += list(ip_elem.to_bytes(1, byteorder = 'big'))
     payload += list(source_port.to_bytes(2, byteorder = 'big'))
@@ -38,33 +79,167 @@ def update_matching_rule(kni_id, rule_id, protocol, source_ip, destination_ip, s
     for tag in tags:
         payload += list(0x8100.to_bytes(2, byteorder = 'big'))
         payload += list(tag.to_bytes(2, byteorder = 'big'))
+    if wildcard is not None:
+        # wildcard extension: type, prefix lengths, any protocol, max ports, priority
+        (source_prefix, destination_prefix, any_protocol, source_port_max, destination_port_max, priority) = wildcard
+        payload += list(int(1).to_bytes(1, byteorder = 'big'))
+        payload += list(source_prefix.to_bytes(1, byteorder = 'big'))
+        payload += list(destination_prefix.to_bytes(1, byteorder = 'big'))
+        payload += list(int(any_protocol).to_bytes(1, byteorder = 'big'))
+        payload += list(source_port_max.to_bytes(2, byteorder = 'big'))
+        payload += list(destination_port_max.to_bytes(2, byteorder = 'big'))
+        payload += list(priority.to_bytes(4, byteorder = 'little'))
+    elif ipv6 is not None:
+        # IPv6 extension: type, source and destination addresses
+        (source_ip6, destination_ip6) = ipv6
+        payload += list(int(2).to_bytes(1, byteorder = 'big'))
+        payload += list(source_ip6.packed)
+        payload += list(destination_ip6.packed)
+    if meter is not None:
+        # meter extension: type, algorithm (1 srTCM, 2 trTCM), peak rate, peak/excess burst
+        (algorithm, peak_rate_bps, peak_burst_bits) = meter
+        payload += list(int(3).to_bytes(1, byteorder = 'big'))
+        payload += list(algorithm.to_bytes(1, byteorder = 'big'))
+        payload += list(peak_rate_bps.to_bytes(8, byteorder = 'little'))
+        payload += list(peak_burst_bits.to_bytes(8, byteorder = 'little'))
+
+    if aggregate:
+        # aggregate extension: the message configures the bucket of the whole VM
+        payload += list(int(4).to_bytes(1, byteorder = 'big'))
+    return bytes(payload)
+
+def batch_frame(seq, ops):
+    """ Payload of a batched control frame, ops being (op, data) pairs: (1, rule message) or (2, [vm_id, rule_id]) """
+    frame = struct.pack("<BBHH", 1, 0, seq, len(ops))
+    for (op, data) in ops:
+        frame += struct.pack("<BBH", op, 0, len(data)) + bytes(data)
+    return frame
+
+def send_payload(payload):
+    """ Sends a rule message to the virtual switch """
+    if mgmt_socket is not None:
+        (status, _) = mgmt_request(1, payload)
+        if status != 0:
+            print("The virtual switch rejected the rule")
+            sys.exit(-1)
+        return
 
     frame = Ether(type=0xbebe) / Raw(payload)
     frame.show()
     sendp(frame, iface="eth1")
 
+def update_matching_rule(*args, **kwargs):
+    send_payload(rule_payload(*args, **kwargs))
+
 def clean_table():
-    for kni_id in range(0, 20):
-        for rule_id in range(0, 5):
-            update_matching_rule(kni_id, rule_id, 0, [0, 0, 0, 0], [0, 0, 0, 0], 0, 0, [0, 0, 0, 0, 0])
-
-if len(sys.argv) < 11:
-    print("Need at least 10 parameters")
-    sys.exit(-1)
-
-kni_id = int(sys.argv[1])
-rule_id = int(sys.argv[2])
-protocol = int(sys.argv[3])
-source_ip = [int(elem) for elem in sys.argv[4].split(".")]
-destination_ip = [int(elem) for elem in sys.argv[5].split(".")]
-source_port = int(sys.argv[6])
-destination_port = int(sys.argv[7])
-tags = [int(elem) for elem in sys.argv[8].split(",")]
-rate_bps = int(sys.argv[9])
-burst_bits = int(sys.argv[10])
-
-if(len(tags) > 10):
-    print("At most 10 tags are allowed in the current implementation")
-    sys.exit(-1)
-
-update_matching_rule(kni_id, rule_id, protocol, source_ip, destination_ip, source_port, destination_port, tags, rate_bps, burst_bits)
+    ops = [(2, [kni_id, rule_id]) for kni_id in range(0, 20) for rule_id in range(0, 5)]
+    # The switch only acks a frame it already applied, the seq makes it a new one
+    sendp(Ether(type=0xbebf) / Raw(batch_frame(random.randrange(65536), ops)), iface="eth1")
+
+def parse_prefix(arg):
+    """ 'a.b.c.d' or 'a.b.c.d/len' -> (list of 4 bytes, prefix length) """
+    (ip, _, length) = arg.partition("/")
+    return ([int(elem) for elem in ip.split(".")], int(length) if length else 32)
+
+def is_ipv6(arg):
+    return ":" in arg
+
+def parse_port_range(arg):
+    """ 'port', 'min-max' or '*' -> (min, max) """
+    if arg == "*":
+        return (0, 65535)
+    (port_min, _, port_max) = arg.partition("-")
+    (port_min, port_max) = (int(port_min), int(port_max) if port_max else int(port_min))
+    if port_max < port_min:
+        raise ValueError("Empty port range " + arg)
+    return (port_min, port_max)
+
+USAGE = ("vm_id rule_id protocol|* src_ip[/len]|src_ip6 dst_ip[/len]|dst_ip6 sport[-max]|* dport[-max]|* tags rate_bps burst_bits [priority] [--srtcm ebs_bits | --trtcm pir_bps pbs_bits]\n"
+        "--aggregate vm_id rate_bps burst_bits [--srtcm ebs_bits | --trtcm pir_bps pbs_bits]")
+
+def parse_rule(args):
+    """ Rule message of a rule given as command line arguments, raises ValueError if they are invalid """
+    args = list(args)
+
+    # Optional meter: srTCM with an excess burst, or trTCM with a peak rate and burst
+    meter = None
+    if "--srtcm" in args:
+        i = args.index("--srtcm")
+        meter = (1, 0, int(args[i + 1]))
+        del args[i:i + 2]
+    elif "--trtcm" in args:
+        i = args.index("--trtcm")
+        meter = (2, int(args[i + 1]), int(args[i + 2]))
+        del args[i:i + 3]
+
+    # Aggregate bucket of a VM, above the buckets of its rules, disabled by a rate and burst of 0
+    if len(args) > 0 and args[0] == "--aggregate":
+        if len(args) < 4:
+            raise ValueError("Need a VM ID, a rate and a burst for an aggregate bucket")
+        return rule_payload(int(args[1]), 0, 0, [0, 0, 0, 0], [0, 0, 0, 0], 0, 0, [], int(args[2]), int(args[3]), meter=meter, aggregate=True)
+
+    if len(args) < 10:
+        raise ValueError("Need at least 10 parameters")
+
+    kni_id = int(args[0])
+    rule_id = int(args[1])
+    any_protocol = args[2] == "*"
+    protocol = 0 if any_protocol else int(args[2])
+    ipv6 = None
+    if is_ipv6(args[3]) or is_ipv6(args[4]):
+        # IPv6 rules are exact rules, the IPv4 addresses of the message are unused
+        ipv6 = (ipaddress.IPv6Address(args[3]), ipaddress.IPv6Address(args[4]))
+        (source_ip, source_prefix) = ([0, 0, 0, 0], 32)
+        (destination_ip, destination_prefix) = ([0, 0, 0, 0], 32)
+    else:
+        (source_ip, source_prefix) = parse_prefix(args[3])
+        (destination_ip, destination_prefix) = parse_prefix(args[4])
+    (source_port, source_port_max) = parse_port_range(args[5])
+    (destination_port, destination_port_max) = parse_port_range(args[6])
+    tags = [int(elem) for elem in args[7].split(",")]
+    rate_bps = int(args[8])
+    burst_bits = int(args[9])
+    priority = int(args[10]) if len(args) > 10 else 0
+
+    # Rules with a prefix, a port range, any protocol or a priority are wildcard rules
+    wildcard = None
+    if any_protocol or source_prefix != 32 or destination_prefix != 32 or source_port != source_port_max or destination_port != destination_port_max or len(args) > 10:
+        wildcard = (source_prefix, destination_prefix, any_protocol, source_port_max, destination_port_max, priority)
+
+    if wildcard is not None and ipv6 is not None:
+        raise ValueError("IPv6 rules cannot be wildcard rules")
+
+    if(len(tags) > 10):
+        raise ValueError("At most 10 tags are allowed in the current implementation")
+
+    return rule_payload(kni_id, rule_id, protocol, source_ip, destination_ip, source_port, destination_port, tags, rate_bps, burst_bits, wildcard, ipv6, meter)
+
+if __name__ == "__main__":
+    args = list(sys.argv)
+
+    # Requests sent to the management socket of the virtual switch instead of VM 0
+    if "--mgmt-socket" in args:
+        i = args.index("--mgmt-socket")
+        mgmt_socket = args[i + 1]
+        del args[i:i + 2]
+
+    if mgmt_socket is not None and len(args) > 1 and args[1] in ("--list", "--stats", "--delete"):
+        if args[1] == "--list":
+            (status, data) = mgmt_request(3, [int(args[2])])
+            print_rules(data)
+        elif args[1] == "--stats":
+            (status, data) = mgmt_request(4, [])
+            print_stats(data)
+        else:
+            (status, data) = mgmt_request(2, [int(args[2]), int(args[3])])
+        sys.exit(0 if status == 0 else -1)
+
+    try:
+        payload = parse_rule(args[1:])
+    except ValueError as e:
+        for line in USAGE.split("\n") + ["--mgmt-socket path --list vm_id | --stats | --delete vm_id rule_id"]:
+            print("Usage: %s %s" % (args[0], line))
+        print("--mgmt-socket path sends the rule to the management socket of the virtual switch")
+        print(e)
+        sys.exit(-1)
+    send_payload(payload)
@@ -7,10 +7,12 @@
 # Up the main interface
 ip link set dev eth1 up
 
-# If control VM, install the update script
+# If control VM, install the update scripts
 if hostname | grep -qE "00$"; then
 	chmod +x /home/vagrant/update-matching-table.py
 	ln -s /home/vagrant/update-matching-table.py /usr/bin/update-matching-table
+	chmod +x /home/vagrant/install-rules.py
+	ln -s /home/vagrant/install-rules.py /usr/bin/install-rules
 fi
 
 # Allocate huge pages
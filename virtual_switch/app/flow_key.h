@@ -0,0 +1,126 @@
+/**
+ * Key of the matching table and its layout as input of the wildcard
+ * classifier, shared with the tests.
+ */
+#ifndef _FLOW_KEY_H_
+#define _FLOW_KEY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <rte_acl.h>
+#include <rte_byteorder.h>
+
+/*
+ * Key of the matching table. IPs and ports are kept in network order
+ * and in header order so that they can be copied straight from packets.
+ * The layout also serves as input of the wildcard classifier, which reads
+ * every field as (part of) an aligned 4-byte word.
+ */
+#define FLOW_KEY_WORDS 4
+struct flow_key {
+	union {
+		struct {
+			uint16_t vlan_tag; /* identifies the vHost the rule belongs to */
+			uint8_t protocol;
+			uint8_t pad; /* always 0, part of the hashed key */
+			uint32_t src_ip;
+			uint32_t dst_ip;
+			uint16_t src_port;
+			uint16_t dst_port;
+		};
+		/* The key as 32-bit words, for the vector compares */
+		uint32_t words[FLOW_KEY_WORDS];
+	};
+};
+
+/*
+ * Fields of the wildcard classifier. Its first input is one byte, the
+ * protocol, and every following input is a 4-byte word of the key: the
+ * VLAN tag is matched as the word it shares with the protocol and pad
+ * bytes, the pad being 0 and the protocol left out by the mask.
+ */
+enum {
+	ACL_FIELD_PROTO,
+	ACL_FIELD_VLAN,
+	ACL_FIELD_SRC,
+	ACL_FIELD_DST,
+	ACL_FIELD_SRCP,
+	ACL_FIELD_DSTP,
+	ACL_NUM_FIELDS
+};
+
+static struct rte_acl_field_def acl_field_defs[ACL_NUM_FIELDS] = {
+	{
+		.type = RTE_ACL_FIELD_TYPE_BITMASK,
+		.size = sizeof(uint8_t),
+		.field_index = ACL_FIELD_PROTO,
+		.input_index = 0,
+		.offset = offsetof(struct flow_key, protocol),
+	},
+	{
+		.type = RTE_ACL_FIELD_TYPE_BITMASK,
+		.size = sizeof(uint32_t),
+		.field_index = ACL_FIELD_VLAN,
+		.input_index = 1,
+		.offset = offsetof(struct flow_key, vlan_tag),
+	},
+	{
+		.type = RTE_ACL_FIELD_TYPE_MASK,
+		.size = sizeof(uint32_t),
+		.field_index = ACL_FIELD_SRC,
+		.input_index = 2,
+		.offset = offsetof(struct flow_key, src_ip),
+	},
+	{
+		.type = RTE_ACL_FIELD_TYPE_MASK,
+		.size = sizeof(uint32_t),
+		.field_index = ACL_FIELD_DST,
+		.input_index = 3,
+		.offset = offsetof(struct flow_key, dst_ip),
+	},
+	{
+		.type = RTE_ACL_FIELD_TYPE_RANGE,
+		.size = sizeof(uint16_t),
+		.field_index = ACL_FIELD_SRCP,
+		.input_index = 4,
+		.offset = offsetof(struct flow_key, src_port),
+	},
+	{
+		.type = RTE_ACL_FIELD_TYPE_RANGE,
+		.size = sizeof(uint16_t),
+		.field_index = ACL_FIELD_DSTP,
+		.input_index = 4,
+		.offset = offsetof(struct flow_key, dst_port),
+	},
+};
+
+RTE_ACL_RULE_DEF(acl_rule, ACL_NUM_FIELDS);
+
+/* Mask of the VLAN tag in the word of the ACL_FIELD_VLAN input */
+#define ACL_VLAN_MASK UINT32_C(0xffff0000)
+
+/*
+ * Fills the fields of a wildcard rule matching the packets of key, with
+ * the given prefixes and port ranges. The port maximums are in network
+ * order like the key, the classifier reads the key in network order.
+ */
+static inline void
+acl_rule_set_fields(struct acl_rule *rule, const struct flow_key *key, int any_protocol,
+		uint8_t src_prefix_len, uint8_t dst_prefix_len, uint16_t src_port_max, uint16_t dst_port_max)
+{
+	rule->field[ACL_FIELD_PROTO].value.u8 = key->protocol;
+	rule->field[ACL_FIELD_PROTO].mask_range.u8 = any_protocol ? 0 : UINT8_MAX;
+	rule->field[ACL_FIELD_VLAN].value.u32 = (uint32_t) rte_be_to_cpu_16(key->vlan_tag) << 16;
+	rule->field[ACL_FIELD_VLAN].mask_range.u32 = ACL_VLAN_MASK;
+	rule->field[ACL_FIELD_SRC].value.u32 = rte_be_to_cpu_32(key->src_ip);
+	rule->field[ACL_FIELD_SRC].mask_range.u32 = RTE_MIN(src_prefix_len, 32);
+	rule->field[ACL_FIELD_DST].value.u32 = rte_be_to_cpu_32(key->dst_ip);
+	rule->field[ACL_FIELD_DST].mask_range.u32 = RTE_MIN(dst_prefix_len, 32);
+	rule->field[ACL_FIELD_SRCP].value.u16 = rte_be_to_cpu_16(key->src_port);
+	rule->field[ACL_FIELD_SRCP].mask_range.u16 = rte_be_to_cpu_16(src_port_max);
+	rule->field[ACL_FIELD_DSTP].value.u16 = rte_be_to_cpu_16(key->dst_port);
+	rule->field[ACL_FIELD_DSTP].mask_range.u16 = rte_be_to_cpu_16(dst_port_max);
+}
+
+#endif /* _FLOW_KEY_H_ */
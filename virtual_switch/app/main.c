@@ -14,9 +14,14 @@
 #include <linux/virtio_ring.h>
 #include <signal.h>
 #include <stdint.h>
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <stdbool.h>
 
 #include <rte_atomic.h>
@@ -30,6 +35,21 @@
 #include <rte_ip.h>
 #include <rte_tcp.h>
 #include <rte_pause.h>
+#include <rte_hash.h>
+#include <rte_hash_crc.h>
+#include <rte_acl.h>
+#include <rte_spinlock.h>
+#include <rte_prefetch.h>
+#include <rte_vect.h>
+#include <rte_net.h>
+#include <rte_meter.h>
+#include <rte_gso.h>
+#include <rte_rcu_qsbr.h>
+#include <rte_ring.h>
+#include <rte_interrupts.h>
+
+#include "flow_key.h"
+#include "shaper.h"
 
 /* Macros for printing using RTE_LOG */
 #define RTE_LOGTYPE_VHOST_CONFIG RTE_LOGTYPE_USER1
@@ -46,8 +66,15 @@ enum {
 	VIRTIO_QNUM
 };
 
-/* five-tuple matching entries per vHost */
-#define N_ENTRIES_PER_VHOST 3
+/* Rule IDs the control VM can address per vHost (the rule ID is one byte) */
+#define N_RULE_IDS_PER_VHOST 256
+
+/* Default number of rules in the matching table (--max-rules) */
+#define DEFAULT_MAX_RULES 4096
+#define MAX_RULES_LIMIT (1 << 24)
+
+/* Default number of wildcard rules (--max-wildcard-rules) */
+#define DEFAULT_MAX_WILDCARD_RULES 1024
 
 /* Max number of VLAN tags to push */
 #define N_TAGS 10
@@ -57,8 +84,8 @@ struct vlan_hdr {
     uint16_t vlan_id;
 };
 
-/* Structure of a matching table entry */
-struct tagging_entry {
+/* Rule as sent by the control VM (layout used by update-matching-table.py) */
+struct rule_msg {
 	uint8_t protocol;
 	uint32_t src_ip;
 	uint32_t dst_ip;
@@ -66,24 +93,334 @@ struct tagging_entry {
 	uint16_t dst_port;
 	uint64_t rate_bps; /* rate in bps */
 	uint64_t burst_bits; /* burst in bits  */
-	uint64_t n_tokens; /* tokens are actually burst * cpu_frequency */
-	uint64_t last_tsc; /* timer - type of rte_rdtsc() */
+	uint64_t n_tokens; /* initial tokens, in bits */
+	uint64_t last_tsc; /* overwritten on installation */
+	uint16_t n_tags;
+	struct vlan_hdr tags[N_TAGS];
+};
+
+/*
+ * Optional extension following the tags of a rule message, turning the
+ * rule into a wildcard rule. Ports are in network order like in the
+ * rule message, the priority is little endian like the rate.
+ */
+#define RULE_EXT_WILDCARD 0x01
+struct rule_msg_ext {
+	uint8_t type; /* RULE_EXT_WILDCARD */
+	uint8_t src_prefix_len; /* 0 (any) to 32 (exact) */
+	uint8_t dst_prefix_len; /* 0 (any) to 32 (exact) */
+	uint8_t any_protocol; /* 1 to match both TCP and UDP */
+	uint16_t src_port_max; /* source ports from src_port to src_port_max match */
+	uint16_t dst_port_max; /* destination ports from dst_port to dst_port_max match */
+	uint32_t priority; /* the highest priority wins among wildcard rules */
+} __attribute__((packed));
+
+/*
+ * Optional extension following the tags of a rule message, turning the
+ * rule into an IPv6 rule. The IPv4 addresses of the message are ignored.
+ */
+#define RULE_EXT_IPV6 0x02
+struct rule_msg_ext6 {
+	uint8_t type; /* RULE_EXT_IPV6 */
+	uint8_t src_ip[16];
+	uint8_t dst_ip[16];
+} __attribute__((packed));
+
+/*
+ * Optional extension following the tags of a rule message, selecting the
+ * shaping algorithm of the rule (token bucket without it). Little endian
+ * like the rate.
+ */
+#define RULE_EXT_METER 0x03
+struct rule_msg_ext_meter {
+	uint8_t type; /* RULE_EXT_METER */
+	uint8_t algorithm; /* enum shaper_algo */
+	uint64_t peak_rate_bps; /* trTCM peak rate */
+	uint64_t peak_burst_bits; /* srTCM excess burst, trTCM peak burst */
+} __attribute__((packed));
+
+/*
+ * Optional extension following the tags of a rule message, turning the
+ * message into the configuration of the aggregate bucket of the VM: its
+ * rate and burst (0 to disable it), with the meter extension if any. The
+ * five-tuple, rule ID and tags are ignored.
+ */
+#define RULE_EXT_AGGREGATE 0x04
+struct rule_msg_ext_aggregate {
+	uint8_t type; /* RULE_EXT_AGGREGATE */
+} __attribute__((packed));
+
+/*
+ * Management socket (--mgmt-socket): a SOCK_SEQPACKET Unix socket served
+ * by the main lcore, one request per message and one reply per request.
+ * The header fields are in host order, the rule messages are the payload
+ * of the control frames: pool, rule ID, rule message and extensions.
+ */
+#define MGMT_MAX_MSG 65536
+#define MGMT_MAX_CLIENTS 16
+
+#define MGMT_OP_SET_RULE	1 /* adds or modifies a rule, data is a rule message */
+#define MGMT_OP_DEL_RULE	2 /* data is the pool and the rule ID */
+#define MGMT_OP_LIST_RULES	3 /* data is the pool, replies a SET_RULE request per rule */
+#define MGMT_OP_STATS		4 /* replies a struct mgmt_dev_stats per device */
+#define MGMT_OP_BULK		5 /* data is a sequence of SET_RULE/DEL_RULE requests */
+
+struct mgmt_req {
+	uint8_t op;
+	uint8_t pad;
+	uint16_t len; /* of data */
+	uint8_t data[];
+} __attribute__((packed));
+
+struct mgmt_reply {
+	int32_t status; /* 0 on success, -1 on failure */
+	uint32_t len; /* of data */
+	uint8_t data[];
+} __attribute__((packed));
+
+/*
+ * Batched control frames of the control VM: a struct ctrl_hdr then n_ops
+ * SET_RULE/DEL_RULE requests laid out as on the management socket, each
+ * one being a TLV. The header fields are little endian like the rate. The
+ * frame is checked as a whole, then its operations are applied in order,
+ * and the switch answers with an ack frame echoing the sequence number.
+ * The single rule frames of ethertype 0xbebe are still accepted, without
+ * ack.
+ */
+#define CTRL_ETHER_TYPE_BATCH 0xbebf
+#define CTRL_BATCH_VERSION 1
+#define CTRL_FLAG_ACK 0x01
+
+struct ctrl_hdr {
+	uint8_t version; /* CTRL_BATCH_VERSION */
+	uint8_t flags; /* CTRL_FLAG_ACK on the replies */
+	uint16_t seq; /* chosen by the control VM, echoed in the ack */
+	uint16_t n_ops;
+	uint8_t ops[];
+} __attribute__((packed));
+
+#define CTRL_ACK_OK		0 /* every operation applied */
+#define CTRL_ACK_PARTIAL	1 /* the failed operations are listed */
+#define CTRL_ACK_MALFORMED	2 /* nothing applied */
+#define CTRL_ACK_BAD_VERSION	3 /* nothing applied, the ack gives the supported version */
+#define CTRL_ACK_MAX_FAILED 64
+
+/* Follows the header of an ack frame */
+struct ctrl_ack {
+	uint8_t status; /* CTRL_ACK_* */
+	uint8_t pad;
+	uint16_t n_applied;
+	uint16_t n_failed;
+	uint16_t failed[]; /* indexes of the first CTRL_ACK_MAX_FAILED failed operations */
+} __attribute__((packed));
+
+struct mgmt_dev_stats {
+	uint32_t vid;
+	uint16_t vlan_tag;
+	uint16_t tx_coreid;
+	uint16_t rx_coreid;
+	uint8_t mac_address[RTE_ETHER_ADDR_LEN];
+	uint64_t rx_total;
+	uint64_t rx_success;
+	uint64_t tx_total;
+	uint64_t tx_success;
+	uint64_t tx_tagged;
+	uint64_t tx_dropped;
+	uint64_t tx_vm_dropped;
+	uint64_t tx_paced;
+	uint64_t tx_pacing_dropped;
+} __attribute__((packed));
+
+/* Key of the IPv6 matching table, same conventions as struct flow_key */
+struct flow_key6 {
+	uint16_t vlan_tag;
+	uint8_t protocol;
+	uint8_t pad;
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint8_t src_ip[16];
+	uint8_t dst_ip[16];
+};
+
+struct tagging_entry;
+struct rte_ether_hdr;
+struct pacing_queue;
+
+/*
+ * Pushes the tag stack of an entry: moves the MACs from the old header
+ * oh to the new one nh and writes the tags in between.
+ */
+typedef void (*tag_writer_t)(struct rte_ether_hdr *nh, const struct rte_ether_hdr *oh,
+		const struct vlan_hdr *tags);
+
+/*
+ * Tags pushed by a rule. A published stack is never modified: a rule
+ * update publishes a new one, so that the data cores read a consistent
+ * stack without locking.
+ */
+struct tag_stack {
 	uint16_t n_tags;
+	uint16_t n_hw_tags; /* outermost tags inserted by the NIC */
+	uint16_t vlan_tci; /* TCIs of the tags inserted by the NIC */
+	uint16_t vlan_tci_outer;
+	uint64_t hw_ol_flags; /* PKT_TX_VLAN/PKT_TX_QINQ for the NIC insertion */
+	tag_writer_t write_tags; /* writer specialized for n_tags - n_hw_tags */
+	/* Template of the pushed headers, written as is after the MACs and
+	 * followed by the ethertype of the packet. Zero padded. */
 	struct vlan_hdr tags[N_TAGS];
 };
 
+/* Structure of a matching table entry */
+struct tagging_entry {
+	struct flow_key key; /* for IPv6 entries, the IPs are 0 */
+	uint8_t rule_id; /* ID given by the control VM */
+	uint8_t wildcard; /* entry of the wildcard classifier, not of the hash */
+	uint8_t ipv6; /* entry of the IPv6 matching table */
+	uint32_t generation; /* changed each time the shaper is replaced or the entry removed */
+	struct pacing_queue *pq; /* queue of the packets waiting for tokens */
+	/* Versions in use, replaced as a whole by rule updates. The data cores
+	 * read each pointer once per packet. stack is NULL until published. */
+	struct tag_stack * volatile stack;
+	struct shaper * volatile shaper;
+};
+
 #define MAX_VIRTIO_DEVICES 64
+/* Maximum VM id, a byte in the rule messages. Only MAX_VIRTIO_DEVICES VMs
+ * fit in the VMDq pools, without --sw-demux. */
+#define MAX_VMS 255
+
+/*
+ * RX queue pairs enabled by the guest of each vhost device id, including
+ * the vring state changes received before the device is added. Only used
+ * by the vhost-user thread. The vhost library has up to 1024 devices.
+ */
+#define MAX_VHOST_VIDS 1024
+static uint32_t vid_rx_enabled[MAX_VHOST_VIDS];
 #define DEBUG_SHAPER 1
+
+/*
+ * Matching table: a cuckoo hash of flow keys. The position returned by
+ * the hash for a key indexes the entry in flow_entries, so that a lookup
+ * costs the same whatever the number of rules.
+ */
+static struct rte_hash *flow_table;
+static struct tagging_entry *flow_entries;
+static uint32_t max_rules = DEFAULT_MAX_RULES;
+
+/* Slots of a matching table. Lock-free tables cannot have extendable buckets
+ * in DPDK 19.08, so they get room for the cuckoo displacements instead. */
+#define FLOW_TABLE_ENTRIES (2 * max_rules)
+
+/* IPv6 matching table, with max_rules entries too */
+static struct rte_hash *flow_table6;
+static struct tagging_entry *flow_entries6;
+
+/*
+ * Wildcard rules (prefixes, port ranges, any protocol) are only looked up
+ * when no exact rule matches. They are compiled into an ACL classifier
+ * whose userdata is the index of the rule in acl_entries plus one.
+ */
+
+/* State of a wildcard rule slot */
+#define ACL_RULE_FREE		0
+#define ACL_RULE_ACTIVE		1
+#define ACL_RULE_DELETED	2 /* may still be matched until the next build */
+
+struct acl_rule_def {
+	uint8_t state;
+	uint32_t deleted_version; /* acl_version in which it was deleted */
+	struct acl_rule rule;
+};
+
+static struct tagging_entry *acl_entries;
+static struct acl_rule_def *acl_defs;
+static uint32_t *acl_free_list;
+static uint32_t acl_n_free;
+static uint32_t max_acl_rules = DEFAULT_MAX_WILDCARD_RULES;
+/* Protects acl_defs, acl_free_list and acl_version */
+static rte_spinlock_t acl_lock = RTE_SPINLOCK_INITIALIZER;
+/* Incremented on each change of the wildcard rules */
+static volatile uint32_t acl_version;
+/* Classifier in use by the data cores, NULL if there is no wildcard rule */
+static struct rte_acl_ctx * volatile acl_ctx;
+
+/*
+ * Incremented whenever a rule is added or removed, or the wildcard
+ * classifier is swapped. Flow cache entries filled with an older version
+ * are invalid. Starts at 1 so that zeroed cache entries are invalid.
+ */
+static volatile uint32_t rules_version = 1;
+
+/*
+ * Rule installed by the control VM for a given pool (first dimension)
+ * and rule ID (second dimension), NULL if none.
+ */
+static struct tagging_entry *rule_slots[MAX_VMS + 1][N_RULE_IDS_PER_VHOST]; // +1 for the 0 entry unused by the control VM
+
 /*
- * First dimension: pool id (corresponds to a device)
- * Second dimension: a list of five-tuple matchings for each vHost
+ * Free tag stacks and shapers. A version replaced by a rule update, or a
+ * matching table slot of a removed rule, is retired with the QSBR token
+ * of the update, and only recycled once every data core has reported a
+ * quiescent state since. Only the core updating the rules uses them.
  */
-static struct tagging_entry matching_table[MAX_VIRTIO_DEVICES + 1][N_ENTRIES_PER_VHOST]; // +1 for the 0 entry unused by the control VM
-static uint64_t cpu_freq = 0;
+struct version_pool {
+	void **free;
+	uint32_t n_free;
+};
+static struct version_pool stack_pool;
+static struct version_pool shaper_pool;
+/* Spare versions beyond one stack and one shaper per entry */
+#define VERSION_POOL_SLACK 4096
+
+#define RETIRED_STACK	0
+#define RETIRED_SHAPER	1
+#define RETIRED_SLOT	2 /* slot of flow_entries */
+#define RETIRED_SLOT6	3 /* slot of flow_entries6 */
+
+struct retired_version {
+	uint64_t token;
+	uint8_t type;
+	void *ptr;
+};
+/* FIFO of the retired versions, in token order */
+static struct retired_version *retired;
+static uint32_t retired_size;
+static uint32_t retired_head;
+static uint32_t retired_len;
+
+/*
+ * Aggregate bucket of each VM, indexed by vlan_tag like rule_slots, NULL
+ * if none: the packets that pass the bucket of their rule must also pass
+ * it. Only used by the TX core of the VM. A new bucket is a new version
+ * from shaper_pool, the old one is retired like those of the rules.
+ */
+static struct shaper * volatile vm_shapers[MAX_VMS + 1];
 
 /* Max burst size for RX/TX */
 #define MAX_PKT_BURST 32
 
+/* Number of packets prefetched ahead when parsing a burst */
+#define PREFETCH_OFFSET 4
+
+/*
+ * Max number of distinct flows of a burst found by vector compares.
+ * The packets of a flow found this way are matched with a single lookup,
+ * the others are looked up one by one.
+ */
+#define MAX_BURST_FLOWS 4
+
+/*
+ * Keys of a burst in structure-of-arrays layout: words[w][i] is the
+ * 32-bit word w of the key of packet i.
+ */
+struct burst_keys {
+	uint32_t words[FLOW_KEY_WORDS][MAX_PKT_BURST] __rte_aligned(32);
+	/* Bitmask of the packets that have a key (TCP/UDP over IPv4) */
+	uint32_t valid;
+	/* Bitmask of the TCP/UDP over IPv6 packets, classified separately */
+	uint32_t ipv6;
+};
+
 /* Device statistics */
 struct device_statistics {
 	/* Number of packets received from vHost */
@@ -95,33 +432,97 @@ struct device_statistics {
 	/* Number of packets dropped by shaper */
 	uint64_t 	tx_dropped;
 
+	/* Number of packets dropped by the aggregate bucket of the VM */
+	uint64_t	tx_vm_dropped;
+
+	/* Number of packets queued by the pacer, and dropped from its queues */
+	uint64_t	tx_paced;
+	uint64_t	tx_pacing_dropped;
+
 	/* Number of packets received from vHost and forwarded */
 	uint64_t	tx_success;
+
+	/* Number of packets forwarded to a VM of the host, without the NIC */
+	uint64_t	tx_local;
+
+	/* Number of TSO packets dropped because they could not be segmented */
+	uint64_t	tx_gso_dropped;
 	
 	/* Number of packets received in the RX queue of vHost */
 	rte_atomic64_t	rx_total_atomic;
 	/* Number of packets transmitted to vHost */
 	rte_atomic64_t	rx_success_atomic;
+	/* Number of packets held while the virtio RX queue was full, and
+	 * dropped because it was */
+	rte_atomic64_t	rx_held_atomic;
+	rte_atomic64_t	rx_ring_dropped_atomic;
+};
+
+/* Maximum number of NIC queues of a pool, each feeding a virtio RX queue */
+#define MAX_RXQ_PER_DEVICE 16
+
+/*
+ * Packets a full ring did not take, with --hold-us: they are offered to the
+ * ring again, before the new ones, until the deadline kept in their
+ * timestamp field.
+ */
+#define HOLD_MAX_PKTS (4 * MAX_PKT_BURST)
+#define MAX_HOLD_US 10000
+struct hold_buffer {
+	uint16_t len;
+	struct rte_mbuf *pkts[HOLD_MAX_PKTS];
+};
+
+/* A NIC queue of the pool of a device, drained by a data core */
+struct vhost_rxq {
+	struct vhost_dev *vdev;
+	/* Index of the queue in the pool */
+	uint16_t index;
+	/* Core receiving data for this queue, RTE_MAX_LCORE if none */
+	uint16_t coreid;
+	TAILQ_ENTRY(vhost_rxq) lcore_rxq_entry;
 };
 
+/* Defines "struct vhost_rxq_tailq_list" as a tail queue of "struct vhost_rxq" */
+TAILQ_HEAD(vhost_rxq_tailq_list, vhost_rxq);
+
 /* vHost device representation */
 struct vhost_dev {
 	/* Device MAC address (Obtained on first TX packet) */
 	struct rte_ether_addr mac_address;
 	/* The VMDQ pool_id of the dev */
 	uint16_t pool_id;
-	/* RX VMDQ queue number (could be derived from pool_id) */
+	/* First RX VMDQ queue number of the pool (could be derived from pool_id) */
 	uint16_t vmdq_rx_q;
 	/* Vlan tag assigned to the pool */
 	uint32_t vlan_tag;
 	/* Core sending data for this vdev */
 	uint16_t tx_coreid;
-	/* Core receiving data for this vdev */
-	uint16_t rx_coreid;
+	/* NUMA node of the guest memory, -1 if unknown */
+	int numa_node;
+	/* Queues receiving data for this vdev */
+	struct vhost_rxq rxq[MAX_RXQ_PER_DEVICE];
+	/* Serialize the NIC queues feeding the same virtio RX queue */
+	rte_spinlock_t rx_lock[MAX_RXQ_PER_DEVICE];
+	/* Packets held for each virtio RX queue, NULL without --hold-us */
+	struct hold_buffer *rx_hold;
+	/* Virtio queue pairs, and those the guest enabled for RX */
+	uint16_t nr_qpairs;
+	volatile uint32_t rx_enabled;
 	/* A device is set as ready if the MAC address has been set */
 	volatile uint8_t ready;
 	/* Device is marked for removal from the data core */
 	volatile uint8_t remove;
+	/* Flush request of the pacer of its TX core once removed */
+	uint32_t flush_ticket;
+	/* Device is moved to another TX core, see move_tx_device() */
+#define TX_MOVE_NONE	0
+#define TX_MOVE_REQUEST	1
+#define TX_MOVE_ACK	2
+	volatile uint8_t tx_move;
+	/* TX packets per second, and stats.tx_total when it was sampled */
+	uint64_t tx_pps;
+	uint64_t tx_total_sampled;
 	/* Device id */
 	int vid;
 	/* Device stats */
@@ -129,34 +530,129 @@ struct vhost_dev {
 	/* Defines "next" tail queue elements */
 	TAILQ_ENTRY(vhost_dev) global_vdev_entry; // in the global queue
 	TAILQ_ENTRY(vhost_dev) tx_lcore_vdev_entry; // in the per-TX_lcore queue
-	TAILQ_ENTRY(vhost_dev) rx_lcore_vdev_entry; // in the per-TX_lcore queue
 } __rte_cache_aligned;
 
 /* Defines "struct vhost_dev_tailq_list" as a tail queue of "struct vhost_dev" */
 TAILQ_HEAD(vhost_dev_tailq_list, vhost_dev);
 
+/*
+ * Per-lcore exact-match cache of classification results, consulted before
+ * the matching table: a direct-mapped array indexed by the key hash, small
+ * enough to stay in the L1/L2 cache.
+ */
+#define FLOW_CACHE_ENTRIES 1024 /* must be a power of 2 */
+
+struct flow_cache_entry {
+	struct flow_key key;
+	/* Rule matched by the key, NULL if none */
+	struct tagging_entry *entry;
+	/* Value of rules_version when the entry was filled */
+	uint32_t version;
+};
+
+struct flow_cache {
+	struct flow_cache_entry entries[FLOW_CACHE_ENTRIES];
+	/* Number of packets classified from/not from the cache */
+	uint64_t hits;
+	uint64_t misses;
+};
+
 /* Data core specific information. */
+/*
+ * Pacing: instead of being dropped, the packets that do not conform to the
+ * bucket of their rule wait in a FIFO per rule until enough tokens are
+ * generated. The queues are held on a timer wheel whose slots are ticks of
+ * 2^tick_shift TSC cycles, released by the data core itself.
+ */
+#define PACING_WHEEL_SLOTS 256 /* must be a power of 2 */
+#define PACING_MAX_QUEUES 1024 /* rules with queued packets, per core */
+#define PACING_TICKS_PER_SEC 100000
+#define MAX_PACING_DEPTH 4096
+
+struct pacing_queue {
+	struct pacer *pacer; /* core owning the queue */
+	struct tagging_entry *entry; /* NULL when free */
+	uint32_t generation; /* of the entry when the queue was taken */
+	uint32_t len;
+	struct vhost_dev *vdev;
+	/* Packets, linked through their userdata */
+	struct rte_mbuf *head;
+	struct rte_mbuf *tail;
+	/* In a slot of the wheel, or in the free list */
+	struct pacing_queue *next;
+};
+
+struct pacer {
+	/* Count of the flushes of removed devices requested/done */
+	volatile uint32_t flush_requested;
+	volatile uint32_t flush_done;
+	struct pacing_queue *slots[PACING_WHEEL_SLOTS];
+	uint64_t cur_tick; /* last tick released */
+	uint32_t tick_shift;
+	struct pacing_queue *free;
+	struct pacing_queue queues[PACING_MAX_QUEUES];
+} __rte_cache_aligned;
+
+/*
+ * Adaptive polling: after idle_polls empty polls, a data core arms the RX
+ * interrupts of its NIC queues and the kicks of its virtio TX queues, polls
+ * once more to catch what came in meanwhile, and then sleeps until one of
+ * them fires or max_sleep_ms elapses.
+ */
+#define SLEEP_MAX_FDS 1024 /* armed queues per core, the others are only polled on wake-up */
+#define SLEEP_WAIT_EVENTS 32
+#define MAX_SLEEP_MS 1000
+
+struct lcore_sleep {
+	/* Epoll instance of the current sleep, -1 when not armed */
+	int epfd;
+	/* NIC queues and kick events armed */
+	uint32_t n_rx_intr;
+	uint16_t rx_intr[SLEEP_MAX_FDS];
+	uint32_t n_kicks;
+	struct rte_epoll_event kicks[SLEEP_MAX_FDS];
+	/* Sleeps, ended by an event or by the timeout */
+	uint64_t sleeps;
+	uint64_t woken;
+	uint64_t timeouts;
+	/* Cycles spent asleep, and from the end of a sleep to the next poll */
+	uint64_t slept_cycles;
+	uint64_t wake_cycles;
+	uint64_t wake_cycles_max;
+} __rte_cache_aligned;
+
 struct lcore_info {
-	/* Number of devices handled by the core */
+	/* Number of device queues handled by the core (RX) */
 	uint32_t		device_num;
-	/* Flag to synchronize device removal */
-#define REQUEST_DEV_REMOVAL	1
-#define ACK_DEV_REMOVAL		0
-	volatile uint8_t	dev_removal_flag;
+	/* Number of devices handled by the core (TX) and their packets per second */
+	uint32_t		tx_device_num;
+	uint64_t		tx_pps;
 	/* List of vHost handled by the core (TX) */
 	struct vhost_dev_tailq_list tx_vdev_list;
-	/* List of vHost handled by the core (RX) */
-	struct vhost_dev_tailq_list rx_vdev_list;
+	/* List of vHost queues handled by the core (RX) */
+	struct vhost_rxq_tailq_list rxq_list;
+	/* Classification results of the core */
+	struct flow_cache *flow_cache;
+	/* Packets of the core waiting for tokens, with pacing */
+	struct pacer *pacer;
+	/* Interrupts armed by the core when idle, with adaptive polling */
+	struct lcore_sleep *sleep;
+	/* NIC queue dispatched by the core with --sw-demux, -1 if none, and
+	 * its packets for no VM */
+	int			nic_rxq;
+	uint64_t		rx_unknown;
+	/* VMs for which the core held packets, by VM id */
+	uint64_t		rx_hold_vms[(MAX_VMS + 64) / 64];
 };
 
 
 #define VLAN_HLEN       4
+#define VLAN_DEI        0x1000 /* drop eligible indicator of a TCI */
 
 /* State of virtio device (learning MAC of VM, working data, working control, ready to delete) */
 #define DEVICE_MAC_LEARNING 0
 #define DEVICE_DATA_RX		1
 #define DEVICE_CONTROL		2
-#define DEVICE_SAFE_REMOVE	3
 
 /* Configurable number of RX/TX ring descriptors */
 #define RTE_TEST_TX_DESC_DEFAULT 512 
@@ -167,6 +663,7 @@ struct lcore_info {
 
 /* EtherType reversed so that CPU stores in BE */
 #define BE_RTE_ETHER_TYPE_IPV4 0x0008
+#define BE_RTE_ETHER_TYPE_IPV6 0xDD86
 #define BE_RTE_ETHER_TYPE_VLAN 0x0081
 
 /* Promiscuous mode */
@@ -176,8 +673,32 @@ static uint32_t promiscuous;
 static uint32_t num_queues = 0;
 static uint32_t num_virtio_devices;
 
-/* Mempool for the mbufs (message buffers) used by the applcation */
-static struct rte_mempool *mbuf_pool;
+/*
+ * Mempools for the mbufs (message buffers) used by the applcation, one per
+ * NUMA node with lcores, indexed by socket id: each core allocates from the
+ * mempool of its node.
+ */
+static struct rte_mempool *mbuf_pools[RTE_MAX_NUMA_NODES];
+
+/*
+ * Mempool for the header segments chained in front of the packets that
+ * cannot be modified in place, and for the clones of their payload.
+ * Only created with dequeue zero copy.
+ */
+#define HDR_MBUF_DATA_SIZE 64
+static struct rte_mempool *hdr_pools[RTE_MAX_NUMA_NODES];
+
+/*
+ * Software GSO of the TSO packets of the guests, after their tags are
+ * pushed. The direct mbufs hold the copied headers, the indirect ones the
+ * payload. Only created with --sw-gso.
+ */
+#define GSO_MAX_SEGS 256 /* 64KB in segments of the minimum GSO size */
+#define GSO_MBUFS_PER_CORE 8192
+#define GSO_DIRECT_MBUF_DATA_SIZE 256
+static uint32_t sw_gso;
+static struct rte_mempool *gso_direct_pools[RTE_MAX_NUMA_NODES];
+static struct rte_mempool *gso_indirect_pools[RTE_MAX_NUMA_NODES];
 
 /* Enable TX checksum offload */
 static uint32_t enable_tx_csum = 1;
@@ -185,16 +706,64 @@ static uint32_t enable_tx_csum = 1;
 static int client_mode = 0;
 /* Enable dequeue zero copy */
 static int dequeue_zero_copy;
+/* Let the NIC insert the outermost tags when it can */
+static uint32_t hw_vlan_insert = 1;
+/* VLAN/QinQ insertion offloads enabled on the port */
+static uint64_t vlan_insert_offloads;
 /* Enable tagging */
 static uint32_t do_tag = 1;
 /* Enable shaping */
 static uint32_t do_shape = 1;
+/* Depth of the pacing queue of a rule, 0 drops non conforming packets */
+static uint32_t pacing_depth;
 static int pool_allocation_failure = 0;
 
 /* Socket file paths */
 static char *socket_files;
 static int nb_sockets;
 
+/* Management socket path, none if empty */
+static char mgmt_socket_path[PATH_MAX];
+/* Apply the rule messages of the control VM */
+static uint32_t in_band_control = 1;
+/* Control frames of the control VM, applied by the main lcore */
+static struct rte_ring *ctrl_ring;
+/* Acks of the batched control frames, sent by the TX core of the control VM */
+static struct rte_ring *ack_ring;
+
+/*
+ * Acks of the last batched control frames, by sequence number: the control
+ * VM sends a frame again when its ack is lost, and the copy is only acked
+ * again instead of being applied twice. A copy has the same sequence
+ * number, length and CRC. Only used by the main lcore.
+ */
+#define CTRL_ACK_WINDOW 256
+struct ctrl_ack_entry {
+	uint32_t len; /* of the frame, 0 if the entry is unused */
+	uint32_t crc;
+	uint16_t seq;
+	uint8_t status;
+	uint16_t n_applied;
+	uint16_t n_failed;
+	uint16_t failed[CTRL_ACK_MAX_FAILED];
+};
+static struct ctrl_ack_entry ctrl_acks[CTRL_ACK_WINDOW];
+
+/* Empty polls before a data core sleeps, 0 to always poll */
+static uint32_t idle_polls;
+/* Longest sleep, bounds the wake-up of a core whose interrupt is missed */
+static uint32_t max_sleep_ms = 1;
+/* The NIC raises RX queue interrupts */
+static int rx_intr;
+/* Send the packets for the VMs of the host to their RX queues, untagged */
+static uint32_t local_switch;
+/* Several cores may enqueue into the virtio RX queue of a device */
+static int rx_shared;
+/* Longest wait of the packets held while a ring is full, 0 drops them */
+static uint32_t hold_us;
+static uint64_t hold_cycles;
+#define CTRL_RING_SIZE 1024
+
 /* VMDq configuration structure */
 static struct rte_eth_conf vmdq_conf_default = {
 	.rxmode = {
@@ -236,14 +805,31 @@ static struct rte_eth_conf vmdq_conf_default = {
 static unsigned lcore_ids[RTE_MAX_LCORE];
 static struct lcore_info lcore_info[RTE_MAX_LCORE];
 
+/* Cores draining the virtio TX queues, all the data cores if none is given */
+static uint8_t tx_lcores[RTE_MAX_LCORE];
+static uint32_t nb_tx_lcores;
+/* TX load of a core above which one of its devices is moved, 0 to only
+ * balance the number of devices */
+static uint32_t tx_rebalance_pps;
+#define TX_BALANCE_INTERVAL_US 1000000
+/* Serializes the placement of the devices on the TX cores */
+static rte_spinlock_t tx_balance_lock = RTE_SPINLOCK_INITIALIZER;
+
 /* DPDK port used */ 
 static int32_t used_port_id;
+/* NUMA node of the port */
+static int nic_socket;
 
 /* Port information */
 static uint16_t num_pf_queues, num_vmdq_queues;
 static uint16_t vmdq_pool_base, vmdq_queue_base;
 static uint16_t queues_per_pool;
 
+/* Use the virtio queue pairs of the guests, with RSS in the VMDq pools */
+static uint32_t multiqueue;
+/* NIC queues of its pool drained for a device */
+static uint16_t rxq_per_device = 1;
+
 /* For each pool ID, VLAN tag to use */
 const uint16_t vlan_tags[] = {
 	 1,  2,  3,  4,  5,  6,  7,  8,
@@ -256,40 +842,67 @@ const uint16_t vlan_tags[] = {
 	57, 58, 59, 60, 61, 62, 63, 64
 };
 
-/* Which pools are used */
-static bool pools_used[] = {
-	0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0
-};
+/*
+ * Registry of the data VMs: their MAC address and their VM id, which is
+ * their VLAN tag and, with VMDq, their pool + 1. Updated under
+ * registry_lock, the data cores read it without locking.
+ */
+static struct rte_hash *mac_table;
+static struct vhost_dev *vm_ids[MAX_VMS + 1];
+static rte_spinlock_t registry_lock = RTE_SPINLOCK_INITIALIZER;
 
-/* MAC 00 is control channel, should not get a pool */
-#define GET_POOL_ID(mac_address) (mac_address.addr_bytes[5] % (num_virtio_devices + 1)) - 1
+/* A last MAC byte of 00 is the control channel, which gets no VM id */
+#define IS_CONTROL_MAC(mac_address) ((mac_address).addr_bytes[5] == 0)
+
+/*
+ * Software RX demultiplexing: RSS spreads the packets over a NIC queue per
+ * RX core, which dispatches them to the VMs by destination MAC address,
+ * instead of the VMDq pools.
+ */
+static uint32_t sw_demux;
+static uint16_t nb_rx_queues;
 
 /* List of VirtIO devices */
 static struct vhost_dev_tailq_list vhost_dev_list = TAILQ_HEAD_INITIALIZER(vhost_dev_list);
+/* Removed devices waiting to be freed */
+static struct vhost_dev_tailq_list removed_vdev_list = TAILQ_HEAD_INITIALIZER(removed_vdev_list);
+
+/* Quiescent states of the data cores, reported at each loop iteration */
+static struct rte_rcu_qsbr *data_qsbr;
 
 /* Used for queueing bursts of TX packets. */
 struct mbuf_table {
 	unsigned len;
 	unsigned txq_id;
 	struct rte_mbuf *m_table[MAX_PKT_BURST];
+	/* Packets the NIC queue did not take, NULL without --hold-us or with
+	 * --dequeue-zero-copy */
+	struct hold_buffer *hold;
+	/* Number of packets held while the NIC queue was full, and dropped
+	 * because it was */
+	uint64_t held;
+	uint64_t ring_dropped;
 };
 
 /* TX queue for each data core. */
 struct mbuf_table lcore_tx_queue[RTE_MAX_LCORE];
 
-/* Print out the matching table */
+/*
+ * Set by SIGUSR1. The table and stats read the versions of the rules, so
+ * they are printed by the main lcore, which is the only one to retire them.
+ */
+static volatile sig_atomic_t dump_requested;
+
+/* Print out the matching table, on the main lcore */
 static void
 print_table(void)
 {
 	struct vhost_dev *vdev;
-	uint16_t entry_id;
+	struct tagging_entry *e;
+	struct acl_rule *r;
+	void *key6;
+	char src6[INET6_ADDRSTRLEN], dst6[INET6_ADDRSTRLEN];
+	uint16_t rule_id;
 	
 	// TODO: not hardcode N_TAGS
 	RTE_LOG(INFO, VHOST_DATA, "**Matching table**\n");
@@ -299,34 +912,37 @@ print_table(void)
 	
 	TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
 		if(vdev->ready == DEVICE_DATA_RX) {
-			for(entry_id = 0; entry_id < N_ENTRIES_PER_VHOST; entry_id++) {
+			for(rule_id = 0; rule_id < N_RULE_IDS_PER_VHOST; rule_id++) {
+				e = rule_slots[vdev->vlan_tag][rule_id];
+				if(e == NULL || e->wildcard || e->ipv6)
+					continue;
 				RTE_LOG(INFO, VHOST_DATA, " %3u    %5u    %3u    %3u.%3u.%3u.%3u    %3u.%3u.%3u.%3u    %5u    %5u   %7u    %11lu    %11lu    %5u,%5u,%5u,%5u,%5u,%5u,%5u,%5u,%5u,%5u\n",
 				vdev->vid,
-				entry_id,
-				matching_table[vdev->vlan_tag][entry_id].protocol,
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].src_ip)),
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].src_ip >> 8)),
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].src_ip >> 16)),
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].src_ip >> 24)),
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].dst_ip)),
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].dst_ip >> 8)),
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].dst_ip >> 16)),
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].dst_ip >> 24)),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].src_port),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].dst_port),
-     				matching_table[vdev->vlan_tag][entry_id].n_tags,
-				matching_table[vdev->vlan_tag][entry_id].burst_bits,
-				matching_table[vdev->vlan_tag][entry_id].rate_bps,
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[0].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[1].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[2].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[3].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[4].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[5].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[6].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[7].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[8].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[9].vlan_id));
+				rule_id,
+				e->key.protocol,
+				((uint8_t) (e->key.src_ip)),
+				((uint8_t) (e->key.src_ip >> 8)),
+				((uint8_t) (e->key.src_ip >> 16)),
+				((uint8_t) (e->key.src_ip >> 24)),
+				((uint8_t) (e->key.dst_ip)),
+				((uint8_t) (e->key.dst_ip >> 8)),
+				((uint8_t) (e->key.dst_ip >> 16)),
+				((uint8_t) (e->key.dst_ip >> 24)),
+				rte_be_to_cpu_16(e->key.src_port),
+				rte_be_to_cpu_16(e->key.dst_port),
+				e->stack->n_tags,
+				e->shaper->burst_bits,
+				e->shaper->rate_bps,
+				rte_be_to_cpu_16(e->stack->tags[0].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[1].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[2].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[3].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[4].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[5].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[6].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[7].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[8].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[9].vlan_id));
 			}
 		}
 	}
@@ -335,43 +951,136 @@ print_table(void)
 	// parsable version
 	TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
 		if(vdev->ready == DEVICE_DATA_RX) {
-			for(entry_id = 0; entry_id < N_ENTRIES_PER_VHOST; entry_id++) {
+			for(rule_id = 0; rule_id < N_RULE_IDS_PER_VHOST; rule_id++) {
+				e = rule_slots[vdev->vlan_tag][rule_id];
+				if(e == NULL || e->wildcard || e->ipv6)
+					continue;
 				RTE_LOG(INFO, VHOST_DATA, "parsable-matching_table=%u-%u-%u-%u.%u.%u.%u-%u.%u.%u.%u-%u-%u-%u-%lu-%lu-%u,%u,%u,%u,%u,%u,%u,%u,%u,%u\n",
 				vdev->vid,
-				entry_id,
-				matching_table[vdev->vlan_tag][entry_id].protocol,
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].src_ip)),
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].src_ip >> 8)),
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].src_ip >> 16)),
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].src_ip >> 24)),
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].dst_ip)),
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].dst_ip >> 8)),
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].dst_ip >> 16)),
-				((uint8_t) (matching_table[vdev->vlan_tag][entry_id].dst_ip >> 24)),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].src_port),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].dst_port),
-     				matching_table[vdev->vlan_tag][entry_id].n_tags,
-     				matching_table[vdev->vlan_tag][entry_id].burst_bits,
-     				matching_table[vdev->vlan_tag][entry_id].rate_bps,
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[0].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[1].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[2].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[3].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[4].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[5].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[6].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[7].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[8].vlan_id),
-				rte_be_to_cpu_16(matching_table[vdev->vlan_tag][entry_id].tags[9].vlan_id));
+				rule_id,
+				e->key.protocol,
+				((uint8_t) (e->key.src_ip)),
+				((uint8_t) (e->key.src_ip >> 8)),
+				((uint8_t) (e->key.src_ip >> 16)),
+				((uint8_t) (e->key.src_ip >> 24)),
+				((uint8_t) (e->key.dst_ip)),
+				((uint8_t) (e->key.dst_ip >> 8)),
+				((uint8_t) (e->key.dst_ip >> 16)),
+				((uint8_t) (e->key.dst_ip >> 24)),
+				rte_be_to_cpu_16(e->key.src_port),
+				rte_be_to_cpu_16(e->key.dst_port),
+				e->stack->n_tags,
+				e->shaper->burst_bits,
+				e->shaper->rate_bps,
+				rte_be_to_cpu_16(e->stack->tags[0].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[1].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[2].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[3].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[4].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[5].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[6].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[7].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[8].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[9].vlan_id));
+			}
+		}
+	}
+
+	RTE_LOG(INFO, VHOST_DATA, "**Wildcard table**\n");
+	RTE_LOG(INFO, VHOST_DATA, "=====  =======  ==========  =====  ====================  ====================  =============  =============  ========  ============  =============  ===========================================================\n");
+	RTE_LOG(INFO, VHOST_DATA, " vID    rule     priority    pro        ip_source             ip_destination          sports         dports      n_tags    burst_bits     rate_bps                                tags_list\n");
+	RTE_LOG(INFO, VHOST_DATA, "-----  -------  ----------  -----  --------------------  --------------------  -------------  -------------  --------  ------------  -------------  --------------------------------------------------------------\n");
+	TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+		if(vdev->ready == DEVICE_DATA_RX) {
+			for(rule_id = 0; rule_id < N_RULE_IDS_PER_VHOST; rule_id++) {
+				e = rule_slots[vdev->vlan_tag][rule_id];
+				if(e == NULL || !e->wildcard)
+					continue;
+				r = &acl_defs[e - acl_entries].rule;
+				RTE_LOG(INFO, VHOST_DATA, " %3u    %5u    %10d    %3u    %3u.%3u.%3u.%3u/%2u    %3u.%3u.%3u.%3u/%2u    %5u-%5u    %5u-%5u   %7u    %11lu    %11lu    %5u,%5u,%5u,%5u,%5u,%5u,%5u,%5u,%5u,%5u\n",
+				vdev->vid,
+				rule_id,
+				r->data.priority,
+				r->field[ACL_FIELD_PROTO].mask_range.u8 ? e->key.protocol : 0,
+				((uint8_t) (e->key.src_ip)),
+				((uint8_t) (e->key.src_ip >> 8)),
+				((uint8_t) (e->key.src_ip >> 16)),
+				((uint8_t) (e->key.src_ip >> 24)),
+				r->field[ACL_FIELD_SRC].mask_range.u32,
+				((uint8_t) (e->key.dst_ip)),
+				((uint8_t) (e->key.dst_ip >> 8)),
+				((uint8_t) (e->key.dst_ip >> 16)),
+				((uint8_t) (e->key.dst_ip >> 24)),
+				r->field[ACL_FIELD_DST].mask_range.u32,
+				r->field[ACL_FIELD_SRCP].value.u16,
+				r->field[ACL_FIELD_SRCP].mask_range.u16,
+				r->field[ACL_FIELD_DSTP].value.u16,
+				r->field[ACL_FIELD_DSTP].mask_range.u16,
+				e->stack->n_tags,
+				e->shaper->burst_bits,
+				e->shaper->rate_bps,
+				rte_be_to_cpu_16(e->stack->tags[0].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[1].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[2].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[3].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[4].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[5].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[6].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[7].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[8].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[9].vlan_id));
+			}
+		}
+	}
+	RTE_LOG(INFO, VHOST_DATA, "=====  =======  ==========  =====  ====================  ====================  =============  =============  ========  ============  =============  ==============================================================\n");
+
+	RTE_LOG(INFO, VHOST_DATA, "**IPv6 matching table**\n");
+	RTE_LOG(INFO, VHOST_DATA, "=====  =======  =====  =========================================  =========================================  =======  =======  ========  ============  =============  ===========================================================\n");
+	RTE_LOG(INFO, VHOST_DATA, " vID    rule     pro                  ip_source                                ip_destination                  sport    dport    n_tags    burst_bits     rate_bps                                tags_list\n");
+	RTE_LOG(INFO, VHOST_DATA, "-----  -------  -----  -----------------------------------------  -----------------------------------------  -------  -------  --------  ------------  -------------  --------------------------------------------------------------\n");
+	TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+		if(vdev->ready == DEVICE_DATA_RX) {
+			for(rule_id = 0; rule_id < N_RULE_IDS_PER_VHOST; rule_id++) {
+				e = rule_slots[vdev->vlan_tag][rule_id];
+				if(e == NULL || !e->ipv6)
+					continue;
+				if (rte_hash_get_key_with_position(flow_table6, e - flow_entries6, &key6) != 0)
+					continue;
+				inet_ntop(AF_INET6, ((struct flow_key6 *) key6)->src_ip, src6, sizeof(src6));
+				inet_ntop(AF_INET6, ((struct flow_key6 *) key6)->dst_ip, dst6, sizeof(dst6));
+				RTE_LOG(INFO, VHOST_DATA, " %3u    %5u    %3u    %41s  %41s    %5u    %5u   %7u    %11lu    %11lu    %5u,%5u,%5u,%5u,%5u,%5u,%5u,%5u,%5u,%5u\n",
+				vdev->vid,
+				rule_id,
+				e->key.protocol,
+				src6,
+				dst6,
+				rte_be_to_cpu_16(e->key.src_port),
+				rte_be_to_cpu_16(e->key.dst_port),
+				e->stack->n_tags,
+				e->shaper->burst_bits,
+				e->shaper->rate_bps,
+				rte_be_to_cpu_16(e->stack->tags[0].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[1].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[2].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[3].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[4].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[5].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[6].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[7].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[8].vlan_id),
+				rte_be_to_cpu_16(e->stack->tags[9].vlan_id));
 			}
 		}
 	}
+	RTE_LOG(INFO, VHOST_DATA, "=====  =======  =====  =========================================  =========================================  =======  =======  ========  ============  =============  ==============================================================\n");
 }
 
 static void
 print_stats(void)
 {
 		struct vhost_dev *vdev;
+		const struct shaper *vm;
+		unsigned lcore;
 
 		RTE_LOG(INFO, VHOST_DATA, "**Tagging application statistics**\n");
 		RTE_LOG(INFO, VHOST_DATA, "=====  ======  ===================  =====  =======  ============  ============  ============  ============  ============  ============\n");
@@ -390,7 +1099,7 @@ print_stats(void)
 							vdev->mac_address.addr_bytes[5],
 							vdev->vmdq_rx_q,
 							vdev->tx_coreid,
-							vdev->rx_coreid,
+							vdev->rxq[0].coreid,
 							rte_atomic64_read(&vdev->stats.rx_total_atomic),
 							rte_atomic64_read(&vdev->stats.rx_success_atomic),
 							vdev->stats.tx_total,
@@ -413,7 +1122,7 @@ print_stats(void)
 							vdev->mac_address.addr_bytes[5],
 							vdev->vmdq_rx_q,
 							vdev->tx_coreid,
-							vdev->rx_coreid,
+							vdev->rxq[0].coreid,
 							rte_atomic64_read(&vdev->stats.rx_total_atomic),
 							rte_atomic64_read(&vdev->stats.rx_success_atomic),
 							vdev->stats.tx_total,
@@ -422,6 +1131,205 @@ print_stats(void)
 							vdev->stats.tx_dropped
 				   );
 		}
+
+		RTE_LOG(INFO, VHOST_DATA, "**VM aggregate shaping statistics**\n");
+		RTE_LOG(INFO, VHOST_DATA, "=====  ======  =======  ============  ============  ============\n");
+		RTE_LOG(INFO, VHOST_DATA, " vID    vlan   enabled    burst_bits     rate_bps     tx_dropped  \n");
+		RTE_LOG(INFO, VHOST_DATA, "-----  ------  -------  ------------  ------------  ------------\n");
+		TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+			vm = vm_shapers[vdev->vlan_tag];
+			RTE_LOG(INFO, VHOST_DATA, " %3u   %5u   %5u %13"PRIu64" %13"PRIu64" %13"PRIu64"\n",
+							vdev->vid,
+							vdev->vlan_tag,
+							vm != NULL,
+							vm != NULL ? vm->burst_bits : 0,
+							vm != NULL ? vm->rate_bps : 0,
+							vdev->stats.tx_vm_dropped);
+		}
+		RTE_LOG(INFO, VHOST_DATA, "=====  ======  =======  ============  ============  ============\n");
+		// parsable version
+		TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+			vm = vm_shapers[vdev->vlan_tag];
+			RTE_LOG(INFO, VHOST_DATA, "parsable-vm_shaper=%u-%u-%u-%"PRIu64"-%"PRIu64"-%"PRIu64"\n",
+							vdev->vid,
+							vdev->vlan_tag,
+							vm != NULL,
+							vm != NULL ? vm->burst_bits : 0,
+							vm != NULL ? vm->rate_bps : 0,
+							vdev->stats.tx_vm_dropped);
+		}
+
+		if (pacing_depth) {
+			RTE_LOG(INFO, VHOST_DATA, "**Pacing statistics**\n");
+			RTE_LOG(INFO, VHOST_DATA, "=====  ============  ============\n");
+			RTE_LOG(INFO, VHOST_DATA, " vID     tx_paced     tx_dropped  \n");
+			RTE_LOG(INFO, VHOST_DATA, "-----  ------------  ------------\n");
+			TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+				RTE_LOG(INFO, VHOST_DATA, " %3u %13"PRIu64" %13"PRIu64"\n",
+								vdev->vid,
+								vdev->stats.tx_paced,
+								vdev->stats.tx_pacing_dropped);
+			}
+			RTE_LOG(INFO, VHOST_DATA, "=====  ============  ============\n");
+			// parsable version
+			TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+				RTE_LOG(INFO, VHOST_DATA, "parsable-pacing=%u-%"PRIu64"-%"PRIu64"\n",
+								vdev->vid,
+								vdev->stats.tx_paced,
+								vdev->stats.tx_pacing_dropped);
+			}
+		}
+
+		if (local_switch) {
+			RTE_LOG(INFO, VHOST_DATA, "**Local switching statistics**\n");
+			RTE_LOG(INFO, VHOST_DATA, "=====  ============\n");
+			RTE_LOG(INFO, VHOST_DATA, " vID     tx_local  \n");
+			RTE_LOG(INFO, VHOST_DATA, "-----  ------------\n");
+			TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+				RTE_LOG(INFO, VHOST_DATA, " %3u %13"PRIu64"\n",
+								vdev->vid,
+								vdev->stats.tx_local);
+			}
+			RTE_LOG(INFO, VHOST_DATA, "=====  ============\n");
+			// parsable version
+			TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+				RTE_LOG(INFO, VHOST_DATA, "parsable-local=%u-%"PRIu64"\n",
+								vdev->vid,
+								vdev->stats.tx_local);
+			}
+		}
+
+		if (sw_gso) {
+			RTE_LOG(INFO, VHOST_DATA, "**GSO statistics**\n");
+			RTE_LOG(INFO, VHOST_DATA, "=====  ============\n");
+			RTE_LOG(INFO, VHOST_DATA, " vID    tx_dropped \n");
+			RTE_LOG(INFO, VHOST_DATA, "-----  ------------\n");
+			TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+				RTE_LOG(INFO, VHOST_DATA, " %3u %13"PRIu64"\n",
+								vdev->vid,
+								vdev->stats.tx_gso_dropped);
+			}
+			RTE_LOG(INFO, VHOST_DATA, "=====  ============\n");
+			// parsable version
+			TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+				RTE_LOG(INFO, VHOST_DATA, "parsable-gso=%u-%"PRIu64"\n",
+								vdev->vid,
+								vdev->stats.tx_gso_dropped);
+			}
+		}
+
+		/* Packets a full ring did not take at once, dropped or held */
+		RTE_LOG(INFO, VHOST_DATA, "**Ring full statistics**\n");
+		RTE_LOG(INFO, VHOST_DATA, "=====  ============  ============\n");
+		RTE_LOG(INFO, VHOST_DATA, " vID     rx_held      rx_dropped  \n");
+		RTE_LOG(INFO, VHOST_DATA, "-----  ------------  ------------\n");
+		TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+			RTE_LOG(INFO, VHOST_DATA, " %3u %13"PRIu64" %13"PRIu64"\n",
+							vdev->vid,
+							rte_atomic64_read(&vdev->stats.rx_held_atomic),
+							rte_atomic64_read(&vdev->stats.rx_ring_dropped_atomic));
+		}
+		RTE_LOG(INFO, VHOST_DATA, "=====  ============  ============\n");
+		RTE_LOG(INFO, VHOST_DATA, "lcore     tx_held      tx_dropped  \n");
+		RTE_LOG(INFO, VHOST_DATA, "-----  ------------  ------------\n");
+		RTE_LCORE_FOREACH_SLAVE(lcore) {
+			RTE_LOG(INFO, VHOST_DATA, " %3u %13"PRIu64" %13"PRIu64"\n",
+							lcore,
+							lcore_tx_queue[lcore].held,
+							lcore_tx_queue[lcore].ring_dropped);
+		}
+		RTE_LOG(INFO, VHOST_DATA, "=====  ============  ============\n");
+		// parsable version
+		TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+			RTE_LOG(INFO, VHOST_DATA, "parsable-rx_ring=%u-%"PRIu64"-%"PRIu64"\n",
+							vdev->vid,
+							rte_atomic64_read(&vdev->stats.rx_held_atomic),
+							rte_atomic64_read(&vdev->stats.rx_ring_dropped_atomic));
+		}
+		RTE_LCORE_FOREACH_SLAVE(lcore) {
+			RTE_LOG(INFO, VHOST_DATA, "parsable-tx_ring=%u-%"PRIu64"-%"PRIu64"\n",
+							lcore,
+							lcore_tx_queue[lcore].held,
+							lcore_tx_queue[lcore].ring_dropped);
+		}
+
+		RTE_LOG(INFO, VHOST_DATA, "**Flow cache statistics**\n");
+		RTE_LOG(INFO, VHOST_DATA, "=====  ============  ============\n");
+		RTE_LOG(INFO, VHOST_DATA, "lcore     hits          misses   \n");
+		RTE_LOG(INFO, VHOST_DATA, "-----  ------------  ------------\n");
+		RTE_LCORE_FOREACH_SLAVE(lcore) {
+			RTE_LOG(INFO, VHOST_DATA, " %3u %13"PRIu64" %13"PRIu64"\n",
+							lcore,
+							lcore_info[lcore].flow_cache->hits,
+							lcore_info[lcore].flow_cache->misses);
+		}
+		RTE_LOG(INFO, VHOST_DATA, "=====  ============  ============\n");
+		// parsable version
+		RTE_LCORE_FOREACH_SLAVE(lcore) {
+			RTE_LOG(INFO, VHOST_DATA, "parsable-flow_cache=%u-%"PRIu64"-%"PRIu64"\n",
+							lcore,
+							lcore_info[lcore].flow_cache->hits,
+							lcore_info[lcore].flow_cache->misses);
+		}
+
+		if (sw_demux) {
+			RTE_LOG(INFO, VHOST_DATA, "**RX demux statistics**\n");
+			RTE_LOG(INFO, VHOST_DATA, "=====  =====  ============\n");
+			RTE_LOG(INFO, VHOST_DATA, "lcore  queue    unknown   \n");
+			RTE_LOG(INFO, VHOST_DATA, "-----  -----  ------------\n");
+			RTE_LCORE_FOREACH_SLAVE(lcore) {
+				if (lcore_info[lcore].nic_rxq < 0)
+					continue;
+				RTE_LOG(INFO, VHOST_DATA, " %3u   %3d %13"PRIu64"\n",
+								lcore,
+								lcore_info[lcore].nic_rxq,
+								lcore_info[lcore].rx_unknown);
+			}
+			RTE_LOG(INFO, VHOST_DATA, "=====  =====  ============\n");
+			// parsable version
+			RTE_LCORE_FOREACH_SLAVE(lcore) {
+				if (lcore_info[lcore].nic_rxq < 0)
+					continue;
+				RTE_LOG(INFO, VHOST_DATA, "parsable-rx_demux=%u-%d-%"PRIu64"\n",
+								lcore,
+								lcore_info[lcore].nic_rxq,
+								lcore_info[lcore].rx_unknown);
+			}
+		}
+
+		if (idle_polls) {
+			uint64_t us_cycles = rte_get_tsc_hz() / US_PER_S;
+			struct lcore_sleep *sl;
+
+			RTE_LOG(INFO, VHOST_DATA, "**Sleep statistics**\n");
+			RTE_LOG(INFO, VHOST_DATA, "=====  ============  ============  ============  ============  ============  ============\n");
+			RTE_LOG(INFO, VHOST_DATA, "lcore     sleeps        woken        timeouts      slept_us     wake_us_avg   wake_us_max \n");
+			RTE_LOG(INFO, VHOST_DATA, "-----  ------------  ------------  ------------  ------------  ------------  ------------\n");
+			RTE_LCORE_FOREACH_SLAVE(lcore) {
+				sl = lcore_info[lcore].sleep;
+				RTE_LOG(INFO, VHOST_DATA, " %3u %13"PRIu64" %13"PRIu64" %13"PRIu64" %13"PRIu64" %13"PRIu64" %13"PRIu64"\n",
+								lcore,
+								sl->sleeps,
+								sl->woken,
+								sl->timeouts,
+								sl->slept_cycles / us_cycles,
+								sl->sleeps ? sl->wake_cycles / sl->sleeps / us_cycles : 0,
+								sl->wake_cycles_max / us_cycles);
+			}
+			RTE_LOG(INFO, VHOST_DATA, "=====  ============  ============  ============  ============  ============  ============\n");
+			// parsable version
+			RTE_LCORE_FOREACH_SLAVE(lcore) {
+				sl = lcore_info[lcore].sleep;
+				RTE_LOG(INFO, VHOST_DATA, "parsable-sleep=%u-%"PRIu64"-%"PRIu64"-%"PRIu64"-%"PRIu64"-%"PRIu64"-%"PRIu64"\n",
+								lcore,
+								sl->sleeps,
+								sl->woken,
+								sl->timeouts,
+								sl->slept_cycles / us_cycles,
+								sl->sleeps ? sl->wake_cycles / sl->sleeps / us_cycles : 0,
+								sl->wake_cycles_max / us_cycles);
+			}
+		}
 }
 
 /*
@@ -454,7 +1362,7 @@ get_eth_conf(struct rte_eth_conf *eth_conf, uint32_t num_virtio_devices)
 
 /*
  * Initialises a given port using global settings and with the rx buffers
- * coming from the mbuf_pool passed as parameter
+ * coming from the mempool of its NUMA node
  */
 static inline int
 port_init(uint16_t port)
@@ -475,11 +1383,6 @@ port_init(uint16_t port)
 	txconf = &dev_info.default_txconf;
 	rxconf->rx_drop_en = 1;
 
-	/*configure the number of supported virtio devices based on VMDQ limits */
-	num_virtio_devices = dev_info.max_vmdq_pools;
-	if(num_virtio_devices > MAX_VIRTIO_DEVICES)
-		num_virtio_devices = MAX_VIRTIO_DEVICES;
-	
 	rx_ring_size = RTE_TEST_RX_DESC_DEFAULT;
 	tx_ring_size = RTE_TEST_TX_DESC_DEFAULT;
 
@@ -493,7 +1396,17 @@ port_init(uint16_t port)
 	if (dequeue_zero_copy)
 		tx_ring_size = 64;
 
-	tx_rings = num_virtio_devices;
+	if (sw_demux)
+		goto rss_conf;
+
+	/*configure the number of supported virtio devices based on VMDQ limits */
+	num_virtio_devices = dev_info.max_vmdq_pools;
+	if(num_virtio_devices > MAX_VIRTIO_DEVICES)
+		num_virtio_devices = MAX_VIRTIO_DEVICES;
+
+	/* Each core sends on its own queue, indexed like in lcore_ids */
+	tx_rings = RTE_MAX(num_virtio_devices, rte_lcore_count());
+	rx_rings = (uint16_t)dev_info.max_rx_queues;
 
 	/* Get port configuration. */
 	retval = get_eth_conf(&port_conf, num_virtio_devices);
@@ -509,15 +1422,69 @@ port_init(uint16_t port)
 	RTE_LOG(INFO, VHOST_PORT, "pf queue num: %u, configured vmdq pool num: %u, each vmdq pool has %u queues\n",
 		num_pf_queues, num_virtio_devices, queues_per_pool);
 
+	/* With multiqueue, RSS spreads the packets of a pool over its queues */
+	if (multiqueue) {
+		if (queues_per_pool > MAX_RXQ_PER_DEVICE) {
+			RTE_LOG(ERR, VHOST_PORT, "Port %u has more than %u queues per pool.\n", port, MAX_RXQ_PER_DEVICE);
+			return -1;
+		}
+		rxq_per_device = queues_per_pool;
+		port_conf.rxmode.mq_mode = ETH_MQ_RX_VMDQ_RSS;
+		port_conf.rx_adv_conf.rss_conf.rss_key = NULL;
+		port_conf.rx_adv_conf.rss_conf.rss_hf = (ETH_RSS_IP | ETH_RSS_TCP | ETH_RSS_UDP) &
+			dev_info.flow_type_rss_offloads;
+	}
+	goto port_conf;
+
+rss_conf:
+	/* Without VMDq, RSS spreads the packets over a queue per RX core and
+	 * the VMs are only limited by their ids. The offloads the port lacks,
+	 * a virtual one for instance, are left out. */
+	num_virtio_devices = MAX_VMS;
+	tx_rings = rte_lcore_count();
+	rx_rings = nb_rx_queues;
+	if (rx_rings > dev_info.max_rx_queues) {
+		RTE_LOG(ERR, VHOST_PORT, "Port %u has %u RX queues, %u are needed.\n", port, dev_info.max_rx_queues, rx_rings);
+		return -1;
+	}
+	(void)(rte_memcpy(&port_conf, &vmdq_conf_default, sizeof(port_conf)));
+	port_conf.rxmode.mq_mode = rx_rings > 1 ? ETH_MQ_RX_RSS : ETH_MQ_RX_NONE;
+	port_conf.rxmode.offloads &= dev_info.rx_offload_capa;
+	port_conf.txmode.offloads &= dev_info.tx_offload_capa;
+	port_conf.rx_adv_conf.rss_conf.rss_key = NULL;
+	port_conf.rx_adv_conf.rss_conf.rss_hf = (ETH_RSS_IP | ETH_RSS_TCP | ETH_RSS_UDP) &
+		dev_info.flow_type_rss_offloads;
+	RTE_LOG(INFO, VHOST_PORT, "%u RSS queues dispatched in software\n", rx_rings);
+
+port_conf:
+	if (tx_rings > dev_info.max_tx_queues) {
+		RTE_LOG(ERR, VHOST_PORT, "Port %u has %u TX queues, %u are needed.\n", port, dev_info.max_tx_queues, tx_rings);
+		return -1;
+	}
+
 	if (!rte_eth_dev_is_valid_port(port))
 		return -1;
 
-	rx_rings = (uint16_t)dev_info.max_rx_queues;
-	if (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MBUF_FAST_FREE)
+	/* VLAN/QinQ insertion, tags are pushed in software without it */
+	port_conf.txmode.offloads &= ~(DEV_TX_OFFLOAD_VLAN_INSERT | DEV_TX_OFFLOAD_QINQ_INSERT);
+	if (hw_vlan_insert)
+		vlan_insert_offloads = dev_info.tx_offload_capa & (DEV_TX_OFFLOAD_VLAN_INSERT | DEV_TX_OFFLOAD_QINQ_INSERT);
+	/* QinQ insertion needs the VLAN one for the inner tag */
+	if (!(vlan_insert_offloads & DEV_TX_OFFLOAD_VLAN_INSERT))
+		vlan_insert_offloads = 0;
+	port_conf.txmode.offloads |= vlan_insert_offloads;
+	/* Chained header segments, clones and GSO segments do not come from a single pool */
+	if ((dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MBUF_FAST_FREE) && !dequeue_zero_copy && !sw_gso)
 		port_conf.txmode.offloads |= DEV_TX_OFFLOAD_MBUF_FAST_FREE;
+	/* RX queue interrupts wake up the idle data cores */
+	if (idle_polls)
+		port_conf.intr_conf.rxq = 1;
+configure:
 	/* Configure ethernet device. */
 	retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
 	if (retval != 0) {
+		if (port_conf.intr_conf.rxq)
+			goto no_rx_intr;
 		RTE_LOG(ERR, VHOST_PORT, "Failed to configure port %u: %s.\n",
 			port, strerror(-retval));
 		return retval;
@@ -536,7 +1503,7 @@ port_init(uint16_t port)
 	/* Setup the queues. */
 	rxconf->offloads = port_conf.rxmode.offloads;
 	for (q = 0; q < rx_rings; q ++) {
-		retval = rte_eth_rx_queue_setup(port, q, rx_ring_size, rte_eth_dev_socket_id(port), rxconf, mbuf_pool);
+		retval = rte_eth_rx_queue_setup(port, q, rx_ring_size, rte_eth_dev_socket_id(port), rxconf, mbuf_pools[nic_socket]);
 		if (retval < 0) {
 			RTE_LOG(ERR, VHOST_PORT,
 				"Failed to setup rx queue %u of port %u: %s.\n",
@@ -557,17 +1524,38 @@ port_init(uint16_t port)
 		}
 	}
 
+	/* The outer tag inserted with QinQ uses the 802.1ad TPID */
+	if ((vlan_insert_offloads & DEV_TX_OFFLOAD_QINQ_INSERT) &&
+			rte_eth_dev_set_vlan_ether_type(port, ETH_VLAN_TYPE_OUTER, RTE_ETHER_TYPE_QINQ) != 0) {
+		RTE_LOG(INFO, VHOST_PORT, "Cannot set the outer TPID of port %u, QinQ tags are pushed in software.\n", port);
+		vlan_insert_offloads &= ~DEV_TX_OFFLOAD_QINQ_INSERT;
+	}
+
 	/* Start the device. */
 	retval  = rte_eth_dev_start(port);
 	if (retval < 0) {
+		if (port_conf.intr_conf.rxq)
+			goto no_rx_intr;
 		RTE_LOG(ERR, VHOST_PORT, "Failed to start port %u: %s\n",
 			port, strerror(-retval));
 		return retval;
 	}
 
-	if (promiscuous)
+	/* The MAC addresses of the VMs are matched in software */
+	if (promiscuous || sw_demux)
 		rte_eth_promiscuous_enable(port);
 
+	/* Without RX interrupts, the idle data cores only wake up on a kick or
+	 * after max_sleep_ms */
+	if (idle_polls) {
+		rx_intr = port_conf.intr_conf.rxq &&
+			rte_eth_dev_rx_intr_enable(port, vmdq_queue_base) == 0 &&
+			rte_eth_dev_rx_intr_disable(port, vmdq_queue_base) == 0;
+		if (!rx_intr)
+			RTE_LOG(INFO, VHOST_PORT, "Port %u has no RX queue interrupts, idle data cores poll it every %u ms.\n",
+				port, max_sleep_ms);
+	}
+
 	static struct rte_ether_addr vmdq_ports_eth_addr;
 	rte_eth_macaddr_get(port, &vmdq_ports_eth_addr);
 	RTE_LOG(INFO, VHOST_PORT, "Max virtio devices supported: %u\n", num_virtio_devices);
@@ -582,6 +1570,14 @@ port_init(uint16_t port)
 			vmdq_ports_eth_addr.addr_bytes[5]);
 
 	return 0;
+
+no_rx_intr:
+	/* Drivers only have interrupts for a few queues (15 on ixgbe), the
+	 * port is set up again without them when it has more */
+	RTE_LOG(INFO, VHOST_PORT, "Port %u cannot use RX queue interrupts with %u queues: %s.\n",
+		port, rx_rings, strerror(-retval));
+	port_conf.intr_conf.rxq = 0;
+	goto configure;
 }
 
 /*
@@ -650,6 +1646,35 @@ parse_num_opt(const char *q_arg, uint32_t max_valid_value)
 	return num;
 }
 
+/*
+ * Parse the comma separated list of the TX cores, which must be data cores.
+ */
+static int
+parse_tx_lcores(const char *arg)
+{
+	const char *p = arg;
+	char *end = NULL;
+	unsigned long lcore;
+
+	memset(tx_lcores, 0, sizeof(tx_lcores));
+	nb_tx_lcores = 0;
+	do {
+		errno = 0;
+		lcore = strtoul(p, &end, 10);
+		if (end == p || errno != 0 || (*end != ',' && *end != '\0'))
+			return -1;
+		if (lcore >= RTE_MAX_LCORE || !rte_lcore_is_enabled(lcore) || lcore == rte_get_master_lcore())
+			return -1;
+		if (!tx_lcores[lcore]) {
+			tx_lcores[lcore] = 1;
+			nb_tx_lcores++;
+		}
+		p = end + 1;
+	} while (*end == ',');
+
+	return 0;
+}
+
 /*
  * Display usage
  */
@@ -662,8 +1687,23 @@ us_vhost_usage(const char *prgname)
 	"		--socket-file: The path of the socket file.\n"
 	"		--tx-csum [0|1] disable/enable TX checksum offload.\n"
 	"		--client register a vhost-user socket as client mode.\n"
-	"		--dequeue-zero-copy enables dequeue zero copy\n",
-	       prgname);
+	"		--dequeue-zero-copy enables dequeue zero copy\n"
+	"		--pacing-depth N: queue up to N non conforming packets per rule instead of dropping them (default 0, max %u)\n"
+	"		--sw-gso [0|1] disable/enable the software segmentation of TSO packets (default 0, not with --dequeue-zero-copy)\n"
+	"		--hw-vlan-insert [0|1] disable/enable the NIC insertion of the outermost tags (default 1)\n"
+	"		--multiqueue [0|1] disable/enable the virtio queue pairs of the guests, with RSS in their VMDq pool (default 0)\n"
+	"		--sw-demux [0|1] disable/enable the dispatch of the NIC packets to the VMs in software, without VMDq (default 0)\n"
+	"		--local-switch [0|1] disable/enable the direct delivery of the packets between the VMs of the host, untagged (default 0)\n"
+	"		--tx-lcores <list>: comma separated data cores draining the virtio TX queues (default all)\n"
+	"		--tx-rebalance-pps N: move a device away from a TX core sending more than N packets/s (default 0, disabled)\n"
+	"		--max-rules N: capacity of the IPv4 and IPv6 matching tables (default %u)\n"
+	"		--max-wildcard-rules N: capacity of the wildcard table (default %u)\n"
+	"		--mgmt-socket <path>: serve rule and stats requests on a Unix socket\n"
+	"		--in-band-control [0|1] disable/enable the rule messages of the control VM (default 1)\n"
+	"		--idle-polls N: sleep until an interrupt after N empty polls of a data core (default 0, always poll)\n"
+	"		--max-sleep-ms N: longest sleep of an idle data core, bounds its wake-up latency (default 1, max %u)\n"
+	"		--hold-us N: hold the packets a full NIC or virtio queue did not take for up to N us and send them again (default 0, drop them, max %u, only virtio queues with --dequeue-zero-copy)\n",
+	       prgname, MAX_PACING_DEPTH, DEFAULT_MAX_RULES, DEFAULT_MAX_WILDCARD_RULES, MAX_SLEEP_MS, MAX_HOLD_US);
 }
 
 /*
@@ -678,10 +1718,25 @@ us_vhost_parse_args(int argc, char **argv)
 	static struct option long_option[] = {
 		{"socket-file", required_argument, NULL, 0},
 		{"tx-csum", required_argument, NULL, 0},
-		{"do_tag", required_argument, NULL, 1},
-		{"do_shape", required_argument, NULL, 1},
+		{"do_tag", required_argument, NULL, 0},
+		{"do_shape", required_argument, NULL, 0},
 		{"client", no_argument, &client_mode, 1},
 		{"dequeue-zero-copy", no_argument, &dequeue_zero_copy, 1},
+		{"max-rules", required_argument, NULL, 0},
+		{"max-wildcard-rules", required_argument, NULL, 0},
+		{"hw-vlan-insert", required_argument, NULL, 0},
+		{"pacing-depth", required_argument, NULL, 0},
+		{"sw-gso", required_argument, NULL, 0},
+		{"tx-lcores", required_argument, NULL, 0},
+		{"multiqueue", required_argument, NULL, 0},
+		{"sw-demux", required_argument, NULL, 0},
+		{"local-switch", required_argument, NULL, 0},
+		{"tx-rebalance-pps", required_argument, NULL, 0},
+		{"mgmt-socket", required_argument, NULL, 0},
+		{"in-band-control", required_argument, NULL, 0},
+		{"idle-polls", required_argument, NULL, 0},
+		{"max-sleep-ms", required_argument, NULL, 0},
+		{"hold-us", required_argument, NULL, 0},
 		{NULL, 0, 0, 0},
 	};
 
@@ -738,39 +1793,255 @@ us_vhost_parse_args(int argc, char **argv)
 					do_shape = ret;
 			}
 
-			/* Set socket file path. */
-			if (!strncmp(long_option[option_index].name,
-						"socket-file", MAX_LONG_OPT_SZ)) {
-				if (us_vhost_parse_socket_path(optarg) == -1) {
-					RTE_LOG(INFO, VHOST_CONFIG,
-					"Invalid argument for socket name (Max %d characters)\n",
-					PATH_MAX);
+			/* Enable/disable the VLAN/QinQ insertion offload. */
+			if (!strncmp(long_option[option_index].name, "hw-vlan-insert", MAX_LONG_OPT_SZ)) {
+				ret = parse_num_opt(optarg, 1);
+				if (ret == -1) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for hw-vlan-insert [0|1]\n");
 					us_vhost_usage(prgname);
 					return -1;
-				}
+				} else
+					hw_vlan_insert = ret;
 			}
 
-			break;
+			/* Enable/disable software GSO. */
+			if (!strncmp(long_option[option_index].name, "sw-gso", MAX_LONG_OPT_SZ)) {
+				ret = parse_num_opt(optarg, 1);
+				if (ret == -1) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for sw-gso [0|1]\n");
+					us_vhost_usage(prgname);
+					return -1;
+				} else
+					sw_gso = ret;
+			}
 
-			/* Invalid option - print options. */
-		default:
+			/* Pacing of the non conforming packets. */
+			if (!strncmp(long_option[option_index].name, "pacing-depth", MAX_LONG_OPT_SZ)) {
+				ret = parse_num_opt(optarg, MAX_PACING_DEPTH);
+				if (ret == -1) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for pacing-depth [0-%u]\n", MAX_PACING_DEPTH);
+					us_vhost_usage(prgname);
+					return -1;
+				} else
+					pacing_depth = ret;
+			}
+
+			/* Capacity of the matching table. */
+			if (!strncmp(long_option[option_index].name, "max-rules", MAX_LONG_OPT_SZ)) {
+				ret = parse_num_opt(optarg, MAX_RULES_LIMIT);
+				if (ret < RTE_HASH_BUCKET_ENTRIES) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for max-rules [%u-%u]\n", RTE_HASH_BUCKET_ENTRIES, MAX_RULES_LIMIT);
+					us_vhost_usage(prgname);
+					return -1;
+				} else
+					max_rules = ret;
+			}
+
+			/* Capacity of the wildcard table. */
+			if (!strncmp(long_option[option_index].name, "max-wildcard-rules", MAX_LONG_OPT_SZ)) {
+				ret = parse_num_opt(optarg, MAX_RULES_LIMIT);
+				if (ret < 1) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for max-wildcard-rules [1-%u]\n", MAX_RULES_LIMIT);
+					us_vhost_usage(prgname);
+					return -1;
+				} else
+					max_acl_rules = ret;
+			}
+
+			/* Enable/disable the virtio queue pairs. */
+			if (!strncmp(long_option[option_index].name, "multiqueue", MAX_LONG_OPT_SZ)) {
+				ret = parse_num_opt(optarg, 1);
+				if (ret == -1) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for multiqueue [0|1]\n");
+					us_vhost_usage(prgname);
+					return -1;
+				} else
+					multiqueue = ret;
+			}
+
+			/* Enable/disable the software demux of the NIC packets. */
+			if (!strncmp(long_option[option_index].name, "sw-demux", MAX_LONG_OPT_SZ)) {
+				ret = parse_num_opt(optarg, 1);
+				if (ret == -1) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for sw-demux [0|1]\n");
+					us_vhost_usage(prgname);
+					return -1;
+				} else
+					sw_demux = ret;
+			}
+
+			/* Enable/disable the direct delivery between the VMs. */
+			if (!strncmp(long_option[option_index].name, "local-switch", MAX_LONG_OPT_SZ)) {
+				ret = parse_num_opt(optarg, 1);
+				if (ret == -1) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for local-switch [0|1]\n");
+					us_vhost_usage(prgname);
+					return -1;
+				} else
+					local_switch = ret;
+			}
+
+			/* Cores draining the virtio TX queues. */
+			if (!strncmp(long_option[option_index].name, "tx-lcores", MAX_LONG_OPT_SZ)) {
+				if (parse_tx_lcores(optarg) == -1) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for tx-lcores, enabled data cores expected\n");
+					us_vhost_usage(prgname);
+					return -1;
+				}
+			}
+
+			/* Load threshold of the TX cores. */
+			if (!strncmp(long_option[option_index].name, "tx-rebalance-pps", MAX_LONG_OPT_SZ)) {
+				ret = parse_num_opt(optarg, INT32_MAX);
+				if (ret == -1) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for tx-rebalance-pps [0-%d]\n", INT32_MAX);
+					us_vhost_usage(prgname);
+					return -1;
+				} else
+					tx_rebalance_pps = ret;
+			}
+
+			/* Management socket. */
+			if (!strncmp(long_option[option_index].name, "mgmt-socket", MAX_LONG_OPT_SZ)) {
+				if (strlcpy(mgmt_socket_path, optarg, sizeof(mgmt_socket_path)) >= sizeof(((struct sockaddr_un *) NULL)->sun_path)) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for mgmt-socket, path too long\n");
+					us_vhost_usage(prgname);
+					return -1;
+				}
+			}
+
+			/* Enable/disable the rule messages of the control VM. */
+			if (!strncmp(long_option[option_index].name, "in-band-control", MAX_LONG_OPT_SZ)) {
+				ret = parse_num_opt(optarg, 1);
+				if (ret == -1) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for in-band-control [0|1]\n");
+					us_vhost_usage(prgname);
+					return -1;
+				} else
+					in_band_control = ret;
+			}
+
+			/* Adaptive polling of the data cores. */
+			if (!strncmp(long_option[option_index].name, "idle-polls", MAX_LONG_OPT_SZ)) {
+				ret = parse_num_opt(optarg, INT32_MAX);
+				if (ret == -1) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for idle-polls [0-%d]\n", INT32_MAX);
+					us_vhost_usage(prgname);
+					return -1;
+				} else
+					idle_polls = ret;
+			}
+
+			/* Longest sleep of an idle data core. */
+			if (!strncmp(long_option[option_index].name, "max-sleep-ms", MAX_LONG_OPT_SZ)) {
+				ret = parse_num_opt(optarg, MAX_SLEEP_MS);
+				if (ret < 1) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for max-sleep-ms [1-%u]\n", MAX_SLEEP_MS);
+					us_vhost_usage(prgname);
+					return -1;
+				} else
+					max_sleep_ms = ret;
+			}
+
+			/* Longest wait of the packets held while a ring is full. */
+			if (!strncmp(long_option[option_index].name, "hold-us", MAX_LONG_OPT_SZ)) {
+				ret = parse_num_opt(optarg, MAX_HOLD_US);
+				if (ret == -1) {
+					RTE_LOG(INFO, VHOST_CONFIG, "Invalid argument for hold-us [0-%u]\n", MAX_HOLD_US);
+					us_vhost_usage(prgname);
+					return -1;
+				} else
+					hold_us = ret;
+			}
+
+			/* Set socket file path. */
+			if (!strncmp(long_option[option_index].name,
+						"socket-file", MAX_LONG_OPT_SZ)) {
+				if (us_vhost_parse_socket_path(optarg) == -1) {
+					RTE_LOG(INFO, VHOST_CONFIG,
+					"Invalid argument for socket name (Max %d characters)\n",
+					PATH_MAX);
+					us_vhost_usage(prgname);
+					return -1;
+				}
+			}
+
+			break;
+
+			/* Invalid option - print options. */
+		default:
 			us_vhost_usage(prgname);
 			return -1;
 		}
 	}
 
+	/* rte_gso reads the headers from the first segment, which only holds
+	 * the Ethernet header and tags once a zero copy packet is tagged. */
+	if (sw_gso && dequeue_zero_copy) {
+		RTE_LOG(INFO, VHOST_CONFIG, "sw-gso cannot be used with dequeue-zero-copy\n");
+		us_vhost_usage(prgname);
+		return -1;
+	}
+
 	return 0;
 }
 
+static inline void
+free_pkts(struct rte_mbuf **pkts, uint16_t n)
+{
+	while (n--)
+		rte_pktmbuf_free(pkts[n]);
+}
+
+/*
+ * Waits until every data core has gone through the start of its main loop,
+ * so that none of them still uses data unlinked before the call: the data
+ * cores report a quiescent state at each iteration of their loop.
+ */
+static void
+sync_data_cores(void)
+{
+	rte_rcu_qsbr_synchronize(data_qsbr, RTE_QSBR_THRID_INVALID);
+}
+
+/*
+ * Registers the MAC address of a data VM and gives it a VM id: the last byte
+ * of its MAC address when it is free, as create-vm.sh derives the MAC
+ * addresses from the VM ids, the first free one otherwise. With VMDq, the
+ * ids are limited to the pools of the NIC.
+ * Called with registry_lock held. Returns the id, -1 if no id is free or the
+ * MAC address is already registered.
+ */
+static int
+register_vm(struct vhost_dev *vdev)
+{
+	uint32_t max_id = sw_demux ? MAX_VMS : num_virtio_devices;
+	uint32_t id = vdev->mac_address.addr_bytes[5];
+
+	if (rte_hash_lookup(mac_table, &vdev->mac_address) >= 0)
+		return -1;
+	if (id > max_id || vm_ids[id] != NULL) {
+		for (id = 1; id <= max_id && vm_ids[id] != NULL; id++)
+			;
+		if (id > max_id)
+			return -1;
+	}
+	if (rte_hash_add_key_data(mac_table, &vdev->mac_address, vdev) != 0)
+		return -1;
+	vm_ids[id] = vdev;
+	return id;
+}
+
 /*
- * This function learns the MAC address of the device and registers this along with a
- * vlan tag to a VMDq.
+ * This function learns the MAC address of the device, gives it a VM id and
+ * registers this along with a vlan tag to a VMDq, without --sw-demux.
  */
 static int
 link_vmdq(struct vhost_dev *vdev, struct rte_mbuf *m)
 {
 	struct rte_ether_hdr *pkt_hdr;
-	int i, ret, pool_id;
+	struct vhost_rxq *rxq;
+	int i, ret, vm_id, pool_id;
 
 	/* Learn MAC address of guest device from packet */
 	pkt_hdr = rte_pktmbuf_mtod(m, struct rte_ether_hdr *);
@@ -778,43 +2049,63 @@ link_vmdq(struct vhost_dev *vdev, struct rte_mbuf *m)
 	for (i = 0; i < RTE_ETHER_ADDR_LEN; i++)
 		vdev->mac_address.addr_bytes[i] = pkt_hdr->s_addr.addr_bytes[i];
 	
-	/* the pool id corresponds to the last MAC byte. */
-	pool_id = GET_POOL_ID(vdev->mac_address);
-	if(pools_used[pool_id]) {
-		if (pool_allocation_failure == 0)
-		{
-			RTE_LOG(ERR, VHOST_DATA, "(%d) device uses a MAC address corresponding to a pool (%u) already allocated\n", vdev->vid, pool_id);
-			pool_allocation_failure = 1;
-		}
-		return -1;
-	}
-	
 	/* Configure RX pool and queue only if it's a data vHost */
-	if(pool_id != -1) {
-		vdev->vlan_tag = vlan_tags[pool_id];
-		
-		/* Assign pool queue to the device */
-		vdev->pool_id = (uint16_t) pool_id;
-		vdev->vmdq_rx_q = pool_id * queues_per_pool + vmdq_queue_base;
-		/* Register the  MAC address to the pool of this device */
-		ret = rte_eth_dev_mac_addr_add(used_port_id, &vdev->mac_address, pool_id + vmdq_pool_base);
-		if (ret) {
-			RTE_LOG(ERR, VHOST_DATA, "(%d) failed to add device MAC address to VMDQ\n", vdev->vid);
+	if (!IS_CONTROL_MAC(vdev->mac_address)) {
+		rte_spinlock_lock(&registry_lock);
+		vm_id = register_vm(vdev);
+		if (vm_id == -1) {
+			rte_spinlock_unlock(&registry_lock);
+			if (pool_allocation_failure == 0)
+			{
+				RTE_LOG(ERR, VHOST_DATA, "(%d) device MAC address is already registered, or no VM id is left\n", vdev->vid);
+				pool_allocation_failure = 1;
+			}
 			return -1;
 		}
-		
-		/* Enable VLAN stripping on the device receive queue */
-		rte_eth_dev_set_vlan_strip_on_queue(used_port_id, vdev->vmdq_rx_q, 1);
+		vdev->vlan_tag = vm_id;
+
+		if (!sw_demux) {
+			/* Assign pool queue to the device */
+			pool_id = vm_id - 1;
+			vdev->pool_id = (uint16_t) pool_id;
+			vdev->vmdq_rx_q = pool_id * queues_per_pool + vmdq_queue_base;
+			/* Register the  MAC address to the pool of this device */
+			ret = rte_eth_dev_mac_addr_add(used_port_id, &vdev->mac_address, pool_id + vmdq_pool_base);
+			if (ret) {
+				RTE_LOG(ERR, VHOST_DATA, "(%d) failed to add device MAC address to VMDQ\n", vdev->vid);
+				/* Not ready yet, the data cores do not use the device */
+				vm_ids[vm_id] = NULL;
+				rte_hash_free_key_with_position(mac_table,
+					rte_hash_del_key(mac_table, &vdev->mac_address));
+				rte_spinlock_unlock(&registry_lock);
+				return -1;
+			}
+
+			/* Enable VLAN stripping on the device receive queues */
+			for (i = 0; i < rxq_per_device; i++)
+				rte_eth_dev_set_vlan_strip_on_queue(used_port_id, vdev->vmdq_rx_q + i, 1);
+		}
+		rte_spinlock_unlock(&registry_lock);
+
+		RTE_LOG(INFO, VHOST_DATA, "(%d) MAC %02x:%02x:%02x:%02x:%02x:%02x registered as VM %d\n", vdev->vid,
+			vdev->mac_address.addr_bytes[0], vdev->mac_address.addr_bytes[1],
+			vdev->mac_address.addr_bytes[2], vdev->mac_address.addr_bytes[3],
+			vdev->mac_address.addr_bytes[4], vdev->mac_address.addr_bytes[5], vm_id);
 
 		/* Set device as ready for RX */
+		rte_smp_wmb();
 		vdev->ready = DEVICE_DATA_RX;
-		pools_used[pool_id] = 1;
 	}
 	else {
-		/* Free the core which was assigned to RX, as it is not needed */
-		lcore_info[vdev->rx_coreid].device_num--;
-		TAILQ_REMOVE(&lcore_info[vdev->rx_coreid].rx_vdev_list, vdev, rx_lcore_vdev_entry);
-		vdev->rx_coreid = 0; 
+		/* Free the cores which were assigned to RX, as they are not needed */
+		for (i = 0; i < rxq_per_device; i++) {
+			rxq = &vdev->rxq[i];
+			if (rxq->coreid == RTE_MAX_LCORE)
+				continue;
+			lcore_info[rxq->coreid].device_num--;
+			TAILQ_REMOVE(&lcore_info[rxq->coreid].rxq_list, rxq, lcore_rxq_entry);
+			rxq->coreid = RTE_MAX_LCORE;
+		}
 		vdev->ready = DEVICE_CONTROL;
 	}
 	
@@ -822,292 +2113,2746 @@ link_vmdq(struct vhost_dev *vdev, struct rte_mbuf *m)
 }
 
 /*
- * Removes MAC address and VLAN tag from VMDq.
- * Ensures that nothing is adding buffers to the RX queue before disabling RX on the device.
+ * Removes the device from the registry, and MAC address and VLAN tag from
+ * VMDq.
+ * Called once the data cores no longer poll the queues of the device, to
+ * clear them out before the pool is given to another device. Once they have
+ * gone through another quiescent state, the data cores no longer find the
+ * device by its MAC address either.
  */
-static inline void
+static void
 unlink_vmdq(struct vhost_dev *vdev)
 {
-	unsigned i;
+	unsigned i, q;
 	unsigned rx_count;
-	int pool_id;
+	int32_t pos;
 	struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
 
-	if (vdev->ready == DEVICE_DATA_RX || vdev->ready == DEVICE_CONTROL) {
-		pool_id = GET_POOL_ID(vdev->mac_address);
-
-		/* Clear MAC and VLAN settings */
-		rte_eth_dev_mac_addr_remove(used_port_id, &vdev->mac_address);
-		for (i = 0; i < 6; i++)
-			vdev->mac_address.addr_bytes[i] = 0;
-		vdev->vlan_tag = 0;
-		vdev->pool_id = 0;
-			
-		/* Clear out the receive buffers if it's a data vHost because the control
-		 * channel has no receive buffer. */
-		if(pool_id != -1) { // could have been vdev->ready == DEVICE_DATA_RX
-			rx_count = rte_eth_rx_burst(used_port_id, (uint16_t)vdev->vmdq_rx_q, pkts_burst, MAX_PKT_BURST);
+	if (vdev->ready == DEVICE_DATA_RX) {
+		rte_spinlock_lock(&registry_lock);
+		vm_ids[vdev->vlan_tag] = NULL;
+		pos = rte_hash_del_key(mac_table, &vdev->mac_address);
+		rte_spinlock_unlock(&registry_lock);
+		sync_data_cores();
+		if (pos >= 0)
+			rte_hash_free_key_with_position(mac_table, pos);
+
+		/* No core sends the held packets any more */
+		for (q = 0; vdev->rx_hold != NULL && q < MAX_RXQ_PER_DEVICE; q++) {
+			rte_atomic64_add(&vdev->stats.rx_ring_dropped_atomic, vdev->rx_hold[q].len);
+			free_pkts(vdev->rx_hold[q].pkts, vdev->rx_hold[q].len);
+			vdev->rx_hold[q].len = 0;
+		}
 
-			while (rx_count) {
-				for (i = 0; i < rx_count; i++)
-					rte_pktmbuf_free(pkts_burst[i]);
+		if (!sw_demux) {
+			rte_eth_dev_mac_addr_remove(used_port_id, &vdev->mac_address);
 
-				rx_count = rte_eth_rx_burst(used_port_id, (uint16_t)vdev->vmdq_rx_q, pkts_burst, MAX_PKT_BURST);
+			/* Clear out the receive buffers */
+			for (q = 0; q < rxq_per_device; q++) {
+				do {
+					rx_count = rte_eth_rx_burst(used_port_id, (uint16_t)(vdev->vmdq_rx_q + q), pkts_burst, MAX_PKT_BURST);
+					for (i = 0; i < rx_count; i++)
+						rte_pktmbuf_free(pkts_burst[i]);
+				} while (rx_count);
 			}
-
-			pools_used[pool_id] = 0;
 		}
-		
-		vdev->ready = DEVICE_MAC_LEARNING;
 	}
+
+	/* Clear MAC and VLAN settings */
+	for (i = 0; i < 6; i++)
+		vdev->mac_address.addr_bytes[i] = 0;
+	vdev->vlan_tag = 0;
+	vdev->pool_id = 0;
+}
+
+/*
+ * Holds packets a full ring did not take until deadline. Returns the number
+ * of packets dropped as the buffer is full.
+ */
+static __rte_always_inline uint16_t
+hold_pkts(struct hold_buffer *h, struct rte_mbuf **pkts, uint16_t count, uint64_t deadline)
+{
+	uint16_t i, n = RTE_MIN(count, HOLD_MAX_PKTS - h->len);
+
+	for (i = 0; i < n; i++) {
+		pkts[i]->timestamp = deadline;
+		h->pkts[h->len++] = pkts[i];
+	}
+	free_pkts(&pkts[n], count - n);
+	return count - n;
 }
 
-static inline void
-free_pkts(struct rte_mbuf **pkts, uint16_t n)
+/*
+ * Removes the first sent packets of a holding buffer, taken by the ring, and
+ * drops the next ones which are past their deadline. Returns the number of
+ * packets dropped.
+ */
+static uint16_t
+hold_expire(struct hold_buffer *h, uint16_t sent, uint64_t now)
 {
-	while (n--)
-		rte_pktmbuf_free(pkts[n]);
+	uint16_t i = sent;
+
+	while (i < h->len && (int64_t) (now - h->pkts[i]->timestamp) >= 0)
+		i++;
+	free_pkts(&h->pkts[sent], i - sent);
+	h->len -= i;
+	memmove(h->pkts, &h->pkts[i], h->len * sizeof(h->pkts[0]));
+	return i - sent;
 }
 
+/*
+ * Sends the TX queue of the core. The packets the NIC does not take are
+ * dropped, or held with --hold-us and sent before the next ones. Returns the
+ * number of packets of the queue sent or held.
+ */
 static uint16_t
 do_drain_mbuf_table(struct mbuf_table *tx_q)
 {
-	uint16_t count;
+	struct hold_buffer *h = tx_q->hold;
+	uint16_t count = 0, dropped;
+	uint64_t now;
+
+	if (likely(h == NULL)) {
+		count = rte_eth_tx_burst(used_port_id, tx_q->txq_id, tx_q->m_table, tx_q->len);
+		if (unlikely(count < tx_q->len)) {
+			tx_q->ring_dropped += tx_q->len - count;
+			free_pkts(&tx_q->m_table[count], tx_q->len - count);
+		}
+		tx_q->len = 0;
+		return count;
+	}
+
+	now = rte_rdtsc();
+	if (unlikely(h->len != 0)) {
+		count = rte_eth_tx_burst(used_port_id, tx_q->txq_id, h->pkts, h->len);
+		tx_q->ring_dropped += hold_expire(h, count, now);
+		count = 0;
+	}
+	if (tx_q->len == 0)
+		return 0;
 
-	count = rte_eth_tx_burst(used_port_id, tx_q->txq_id, tx_q->m_table, tx_q->len);
+	if (likely(h->len == 0))
+		count = rte_eth_tx_burst(used_port_id, tx_q->txq_id, tx_q->m_table, tx_q->len);
 	if (unlikely(count < tx_q->len)) {
-		free_pkts(&tx_q->m_table[count], tx_q->len - count);
+		tx_q->held += tx_q->len - count;
+		dropped = hold_pkts(h, &tx_q->m_table[count], tx_q->len - count, now + hold_cycles);
+		tx_q->ring_dropped += dropped;
+		count = tx_q->len - dropped;
 	}
 	tx_q->len = 0;
 	return count;
 }
 
+/*
+ * Enqueues packets into a virtio RX queue of the device, after the packets
+ * held for it with --hold-us; count may be 0 to only send these. The
+ * packets are freed, or held if the queue is full. lock is set when several
+ * cores may feed the device.
+ */
+static __rte_always_inline void
+enqueue_qpair(struct vhost_dev *vdev, uint16_t qpair, struct rte_mbuf **pkts, uint16_t count, const int lock)
+{
+	struct hold_buffer *h;
+	uint16_t queue_id = qpair * VIRTIO_QNUM + VIRTIO_RXQ;
+	uint16_t enqueue_count = 0, sent, dropped = 0, held = 0;
+	uint64_t now;
+
+	if (lock)
+		rte_spinlock_lock(&vdev->rx_lock[qpair]);
+
+	if (likely(vdev->rx_hold == NULL)) {
+		enqueue_count = rte_vhost_enqueue_burst(vdev->vid, queue_id, pkts, count);
+		free_pkts(pkts, count);
+		dropped = count - enqueue_count;
+	} else {
+		h = &vdev->rx_hold[qpair];
+		now = rte_rdtsc();
+		if (unlikely(h->len != 0)) {
+			enqueue_count = rte_vhost_enqueue_burst(vdev->vid, queue_id, h->pkts, h->len);
+			free_pkts(h->pkts, enqueue_count);
+			dropped = hold_expire(h, enqueue_count, now);
+		}
+		sent = 0;
+		if (likely(h->len == 0) && count != 0)
+			sent = rte_vhost_enqueue_burst(vdev->vid, queue_id, pkts, count);
+		free_pkts(pkts, sent);
+		enqueue_count += sent;
+		if (unlikely(sent < count)) {
+			held = count - sent;
+			dropped += hold_pkts(h, &pkts[sent], held, now + hold_cycles);
+		}
+		/* The core sends them again if no packet comes for the device */
+		if (h->len != 0)
+			lcore_info[rte_lcore_id()].rx_hold_vms[vdev->vlan_tag / 64] |= 1ULL << (vdev->vlan_tag % 64);
+	}
+
+	if (lock)
+		rte_spinlock_unlock(&vdev->rx_lock[qpair]);
+
+	rte_atomic64_add(&vdev->stats.rx_success_atomic, enqueue_count);
+	if (unlikely(held != 0))
+		rte_atomic64_add(&vdev->stats.rx_held_atomic, held);
+	if (unlikely(dropped != 0))
+		rte_atomic64_add(&vdev->stats.rx_ring_dropped_atomic, dropped);
+}
+
+/*
+ * Enqueues packets received on the NIC queue index into the device. The
+ * flows RSS puts on a NIC queue all go to the same virtio queue, or to the
+ * first one if the guest disabled it.
+ */
 static __rte_always_inline void
-drain_eth_rx(struct vhost_dev *vdev)
+enqueue_guest(struct vhost_dev *vdev, uint16_t index, struct rte_mbuf **pkts, uint16_t count, const int lock)
+{
+	uint16_t qpair = 0;
+
+	if (lock) {
+		qpair = index % RTE_MIN(vdev->nr_qpairs, MAX_RXQ_PER_DEVICE);
+		if (!(vdev->rx_enabled & (1U << qpair)))
+			qpair = 0;
+	}
+	enqueue_qpair(vdev, qpair, pkts, count, lock);
+}
+
+/*
+ * Sends again the packets the core held for the VMs, when no new packet
+ * came for them. The VMs are found by id, as the devices may be removed
+ * meanwhile: their held packets are then dropped by unlink_vmdq().
+ */
+static uint32_t
+flush_rx_holds(unsigned lcore_id)
+{
+	uint64_t *vms = lcore_info[lcore_id].rx_hold_vms;
+	const int lock = rx_shared;
+	struct vhost_dev *vdev;
+	uint64_t bits;
+	uint32_t w, id, n = 0;
+	uint16_t q, left;
+
+	for (w = 0; w < RTE_DIM(lcore_info[lcore_id].rx_hold_vms); w++) {
+		bits = vms[w];
+		while (bits != 0) {
+			id = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			vdev = vm_ids[id];
+			left = 0;
+			if (vdev != NULL && vdev->ready == DEVICE_DATA_RX && vdev->rx_hold != NULL) {
+				for (q = 0; q < MAX_RXQ_PER_DEVICE; q++) {
+					if (vdev->rx_hold[q].len == 0)
+						continue;
+					n += vdev->rx_hold[q].len;
+					enqueue_qpair(vdev, q, NULL, 0, lock);
+					left |= vdev->rx_hold[q].len;
+				}
+			}
+			if (left == 0)
+				vms[w] &= ~(1ULL << (id % 64));
+		}
+	}
+	return n;
+}
+
+static __rte_always_inline uint16_t
+drain_eth_rx(struct vhost_rxq *rxq)
 {
-	uint16_t rx_count, enqueue_count;
+	struct vhost_dev *vdev = rxq->vdev;
+	uint16_t rx_count;
 	struct rte_mbuf *pkts[MAX_PKT_BURST];
 
 	/* Get data from NIC (and from the particular VMDq) */
-	rx_count = rte_eth_rx_burst(used_port_id, vdev->vmdq_rx_q, pkts, MAX_PKT_BURST);
+	rx_count = rte_eth_rx_burst(used_port_id, vdev->vmdq_rx_q + rxq->index, pkts, MAX_PKT_BURST);
 	if (!rx_count)
-		return;
-	
-	/* Send to vHost */
-	enqueue_count = rte_vhost_enqueue_burst(vdev->vid, VIRTIO_RXQ, pkts, rx_count);
+		return 0;
 	
-	/* Update stats */
+	/* Send to vHost, which frees the packets */
 	rte_atomic64_add(&vdev->stats.rx_total_atomic, rx_count);
-	rte_atomic64_add(&vdev->stats.rx_success_atomic, enqueue_count);
-
-	/* Free memory used by packets */
-	free_pkts(pkts, rx_count);
+	enqueue_guest(vdev, rxq->index, pkts, rx_count, rx_shared);
+	return rx_count;
 }
-				
-/**
- * Tag a packet based on the matching table.
- * Returns the number of tags added.
+
+/*
+ * Drains a RSS queue of the NIC and dispatches its packets to the devices,
+ * with --sw-demux: the unicast packets by destination MAC address, the
+ * others, in promiscuous mode, by VLAN tag like the VMDq pools. The tag is
+ * stripped in software when the NIC did not.
  */
-static inline uint16_t tag_packet(struct rte_mbuf *packet, struct vhost_dev *vdev) {
+static __rte_always_inline uint16_t
+drain_eth_rx_demux(unsigned lcore_id, uint16_t queue_id)
+{
+	struct rte_mbuf *pkts[MAX_PKT_BURST];
+	struct rte_mbuf *batch[MAX_PKT_BURST];
+	struct vhost_dev *vdevs[MAX_PKT_BURST];
+	const void *keys[MAX_PKT_BURST];
 	struct rte_ether_hdr *eth_hdr;
-	struct rte_ipv4_hdr *ipv4_hdr;
-	struct rte_udp_hdr *tp_hdr;
-	struct rte_ether_hdr *oh, *nh;
-	
-	/* We assume always Ethernet. */
-	eth_hdr = rte_pktmbuf_mtod(packet, struct rte_ether_hdr *);
-
-	/* Only IPv4: that means VLAN packets are not allowed. */
-	if(eth_hdr->ether_type == BE_RTE_ETHER_TYPE_IPV4) {
-		ipv4_hdr = (struct rte_ipv4_hdr *)(eth_hdr + 1);
-
-		/* Only TCP/UDP. */
-		if(ipv4_hdr->next_proto_id == IPPROTO_TCP || ipv4_hdr->next_proto_id == IPPROTO_UDP) {
-			tp_hdr = (struct rte_udp_hdr *)((unsigned char *) ipv4_hdr + sizeof(struct rte_ipv4_hdr));
-			/* Matching in the table. */
-			for(int entry_id = 0; entry_id < N_ENTRIES_PER_VHOST; entry_id++) {
-				/* Checking if source and destination IPs match. */
-				if(memcmp(&matching_table[vdev->vlan_tag][entry_id].src_ip, &ipv4_hdr->src_addr, 8))
-					continue;
-
-				/* Checking if TP source and destination ports match */
-				if(memcmp(&matching_table[vdev->vlan_tag][entry_id].src_port, &tp_hdr->src_port, 4))
-					continue;
+	struct vhost_dev *vdev;
+	uint64_t hits;
+	uint32_t pending = 0;
+	uint16_t rx_count, n, i, vlan;
+	int sw_strip;
 
-				if(matching_table[vdev->vlan_tag][entry_id].protocol != ipv4_hdr->next_proto_id)
-					continue;
+	rx_count = rte_eth_rx_burst(used_port_id, queue_id, pkts, MAX_PKT_BURST);
+	if (!rx_count)
+		return 0;
+
+	for (i = 0; i < rx_count; i++)
+		keys[i] = &rte_pktmbuf_mtod(pkts[i], struct rte_ether_hdr *)->d_addr;
+	rte_hash_lookup_bulk_data(mac_table, keys, rx_count, &hits, (void **) vdevs);
+
+	for (i = 0; i < rx_count; i++) {
+		eth_hdr = rte_pktmbuf_mtod(pkts[i], struct rte_ether_hdr *);
+		vlan = 0;
+		sw_strip = 0;
+		if (pkts[i]->ol_flags & PKT_RX_VLAN_STRIPPED)
+			vlan = pkts[i]->vlan_tci & 0xfff;
+		else if (eth_hdr->ether_type == BE_RTE_ETHER_TYPE_VLAN) {
+			vlan = rte_be_to_cpu_16(((struct rte_vlan_hdr *) (eth_hdr + 1))->vlan_tci) & 0xfff;
+			sw_strip = 1;
+		}
+		if (!((hits >> i) & 1))
+			vdevs[i] = (promiscuous && rte_is_multicast_ether_addr(&eth_hdr->d_addr) && vlan <= MAX_VMS) ?
+				vm_ids[vlan] : NULL;
+		if (sw_strip)
+			rte_vlan_strip(pkts[i]);
+		if (vdevs[i] != NULL && vdevs[i]->ready == DEVICE_DATA_RX)
+			pending |= 1U << i;
+		else {
+			lcore_info[lcore_id].rx_unknown++;
+			rte_pktmbuf_free(pkts[i]);
+		}
+	}
 
-				/* Nothing to do */
-				if(matching_table[vdev->vlan_tag][entry_id].n_tags == 0)
-				    return 0;
+	/* Send the packets of each device at once */
+	while (pending != 0) {
+		vdev = vdevs[__builtin_ctz(pending)];
+		n = 0;
+		for (i = __builtin_ctz(pending); i < rx_count; i++) {
+			if (((pending >> i) & 1) && vdevs[i] == vdev) {
+				batch[n++] = pkts[i];
+				pending &= ~(1U << i);
+			}
+		}
+		rte_atomic64_add(&vdev->stats.rx_total_atomic, n);
+		enqueue_guest(vdev, queue_id, batch, n, 1);
+	}
+	return rx_count;
+}
 				
-				/* Shaping: if not allowed to send, do not tag it. */
-				if(likely(do_shape)) 
-				{
-					uint64_t current_tsc;
-					uint64_t generate_tokens;
-					uint64_t delta_cycles;
-					current_tsc = rte_rdtsc();
-					// get difference in cycles					
-					delta_cycles = current_tsc - matching_table[vdev->vlan_tag][entry_id].last_tsc;
-					generate_tokens = delta_cycles * matching_table[vdev->vlan_tag][entry_id].rate_bps;
-					// here we check for overflow, but we consume resources
-					if ( delta_cycles != 0 && generate_tokens/delta_cycles != matching_table[vdev->vlan_tag][entry_id].rate_bps ) 
-					{
-						// we have overflow, which means a lot of time passed between two cycles, we just set generate tokens to big value
-						// e.g., burst size
-						generate_tokens = cpu_freq * matching_table[vdev->vlan_tag][entry_id].burst_bits;
-					}
-					
-					// update timer
-					matching_table[vdev->vlan_tag][entry_id].last_tsc = current_tsc;
-                                	
-					// add tokens
-					if ((matching_table[vdev->vlan_tag][entry_id].n_tokens + generate_tokens) > cpu_freq * matching_table[vdev->vlan_tag][entry_id].burst_bits)
-					{
-						matching_table[vdev->vlan_tag][entry_id].n_tokens = cpu_freq * matching_table[vdev->vlan_tag][entry_id].burst_bits;
-					} else
-					{
-						matching_table[vdev->vlan_tag][entry_id].n_tokens = matching_table[vdev->vlan_tag][entry_id].n_tokens + generate_tokens;
-					}
-			        	
-					// Full packet size on line is: preamble size (8B) + eth. size (14B) + length of IP (variable) + CRC/FCS (4B) + inter. gap (12B) 
-					uint64_t packet_size;
-					packet_size = 8 + sizeof(struct rte_ether_hdr) + 4 + 12 + rte_bswap16(ipv4_hdr->total_length) + 4*matching_table[vdev->vlan_tag][entry_id].n_tags;
-					
-					// Check if we have enough tokens. *8 since packet size is in bytes.	
-					if (matching_table[vdev->vlan_tag][entry_id].n_tokens >  8 * packet_size * cpu_freq)
-					{
-						matching_table[vdev->vlan_tag][entry_id].n_tokens -= 8 * packet_size * cpu_freq;
-					} else
-					{
-						vdev->stats.tx_dropped++;
-						return 0;
-					}
-				}
-			
-				/* We cannot tag if mbuf is shared */
-				if (!RTE_MBUF_DIRECT(packet) || rte_mbuf_refcnt_read(packet) > 1) {
-					return 0;
-				}
+/**
+ * Fills the packet type and header lengths of a packet, unless they were
+ * already provided with it, so that the headers are parsed only once.
+ * IPv4 options, IPv6 extension headers and VLAN headers of the guest are
+ * accounted for in the lengths.
+ */
+static __rte_always_inline void
+parse_packet(struct rte_mbuf *packet)
+{
+	struct rte_net_hdr_lens hdr_lens;
 
-				/* oh = old header, nh = new header */	
-				oh = rte_pktmbuf_mtod(packet, struct rte_ether_hdr *);
+	if (packet->packet_type != RTE_PTYPE_UNKNOWN)
+		return;
 
-				/* Make space in front */
-				nh = (struct rte_ether_hdr*) rte_pktmbuf_prepend(packet, matching_table[vdev->vlan_tag][entry_id].n_tags * sizeof(struct rte_vlan_hdr));
-				if (nh == NULL) {
-					/* Not enough space */
-					return 0;
-				}
+	packet->packet_type = rte_net_get_ptype(packet, &hdr_lens,
+			RTE_PTYPE_L2_MASK | RTE_PTYPE_L3_MASK | RTE_PTYPE_L4_MASK);
+	packet->l2_len = hdr_lens.l2_len;
+	packet->l3_len = hdr_lens.l3_len;
+	packet->l4_len = hdr_lens.l4_len;
+}
 
-				/* Copy the (first part of) the Ethernet header at its new place (oh->nh) */
-				memmove(nh, oh, 2 * RTE_ETHER_ADDR_LEN);
+/* Returns true if the packet is TCP/UDP with its ports in the first segment */
+static __rte_always_inline int
+has_ports(const struct rte_mbuf *packet)
+{
+	uint32_t l4_type = packet->packet_type & RTE_PTYPE_L4_MASK;
 
-				/* Copy list of tags after source and destination MAC */
-				rte_memcpy(&(nh->ether_type), matching_table[vdev->vlan_tag][entry_id].tags, matching_table[vdev->vlan_tag][entry_id].n_tags * 4);
+	return ((l4_type == RTE_PTYPE_L4_TCP) | (l4_type == RTE_PTYPE_L4_UDP)) &
+		(packet->l2_len + packet->l3_len + sizeof(uint32_t) <= rte_pktmbuf_data_len(packet));
+}
 
-				packet->ol_flags &= ~(PKT_RX_VLAN_STRIPPED | PKT_TX_VLAN);
-				if (packet->ol_flags & PKT_TX_TUNNEL_MASK)
-					packet->outer_l2_len += matching_table[vdev->vlan_tag][entry_id].n_tags * sizeof(struct rte_vlan_hdr);
-				else
-					packet->l2_len += matching_table[vdev->vlan_tag][entry_id].n_tags * sizeof(struct rte_vlan_hdr);
-				return matching_table[vdev->vlan_tag][entry_id].n_tags;
-			}
+/**
+ * Extracts the matching table key of packet i of a burst.
+ * The headers are read without branching: the key is only marked valid
+ * if the packet is TCP/UDP over IPv4.
+ */
+static __rte_always_inline void
+extract_key(struct rte_mbuf *packet, uint16_t i, uint16_t vlan_tag, struct burst_keys *bk)
+{
+	struct rte_ipv4_hdr *ipv4_hdr;
+	struct rte_udp_hdr *tp_hdr;
+	struct flow_key key;
+	uint32_t ports;
+	uint16_t w;
+
+	parse_packet(packet);
+	ports = has_ports(packet);
+	ipv4_hdr = rte_pktmbuf_mtod_offset(packet, struct rte_ipv4_hdr *, packet->l2_len);
+	tp_hdr = rte_pktmbuf_mtod_offset(packet, struct rte_udp_hdr *, packet->l2_len + packet->l3_len);
+
+	key.vlan_tag = vlan_tag;
+	key.protocol = ipv4_hdr->next_proto_id;
+	key.pad = 0;
+	key.src_ip = ipv4_hdr->src_addr;
+	key.dst_ip = ipv4_hdr->dst_addr;
+	key.src_port = tp_hdr->src_port;
+	key.dst_port = tp_hdr->dst_port;
+
+	for (w = 0; w < FLOW_KEY_WORDS; w++)
+		bk->words[w][i] = key.words[w];
+	bk->valid |= (uint32_t) (RTE_ETH_IS_IPV4_HDR(packet->packet_type) && ports) << i;
+	bk->ipv6 |= (uint32_t) (RTE_ETH_IS_IPV6_HDR(packet->packet_type) && ports) << i;
+}
 
-			return 0;
-		}
-	}
+/**
+ * Extracts the IPv6 matching table key of a TCP/UDP packet, the header
+ * lengths include the extension headers.
+ */
+static __rte_always_inline void
+extract_key6(struct rte_mbuf *packet, uint16_t vlan_tag, struct flow_key6 *key)
+{
+	struct rte_ipv6_hdr *ipv6_hdr;
+	struct rte_udp_hdr *tp_hdr;
 
-	return 0;
+	ipv6_hdr = rte_pktmbuf_mtod_offset(packet, struct rte_ipv6_hdr *, packet->l2_len);
+	tp_hdr = rte_pktmbuf_mtod_offset(packet, struct rte_udp_hdr *, packet->l2_len + packet->l3_len);
+
+	key->vlan_tag = vlan_tag;
+	key->protocol = (packet->packet_type & RTE_PTYPE_L4_MASK) == RTE_PTYPE_L4_TCP ? IPPROTO_TCP : IPPROTO_UDP;
+	key->pad = 0;
+	key->src_port = tp_hdr->src_port;
+	key->dst_port = tp_hdr->dst_port;
+	rte_memcpy(key->src_ip, ipv6_hdr->src_addr, sizeof(key->src_ip));
+	rte_memcpy(key->dst_ip, ipv6_hdr->dst_addr, sizeof(key->dst_ip));
 }
 
 /**
- * Updates a matching table entry.
+ * Classifies the IPv6 packets of a burst (given by a bitmask) with a single
+ * bulk lookup in the IPv6 matching table.
  */
-static inline void update_table(struct rte_mbuf *packet) {
-	/* Check that it is one of our ctrl packets */
+static __rte_always_inline void
+classify_burst6(struct rte_mbuf **pkts, uint32_t ipv6_mask, uint16_t vlan_tag, struct tagging_entry **entries)
+{
+	struct flow_key6 keys[MAX_PKT_BURST];
+	const void *key_ptrs[MAX_PKT_BURST];
+	int32_t positions[MAX_PKT_BURST];
+	uint16_t pkt_ids[MAX_PKT_BURST];
+	uint16_t i, n_keys = 0;
+
+	for (; ipv6_mask != 0; ipv6_mask &= ipv6_mask - 1) {
+		i = __builtin_ctz(ipv6_mask);
+		extract_key6(pkts[i], vlan_tag, &keys[n_keys]);
+		key_ptrs[n_keys] = &keys[n_keys];
+		pkt_ids[n_keys++] = i;
+	}
+
+	rte_hash_lookup_bulk(flow_table6, key_ptrs, n_keys, positions);
+	for (i = 0; i < n_keys; i++) {
+		/* A slot being filled is not published yet */
+		if (positions[i] >= 0 && flow_entries6[positions[i]].stack != NULL)
+			entries[pkt_ids[i]] = &flow_entries6[positions[i]];
+	}
+}
+
+/**
+ * Returns the bitmask of the packets of a burst whose key is the same as
+ * the key of packet ref, comparing 8 (AVX2) or 4 (SSE) keys at once.
+ */
+static __rte_always_inline uint32_t
+match_burst_keys(const struct burst_keys *bk, uint16_t ref, uint16_t count)
+{
+	uint32_t mask = 0;
+	uint16_t i;
+#if defined(__AVX2__)
+	__m256i eq, ref_word;
+	uint16_t w;
+
+	for (i = 0; i < count; i += 8) {
+		eq = _mm256_set1_epi32(-1);
+		for (w = 0; w < FLOW_KEY_WORDS; w++) {
+			ref_word = _mm256_set1_epi32(bk->words[w][ref]);
+			eq = _mm256_and_si256(eq, _mm256_cmpeq_epi32(ref_word,
+					_mm256_load_si256((const __m256i *) &bk->words[w][i])));
+		}
+		mask |= (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(eq)) << i;
+	}
+#elif defined(__SSE4_2__)
+	__m128i eq, ref_word;
+	uint16_t w;
+
+	for (i = 0; i < count; i += 4) {
+		eq = _mm_set1_epi32(-1);
+		for (w = 0; w < FLOW_KEY_WORDS; w++) {
+			ref_word = _mm_set1_epi32(bk->words[w][ref]);
+			eq = _mm_and_si128(eq, _mm_cmpeq_epi32(ref_word,
+					_mm_load_si128((const __m128i *) &bk->words[w][i])));
+		}
+		mask |= (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(eq)) << i;
+	}
+#else
+	for (i = 0; i < count; i++) {
+		if (bk->words[0][i] == bk->words[0][ref] && bk->words[1][i] == bk->words[1][ref] &&
+				bk->words[2][i] == bk->words[2][ref] && bk->words[3][i] == bk->words[3][ref])
+			mask |= 1U << i;
+	}
+#endif
+	/* Lanes past the burst are garbage */
+	return mask & bk->valid;
+}
+
+/* Hash of a key for the flow cache */
+static __rte_always_inline uint32_t
+flow_key_hash(const struct flow_key *key)
+{
+	uint32_t hash;
+
+	hash = rte_hash_crc_8byte(((uint64_t) key->words[1] << 32) | key->words[0], 0);
+	return rte_hash_crc_8byte(((uint64_t) key->words[3] << 32) | key->words[2], hash);
+}
+
+static __rte_always_inline int
+flow_key_equal(const struct flow_key *a, const struct flow_key *b)
+{
+	return ((a->words[0] ^ b->words[0]) | (a->words[1] ^ b->words[1]) |
+		(a->words[2] ^ b->words[2]) | (a->words[3] ^ b->words[3])) == 0;
+}
+
+/**
+ * Classifies a burst of packets: parses all the headers first (prefetching
+ * ahead), groups the packets of the same flow with vector compares, and
+ * looks up one key per group and per remaining packet in the flow cache of
+ * the lcore. The keys missing the cache are looked up in the matching table,
+ * and then the keys matching no exact rule in the wildcard classifier.
+ * entries[i] is set to the rule matching pkts[i], or NULL if none.
+ */
+static __rte_always_inline void
+classify_burst(struct rte_mbuf **pkts, uint16_t count, uint16_t vlan_tag, struct tagging_entry **entries)
+{
+	struct burst_keys bk;
+	struct flow_key key;
+	struct flow_key keys[MAX_PKT_BURST];
+	const void *key_ptrs[MAX_PKT_BURST];
+	int32_t positions[MAX_PKT_BURST];
+	/* Packets each looked up key applies to */
+	uint32_t key_members[MAX_PKT_BURST];
+	struct flow_cache_entry *key_cache_entries[MAX_PKT_BURST];
+	struct tagging_entry *key_entries[MAX_PKT_BURST];
+	const uint8_t *acl_data[MAX_PKT_BURST];
+	uint32_t acl_results[MAX_PKT_BURST];
+	uint16_t miss_ids[MAX_PKT_BURST];
+	struct flow_cache *cache = lcore_info[rte_lcore_id()].flow_cache;
+	struct flow_cache_entry *ce;
+	struct rte_acl_ctx *ctx;
+	struct tagging_entry *entry;
+	uint32_t pending, members, version, hash;
+	uint16_t i, w, n_keys = 0, n_flows = 0, n_misses = 0;
+
+	/* Read before any lookup, so that results are never cached with a
+	 * version newer than the rules they were obtained from */
+	version = rules_version;
+	rte_smp_rmb();
+
+	/* Parse the whole burst into keys */
+	bk.valid = 0;
+	bk.ipv6 = 0;
+	for (i = 0; i < PREFETCH_OFFSET && i < count; i++)
+		rte_prefetch0(rte_pktmbuf_mtod(pkts[i], void *));
+	for (i = 0; i < count; i++) {
+		entries[i] = NULL;
+		if (i + PREFETCH_OFFSET < count)
+			rte_prefetch0(rte_pktmbuf_mtod(pkts[i + PREFETCH_OFFSET], void *));
+		extract_key(pkts[i], i, vlan_tag, &bk);
+	}
+
+	if (unlikely(bk.ipv6 != 0))
+		classify_burst6(pkts, bk.ipv6, vlan_tag, entries);
+
+	/* Group the packets of the first flows, the others are alone */
+	pending = bk.valid;
+	while (pending != 0) {
+		i = __builtin_ctz(pending);
+		if (n_flows < MAX_BURST_FLOWS) {
+			members = match_burst_keys(&bk, i, count) & pending;
+			n_flows++;
+		} else {
+			members = 1U << i;
+		}
+		pending &= ~members;
+
+		for (w = 0; w < FLOW_KEY_WORDS; w++)
+			key.words[w] = bk.words[w][i];
+
+		/* One probe in the flow cache */
+		hash = (pkts[i]->ol_flags & PKT_RX_RSS_HASH) ? pkts[i]->hash.rss : flow_key_hash(&key);
+		ce = &cache->entries[hash & (FLOW_CACHE_ENTRIES - 1)];
+		if (ce->version == version && flow_key_equal(&ce->key, &key)) {
+			cache->hits += __builtin_popcount(members);
+			for (; members != 0; members &= members - 1)
+				entries[__builtin_ctz(members)] = ce->entry;
+			continue;
+		}
+		cache->misses += __builtin_popcount(members);
+
+		keys[n_keys] = key;
+		key_ptrs[n_keys] = &keys[n_keys];
+		key_cache_entries[n_keys] = ce;
+		key_members[n_keys++] = members;
+	}
+
+	if (n_keys == 0)
+		return;
+
+	rte_hash_lookup_bulk(flow_table, key_ptrs, n_keys, positions);
+	ctx = acl_ctx;
+	for (i = 0; i < n_keys; i++) {
+		key_entries[i] = NULL;
+		if (positions[i] >= 0 && flow_entries[positions[i]].stack != NULL) {
+			key_entries[i] = &flow_entries[positions[i]];
+		} else if (ctx != NULL) {
+			acl_data[n_misses] = (const uint8_t *) &keys[i];
+			miss_ids[n_misses++] = i;
+		}
+	}
+
+	if (n_misses != 0) {
+		rte_acl_classify(ctx, acl_data, acl_results, n_misses, 1);
+		for (i = 0; i < n_misses; i++) {
+			if (acl_results[i] != 0)
+				key_entries[miss_ids[i]] = &acl_entries[acl_results[i] - 1];
+		}
+	}
+
+	/* Apply the results and remember them in the flow cache */
+	for (i = 0; i < n_keys; i++) {
+		entry = key_entries[i];
+		for (members = key_members[i]; members != 0; members &= members - 1)
+			entries[__builtin_ctz(members)] = entry;
+
+		ce = key_cache_entries[i];
+		ce->key = keys[i];
+		ce->entry = entry;
+		ce->version = version;
+	}
+}
+
+/*
+ * Tag writers, one per number of tags so that every copy has a size known
+ * at compile time. The MACs are loaded before the tags are written, as the
+ * old and new headers overlap.
+ */
+#define DEFINE_TAG_WRITER(n) \
+static void \
+write_tags_##n(struct rte_ether_hdr *nh, const struct rte_ether_hdr *oh, const struct vlan_hdr *tags) \
+{ \
+	uint64_t macs_lo; \
+	uint32_t macs_hi; \
+ \
+	memcpy(&macs_lo, oh, sizeof(macs_lo)); \
+	memcpy(&macs_hi, (const uint8_t *) oh + sizeof(macs_lo), sizeof(macs_hi)); \
+	memcpy(&nh->ether_type, tags, (n) * sizeof(struct vlan_hdr)); \
+	memcpy(nh, &macs_lo, sizeof(macs_lo)); \
+	memcpy((uint8_t *) nh + sizeof(macs_lo), &macs_hi, sizeof(macs_hi)); \
+}
+
+DEFINE_TAG_WRITER(0)
+DEFINE_TAG_WRITER(1)
+DEFINE_TAG_WRITER(2)
+DEFINE_TAG_WRITER(3)
+DEFINE_TAG_WRITER(4)
+DEFINE_TAG_WRITER(5)
+DEFINE_TAG_WRITER(6)
+DEFINE_TAG_WRITER(7)
+DEFINE_TAG_WRITER(8)
+DEFINE_TAG_WRITER(9)
+DEFINE_TAG_WRITER(10)
+
+static const tag_writer_t tag_writers[N_TAGS + 1] = {
+	write_tags_0, write_tags_1, write_tags_2, write_tags_3, write_tags_4, write_tags_5,
+	write_tags_6, write_tags_7, write_tags_8, write_tags_9, write_tags_10,
+};
+
+/*
+ * Tags a packet whose data cannot be modified (shared or indirect mbuf,
+ * as given by dequeue zero copy): the Ethernet header and the tags are
+ * written into a header segment chained in front of the untouched payload.
+ * Returns the new head of the packet, NULL on failure.
+ */
+static struct rte_mbuf *
+push_tags_segment(struct rte_mbuf *packet, const struct tag_stack *st)
+{
+	struct rte_mbuf *hdr, *payload;
+	struct rte_ether_hdr *oh, *nh;
+	uint16_t n_sw_tags = st->n_tags - st->n_hw_tags;
+	uint16_t hdr_len = sizeof(struct rte_ether_hdr) + n_sw_tags * sizeof(struct rte_vlan_hdr);
+
+	hdr = rte_pktmbuf_alloc(hdr_pools[rte_socket_id()]);
+	if (unlikely(hdr == NULL))
+		return NULL;
+
+	/* The mbuf fields of a shared mbuf are not ours either, so the payload
+	 * segment is a clone of it. */
+	payload = packet;
+	if (rte_mbuf_refcnt_read(packet) > 1) {
+		payload = rte_pktmbuf_clone(packet, hdr_pools[rte_socket_id()]);
+		if (unlikely(payload == NULL)) {
+			rte_pktmbuf_free(hdr);
+			return NULL;
+		}
+	}
+
+	oh = rte_pktmbuf_mtod(payload, struct rte_ether_hdr *);
+	nh = (struct rte_ether_hdr *) rte_pktmbuf_append(hdr, hdr_len);
+	st->write_tags(nh, oh, &st->tags[st->n_hw_tags]);
+	*(uint16_t *) ((uint8_t *) nh + hdr_len - sizeof(uint16_t)) = oh->ether_type;
+
+	/* Keep the offload metadata on the new head */
+	hdr->ol_flags = payload->ol_flags;
+	hdr->packet_type = payload->packet_type;
+	hdr->tx_offload = payload->tx_offload;
+	hdr->hash = payload->hash;
+
+	rte_pktmbuf_adj(payload, sizeof(struct rte_ether_hdr));
+	if (unlikely(rte_pktmbuf_chain(hdr, payload) != 0)) {
+		rte_pktmbuf_free(hdr);
+		if (payload != packet)
+			rte_pktmbuf_free(payload);
+		else
+			rte_pktmbuf_prepend(payload, sizeof(struct rte_ether_hdr));
+		return NULL;
+	}
+
+	/* The clone holds its own reference on the packet */
+	if (payload != packet)
+		rte_pktmbuf_free(packet);
+
+	return hdr;
+}
+
+/*
+ * Splits a TCP/IPv4 TSO packet into segments of its MSS with rte_gso and
+ * adds them to the TX queue, for NICs that cannot segment the tagged
+ * frames. GSO does not compute checksums: the segments get the IP and TCP
+ * checksum offloads, with the pseudo header checksum of their own length.
+ */
+static void
+tx_enqueue_gso(struct vhost_dev *vdev, struct mbuf_table *tx_q, struct rte_mbuf *packet)
+{
+	struct rte_mbuf *segs[GSO_MAX_SEGS];
+	struct rte_ipv4_hdr *ipv4_hdr;
+	struct rte_tcp_hdr *tcp_hdr;
+	struct rte_gso_ctx gso_ctx = {
+		.direct_pool = gso_direct_pools[rte_socket_id()],
+		.indirect_pool = gso_indirect_pools[rte_socket_id()],
+		.flag = 0,
+		.gso_types = DEV_TX_OFFLOAD_TCP_TSO,
+		.gso_size = packet->l2_len + packet->l3_len + packet->l4_len + packet->tso_segsz,
+	};
+	/* The tags left to the NIC are not copied by rte_gso */
+	uint16_t vlan_tci = packet->vlan_tci, vlan_tci_outer = packet->vlan_tci_outer;
+	struct rte_mbuf *seg;
+	int n_segs, i;
+
+	n_segs = rte_gso_segment(packet, &gso_ctx, segs, GSO_MAX_SEGS);
+	if (unlikely(n_segs < 0)) {
+		vdev->stats.tx_gso_dropped++;
+		rte_pktmbuf_free(packet);
+		return;
+	}
+
+	for (i = 0; i < n_segs; i++) {
+		seg = segs[i];
+		seg->vlan_tci = vlan_tci;
+		seg->vlan_tci_outer = vlan_tci_outer;
+		seg->ol_flags &= ~PKT_TX_TCP_SEG;
+		seg->ol_flags |= PKT_TX_IP_CKSUM | PKT_TX_TCP_CKSUM;
+		ipv4_hdr = rte_pktmbuf_mtod_offset(seg, struct rte_ipv4_hdr *, seg->l2_len);
+		tcp_hdr = (struct rte_tcp_hdr *) ((uint8_t *) ipv4_hdr + seg->l3_len);
+		ipv4_hdr->hdr_checksum = 0;
+		tcp_hdr->cksum = rte_ipv4_phdr_cksum(ipv4_hdr, seg->ol_flags);
+
+		tx_q->m_table[tx_q->len++] = seg;
+		if (unlikely(tx_q->len == MAX_PKT_BURST))
+			vdev->stats.tx_success += (uint64_t)do_drain_mbuf_table(tx_q);
+	}
+}
+
+/* Adds a packet to the TX queue of the core, sending the queue when full */
+static __rte_always_inline void
+tx_enqueue(struct vhost_dev *vdev, struct mbuf_table *tx_q, struct rte_mbuf *packet)
+{
+	if (unlikely(sw_gso && (packet->ol_flags & PKT_TX_TCP_SEG) &&
+			(packet->ol_flags & (PKT_TX_IPV4 | PKT_TX_TUNNEL_MASK)) == PKT_TX_IPV4)) {
+		tx_enqueue_gso(vdev, tx_q, packet);
+		return;
+	}
+
+	tx_q->m_table[tx_q->len++] = packet;
+	if (unlikely(tx_q->len == MAX_PKT_BURST))
+		vdev->stats.tx_success += (uint64_t)do_drain_mbuf_table(tx_q);
+}
+
+/*
+ * Finds the packets of a burst for the other VMs of the host, with
+ * --local-switch. Returns their mask, and their devices in dsts.
+ */
+static __rte_always_inline uint32_t
+find_local(struct rte_mbuf **pkts, uint16_t count, struct vhost_dev *vdev, struct vhost_dev **dsts)
+{
+	const void *keys[MAX_PKT_BURST];
+	uint64_t hits;
+	uint32_t local = 0;
+	uint16_t i;
+
+	if (count == 0)
+		return 0;
+	for (i = 0; i < count; i++)
+		keys[i] = &rte_pktmbuf_mtod(pkts[i], struct rte_ether_hdr *)->d_addr;
+	if (rte_hash_lookup_bulk_data(mac_table, keys, count, &hits, (void **) dsts) <= 0)
+		return 0;
+	for (i = 0; i < count; i++) {
+		if (((hits >> i) & 1) && dsts[i] != vdev && dsts[i]->ready == DEVICE_DATA_RX)
+			local |= 1U << i;
+	}
+	return local;
+}
+
+/*
+ * Enqueues the packets of a device for the VMs of the host into their
+ * virtio RX queues, grouped by VM. The flows of a queue pair of the device
+ * go to the same queue pair of each VM.
+ */
+static __rte_always_inline void
+send_local(struct vhost_dev *vdev, uint16_t qpair, struct rte_mbuf **pkts, struct vhost_dev **dsts, uint16_t count)
+{
+	struct rte_mbuf *batch[MAX_PKT_BURST];
+	struct vhost_dev *dst;
+	uint32_t pending = RTE_LEN2MASK(count, uint32_t);
+	uint16_t i, n;
+
+	while (pending != 0) {
+		dst = dsts[__builtin_ctz(pending)];
+		n = 0;
+		for (i = __builtin_ctz(pending); i < count; i++) {
+			if (((pending >> i) & 1) && dsts[i] == dst) {
+				batch[n++] = pkts[i];
+				pending &= ~(1U << i);
+			}
+		}
+		rte_atomic64_add(&dst->stats.rx_total_atomic, n);
+		enqueue_guest(dst, qpair, batch, n, 1);
+	}
+	vdev->stats.tx_local += count;
+	vdev->stats.tx_success += count;
+}
+
+/* Shaping modes of a worker loop instance */
+#define SHAPE_NONE 0
+#define SHAPE_DROP 1
+#define SHAPE_PACE 2
+
+/* Returned by tag_packet() for a packet kept by the pacer */
+#define TAG_QUEUED UINT16_MAX
+
+/**
+ * Pushes a tag stack on a packet. The packet is replaced when its
+ * headers are pushed in a new segment.
+ * Returns the number of tags added, 0 if the packet could not be tagged.
+ */
+static __rte_always_inline uint16_t
+push_tags(struct rte_mbuf **pkt, const struct tag_stack *st)
+{
+	struct rte_mbuf *packet = *pkt;
+	struct rte_ether_hdr *oh, *nh;
+	uint16_t n_sw_tags;
+
+	/* If the mbuf is shared, the tags go in a header segment */
+	if (unlikely(!RTE_MBUF_DIRECT(packet) || rte_mbuf_refcnt_read(packet) > 1)) {
+		if (!dequeue_zero_copy)
+			return 0;
+		packet = push_tags_segment(packet, st);
+		if (packet == NULL)
+			return 0;
+		*pkt = packet;
+		goto tagged;
+	}
+
+	/* The tags inserted by the NIC are not written at all */
+	n_sw_tags = st->n_tags - st->n_hw_tags;
+	if (n_sw_tags != 0) {
+		/* oh = old header, nh = new header */	
+		oh = rte_pktmbuf_mtod(packet, struct rte_ether_hdr *);
+
+		/* Make space in front */
+		nh = (struct rte_ether_hdr*) rte_pktmbuf_prepend(packet, n_sw_tags * sizeof(struct rte_vlan_hdr));
+		if (nh == NULL) {
+			/* Not enough space */
+			return 0;
+		}
+
+		/* Move the MACs at their new place (oh->nh) and copy the tags after them */
+		st->write_tags(nh, oh, &st->tags[st->n_hw_tags]);
+	}
+
+tagged:
+	n_sw_tags = st->n_tags - st->n_hw_tags;
+	packet->ol_flags &= ~(PKT_RX_VLAN_STRIPPED | PKT_TX_VLAN | PKT_TX_QINQ);
+	packet->ol_flags |= st->hw_ol_flags;
+	packet->vlan_tci = st->vlan_tci;
+	packet->vlan_tci_outer = st->vlan_tci_outer;
+	if (packet->ol_flags & PKT_TX_TUNNEL_MASK)
+		packet->outer_l2_len += n_sw_tags * sizeof(struct rte_vlan_hdr);
+	else
+		packet->l2_len += n_sw_tags * sizeof(struct rte_vlan_hdr);
+	return st->n_tags;
+}
+
+/*
+ * Configures a shaper from a rule message and its optional meter extension.
+ * Returns -1 if the parameters are not valid for the algorithm.
+ */
+static int
+shaper_config(struct shaper *s, const struct rule_msg *msg, const struct rule_msg_ext_meter *meter)
+{
+	if (meter == NULL)
+		return shaper_init(s, SHAPER_TOKEN_BUCKET, msg->rate_bps, msg->burst_bits, msg->n_tokens, 0, 0);
+	return shaper_init(s, meter->algorithm, msg->rate_bps, msg->burst_bits, msg->n_tokens,
+			meter->peak_rate_bps, meter->peak_burst_bits);
+}
+
+/*
+ * Size on line of a packet once tagged. A TSO/UFO packet leaves the NIC as
+ * one frame per segment, each with its own headers, tags and framing.
+ */
+static __rte_always_inline uint32_t
+packet_wire_size(const struct rte_mbuf *packet, const struct tag_stack *st)
+{
+	uint32_t hdr_len, payload_len, n_segs;
+
+	// Full packet size on line is: preamble size (8B) + frame (L2 headers included) + CRC/FCS (4B) + inter. gap (12B) 
+	if (likely(!(packet->ol_flags & (PKT_TX_TCP_SEG | PKT_TX_UDP_SEG)) || packet->tso_segsz == 0))
+		return 8 + rte_pktmbuf_pkt_len(packet) + 4 + 12 + 4*st->n_tags;
+
+	/* UFO segments are IP fragments, only the first one has the UDP header */
+	hdr_len = packet->outer_l2_len + packet->outer_l3_len + packet->l2_len + packet->l3_len;
+	if (packet->ol_flags & PKT_TX_TCP_SEG)
+		hdr_len += packet->l4_len;
+	payload_len = rte_pktmbuf_pkt_len(packet) - RTE_MIN(hdr_len, rte_pktmbuf_pkt_len(packet));
+	n_segs = RTE_MAX((payload_len + packet->tso_segsz - 1) / packet->tso_segsz, 1u);
+	return payload_len + n_segs * (8 + hdr_len + 4 + 12 + 4*st->n_tags);
+}
+
+/*
+ * Checks a packet that passed the bucket of its rule against the aggregate
+ * bucket of its VM, if any. When the aggregate drops the packet, the tokens
+ * it took from the token bucket s of its rule are given back.
+ */
+static __rte_always_inline enum shaper_verdict
+vm_shaper_check(struct vhost_dev *vdev, struct shaper *s, uint32_t size, uint64_t current_tsc,
+		enum shaper_verdict verdict)
+{
+	struct shaper *vm = vm_shapers[vdev->vlan_tag];
+	enum shaper_verdict vm_verdict;
+
+	if (likely(vm == NULL))
+		return verdict;
+
+	vm_verdict = shaper_check(vm, size, current_tsc);
+	if (vm_verdict == SHAPER_DROP) {
+		shaper_refund(s, size);
+		vdev->stats.tx_vm_dropped++;
+		return SHAPER_DROP;
+	}
+	return RTE_MAX(verdict, vm_verdict);
+}
+
+/* Sets the drop eligible indicator of the outermost tag of a tagged packet */
+static __rte_always_inline void
+mark_packet(struct rte_mbuf *packet, const struct tag_stack *st)
+{
+	struct vlan_hdr *vlan_hdr;
+
+	if (st->n_hw_tags == 2) {
+		packet->vlan_tci_outer |= VLAN_DEI;
+	} else if (st->n_hw_tags == 1) {
+		packet->vlan_tci |= VLAN_DEI;
+	} else {
+		vlan_hdr = rte_pktmbuf_mtod_offset(packet, struct vlan_hdr *, 2 * RTE_ETHER_ADDR_LEN);
+		vlan_hdr->vlan_id |= rte_cpu_to_be_16(VLAN_DEI);
+	}
+}
+
+/* Returns true if q is the live pacing queue of the entry on this core */
+static __rte_always_inline int
+pacing_queue_valid(const struct pacing_queue *q, const struct tagging_entry *entry, const struct pacer *pacer)
+{
+	return q->pacer == pacer && q->entry == entry && q->generation == entry->generation;
+}
+
+/* Links a pacing queue in the slot of the wheel matching its release time */
+static void
+pacer_schedule(struct pacer *pacer, struct pacing_queue *q, uint64_t release_tsc)
+{
+	uint64_t tick = release_tsc >> pacer->tick_shift;
+
+	/* Queues beyond the wheel are checked again at its end */
+	if (tick <= pacer->cur_tick)
+		tick = pacer->cur_tick + 1;
+	else if (tick >= pacer->cur_tick + PACING_WHEEL_SLOTS)
+		tick = pacer->cur_tick + PACING_WHEEL_SLOTS - 1;
+
+	q->next = pacer->slots[tick & (PACING_WHEEL_SLOTS - 1)];
+	pacer->slots[tick & (PACING_WHEEL_SLOTS - 1)] = q;
+}
+
+/*
+ * Queues a non conforming packet of a token bucket rule, tail dropping it
+ * beyond the queue depth.
+ */
+static void
+pacer_enqueue(struct pacer *pacer, struct tagging_entry *entry, struct vhost_dev *vdev,
+		struct rte_mbuf *packet, uint32_t size, uint64_t current_tsc)
+{
+	struct pacing_queue *q = entry->pq;
+
+	/* A packet above the burst never conforms, it would block the queue */
+	if (!shaper_tb_fits(entry->shaper, size)) {
+		vdev->stats.tx_dropped++;
+		vdev->stats.tx_pacing_dropped++;
+		rte_pktmbuf_free(packet);
+		return;
+	}
+
+	packet->userdata = NULL;
+	if (q != NULL && pacing_queue_valid(q, entry, pacer)) {
+		if (q->len >= pacing_depth) {
+			vdev->stats.tx_dropped++;
+			vdev->stats.tx_pacing_dropped++;
+			rte_pktmbuf_free(packet);
+			return;
+		}
+		q->tail->userdata = packet;
+		q->tail = packet;
+		q->len++;
+		vdev->stats.tx_paced++;
+		return;
+	}
+
+	/* A rule without rate never conforms */
+	q = pacer->free;
+	if (q == NULL || entry->shaper->tb.rate == 0) {
+		vdev->stats.tx_dropped++;
+		vdev->stats.tx_pacing_dropped++;
+		rte_pktmbuf_free(packet);
+		return;
+	}
+	pacer->free = q->next;
+
+	q->entry = entry;
+	q->generation = entry->generation;
+	q->vdev = vdev;
+	q->head = packet;
+	q->tail = packet;
+	q->len = 1;
+	entry->pq = q;
+	vdev->stats.tx_paced++;
+	pacer_schedule(pacer, q, shaper_tb_release_tsc(entry->shaper, size, current_tsc));
+}
+
+/* Drops the packets of a pacing queue and gives it back */
+static void
+pacer_drop_queue(struct pacer *pacer, struct pacing_queue *q)
+{
+	struct rte_mbuf *packet, *next;
+
+	for (packet = q->head; packet != NULL; packet = next) {
+		next = packet->userdata;
+		rte_pktmbuf_free(packet);
+	}
+	q->vdev->stats.tx_dropped += q->len;
+	q->vdev->stats.tx_pacing_dropped += q->len;
+	q->head = NULL;
+	q->len = 0;
+	q->entry = NULL;
+	q->next = pacer->free;
+	pacer->free = q;
+}
+
+/*
+ * Sends the packets of a pacing queue that conform to the bucket of its
+ * rule, and schedules the queue again if some are left.
+ */
+static void
+pacer_release(struct pacer *pacer, struct pacing_queue *q, uint64_t current_tsc, struct mbuf_table *tx_q)
+{
+	struct tagging_entry *entry = q->entry;
+	struct vhost_dev *vdev = q->vdev;
+	struct rte_mbuf *local_pkts[MAX_PKT_BURST];
+	struct vhost_dev *local_dsts[MAX_PKT_BURST];
+	struct tag_stack *st;
+	struct shaper *s;
+	struct rte_mbuf *packet;
+	enum shaper_verdict verdict;
+	uint32_t size = 0;
+	uint16_t n_local = 0;
+
+	/* The bucket of the rule changed since the packets were queued */
+	if (q->generation != entry->generation) {
+		pacer_drop_queue(pacer, q);
+		return;
+	}
+	/* The tags may have changed, the packets leave with the new ones */
+	st = entry->stack;
+	s = entry->shaper;
+
+	while (q->head != NULL) {
+		packet = q->head;
+		size = packet_wire_size(packet, st);
+		/* New tags may have made it larger than the burst */
+		if (unlikely(!shaper_tb_fits(s, size))) {
+			q->head = packet->userdata;
+			q->len--;
+			vdev->stats.tx_dropped++;
+			vdev->stats.tx_pacing_dropped++;
+			rte_pktmbuf_free(packet);
+			continue;
+		}
+		if (shaper_check(s, size, current_tsc) != SHAPER_PASS)
+			break;
+		q->head = packet->userdata;
+		q->len--;
+
+		verdict = vm_shaper_check(vdev, s, size, current_tsc, SHAPER_PASS);
+		if (verdict == SHAPER_DROP) {
+			vdev->stats.tx_dropped++;
+			rte_pktmbuf_free(packet);
+			continue;
+		}
+		/* The packets for the VMs of the host still skip the NIC, untagged.
+		 * The pacer does not know their queue pair, they use the first one. */
+		if (local_switch && find_local(&packet, 1, vdev, &local_dsts[n_local])) {
+			vdev->stats.tx_tagged++;
+			local_pkts[n_local++] = packet;
+			if (n_local == MAX_PKT_BURST) {
+				send_local(vdev, 0, local_pkts, local_dsts, n_local);
+				n_local = 0;
+			}
+			continue;
+		}
+		if (push_tags(&packet, st) == 0) {
+			rte_pktmbuf_free(packet);
+			continue;
+		}
+		if (unlikely(verdict == SHAPER_MARK))
+			mark_packet(packet, st);
+		vdev->stats.tx_tagged++;
+		tx_enqueue(vdev, tx_q, packet);
+	}
+	if (tx_q->len > 0)
+		vdev->stats.tx_success += (uint64_t)do_drain_mbuf_table(tx_q);
+	if (n_local != 0)
+		send_local(vdev, 0, local_pkts, local_dsts, n_local);
+
+	if (q->head != NULL) {
+		pacer_schedule(pacer, q, shaper_tb_release_tsc(s, size, current_tsc));
+		return;
+	}
+	entry->pq = NULL;
+	q->entry = NULL;
+	q->next = pacer->free;
+	pacer->free = q;
+}
+
+/* Drops the queued packets of a device moved away, and of the removed devices */
+static void
+pacer_flush_vdev(struct pacer *pacer, struct vhost_dev *vdev)
+{
+	struct pacing_queue **prev, *q;
+	unsigned i;
+
+	for (i = 0; i < PACING_WHEEL_SLOTS; i++) {
+		prev = &pacer->slots[i];
+		while ((q = *prev) != NULL) {
+			if (q->vdev != vdev && !q->vdev->remove) {
+				prev = &q->next;
+				continue;
+			}
+			*prev = q->next;
+			pacer_drop_queue(pacer, q);
+		}
+	}
+}
+
+/* Releases the pacing queues whose slots of the wheel have expired */
+static __rte_always_inline void
+pacer_run(struct pacer *pacer, struct mbuf_table *tx_q)
+{
+	struct pacing_queue *q, *next;
+	uint64_t current_tsc = rte_rdtsc();
+	uint64_t tick = current_tsc >> pacer->tick_shift;
+	uint32_t flush_requested = pacer->flush_requested;
+
+	/* Drop the packets of the devices removed since the last run */
+	if (unlikely(flush_requested != pacer->flush_done)) {
+		rte_smp_rmb();
+		pacer_flush_vdev(pacer, NULL);
+		pacer->flush_done = flush_requested;
+	}
+
+	if (tick - pacer->cur_tick > PACING_WHEEL_SLOTS)
+		pacer->cur_tick = tick - PACING_WHEEL_SLOTS;
+
+	while (pacer->cur_tick < tick) {
+		pacer->cur_tick++;
+		q = pacer->slots[pacer->cur_tick & (PACING_WHEEL_SLOTS - 1)];
+		pacer->slots[pacer->cur_tick & (PACING_WHEEL_SLOTS - 1)] = NULL;
+		for (; q != NULL; q = next) {
+			next = q->next;
+			pacer_release(pacer, q, current_tsc, tx_q);
+		}
+	}
+}
+
+/*
+ * Shapes the packets of a burst rule by rule, at the time the burst was
+ * read: the bucket of a token bucket rule is refilled once and debited at
+ * once with the wire size of all the packets of the rule, when it holds
+ * them all. Otherwise the packets are left to the per packet checks of
+ * tag_packet(), which then give the same verdicts. So are the rules with
+ * queued packets or a meter, and all the packets when the VM aggregate,
+ * which rule tokens may be given back to, is enabled.
+ * Returns the bitmask of the packets that conform.
+ */
+static __rte_always_inline uint32_t
+shape_burst(struct rte_mbuf **pkts, uint16_t count, struct tagging_entry **entries, struct vhost_dev *vdev,
+		uint64_t current_tsc, const int shape)
+{
+	struct tagging_entry *entry;
+	struct tag_stack *st;
+	struct shaper *s;
+	struct pacer *pacer = NULL;
+	uint32_t done = 0;
+	uint32_t conforming = 0;
+	uint32_t members;
+	uint64_t cost;
+	uint16_t i, j;
+
+	if (vm_shapers[vdev->vlan_tag] != NULL)
+		return 0;
+	if (shape == SHAPE_PACE)
+		pacer = lcore_info[rte_lcore_id()].pacer;
+
+	for (i = 0; i < count; i++) {
+		entry = entries[i];
+		if (entry == NULL || (done & (1u << i)))
+			continue;
+		st = entry->stack;
+		s = entry->shaper;
+		if (st->n_tags == 0 || s->algo != SHAPER_TOKEN_BUCKET)
+			continue;
+		if (shape == SHAPE_PACE && entry->pq != NULL && pacing_queue_valid(entry->pq, entry, pacer))
+			continue;
+
+		members = 0;
+		cost = 0;
+		for (j = i; j < count; j++) {
+			if (entries[j] == entry) {
+				members |= 1u << j;
+				cost += shaper_tb_cost(packet_wire_size(pkts[j], st));
+			}
+		}
+		done |= members;
+
+		shaper_tb_refill(s, current_tsc);
+		if (s->tb.tokens > cost) {
+			s->tb.tokens -= cost;
+			conforming |= members;
+		}
+	}
+
+	return conforming;
+}
+
+/**
+ * Shape and tag a packet based on the matching table entry it matched.
+ * The packet is replaced when its headers are pushed in a new segment.
+ * shape is a compile time constant of each worker loop instance: without
+ * pacing, non conforming packets are dropped, with pacing they are queued.
+ * conforming is set for the packets already shaped by shape_burst(), and
+ * current_tsc is the time the burst was read. push is cleared for the
+ * packets to a VM of the host, which are shaped but left untagged.
+ * Returns the number of tags added, or of the rule for an untagged packet,
+ * or TAG_QUEUED if the packet was queued.
+ */
+static __rte_always_inline uint16_t
+tag_packet(struct rte_mbuf **pkt, struct vhost_dev *vdev, struct tagging_entry *entry, const int shape,
+		int conforming, uint64_t current_tsc, int push) {
+	enum shaper_verdict verdict = SHAPER_PASS;
+	/* Read once, a rule update may publish new versions meanwhile */
+	struct tag_stack *st = entry->stack;
+	struct shaper *s;
+	uint16_t n_tags;
+	uint32_t size;
+
+	/* Nothing to do */
+	if(st->n_tags == 0)
+	    return 0;
+	
+	/* Shaping: if not allowed to send, do not tag it. */
+	if(shape != SHAPE_NONE && !conforming) 
+	{
+		struct pacer *pacer = NULL;
+
+		if (shape == SHAPE_PACE)
+			pacer = lcore_info[rte_lcore_id()].pacer;
+
+		size = packet_wire_size(*pkt, st);
+		/* Packets of a rule leave in order, behind the queued ones */
+		if (shape == SHAPE_PACE && entry->pq != NULL && pacing_queue_valid(entry->pq, entry, pacer)) {
+			pacer_enqueue(pacer, entry, vdev, *pkt, size, 0);
+			return TAG_QUEUED;
+		}
+
+		s = entry->shaper;
+		verdict = shaper_check(s, size, current_tsc);
+		if (verdict == SHAPER_DROP) {
+			/* Only token bucket rules know when they conform again */
+			if (shape == SHAPE_PACE && s->algo == SHAPER_TOKEN_BUCKET) {
+				pacer_enqueue(pacer, entry, vdev, *pkt, size, current_tsc);
+				return TAG_QUEUED;
+			}
+			vdev->stats.tx_dropped++;
+			return 0;
+		}
+
+		/* The VM as a whole must conform too */
+		verdict = vm_shaper_check(vdev, s, size, current_tsc, verdict);
+		if (verdict == SHAPER_DROP) {
+			vdev->stats.tx_dropped++;
+			return 0;
+		}
+	}
+
+	if (!push)
+		return st->n_tags;
+	n_tags = push_tags(pkt, st);
+	if (unlikely(verdict == SHAPER_MARK) && n_tags != 0)
+		mark_packet(*pkt, st);
+	return n_tags;
+}
+
+/* Returns true on a data core, which must never wait for the others */
+static inline int
+on_data_core(void)
+{
+	unsigned lcore_id = rte_lcore_id();
+
+	return lcore_id != LCORE_ID_ANY && lcore_id != rte_get_master_lcore();
+}
+
+static int
+version_pool_init(struct version_pool *pool, const char *name, uint32_t n, size_t size)
+{
+	char *elts;
+	uint32_t i;
+
+	size = RTE_ALIGN_CEIL(size, RTE_CACHE_LINE_SIZE);
+	elts = rte_zmalloc(name, (size_t) n * size, RTE_CACHE_LINE_SIZE);
+	pool->free = rte_malloc(name, n * sizeof(void *), 0);
+	if (elts == NULL || pool->free == NULL)
+		return -1;
+	for (i = 0; i < n; i++)
+		pool->free[i] = elts + (size_t) i * size;
+	pool->n_free = n;
+	return 0;
+}
+
+/*
+ * Retires a version, or a matching table slot, unlinked by the caller. The
+ * data cores may use it until they report a quiescent state.
+ */
+static void
+version_retire(uint8_t type, void *ptr)
+{
+	struct retired_version *r = &retired[(retired_head + retired_len) % retired_size];
+
+	r->token = rte_rcu_qsbr_start(data_qsbr);
+	r->type = type;
+	r->ptr = ptr;
+	retired_len++;
+}
+
+/* Recycles the retired versions that no data core can still use */
+static void
+reclaim_versions(void)
+{
+	struct retired_version *r;
+	struct tagging_entry *entry;
+
+	while (retired_len != 0) {
+		r = &retired[retired_head];
+		if (rte_rcu_qsbr_check(data_qsbr, r->token, false) != 1)
+			break;
+
+		switch (r->type) {
+		case RETIRED_STACK:
+			stack_pool.free[stack_pool.n_free++] = r->ptr;
+			break;
+		case RETIRED_SHAPER:
+			shaper_pool.free[shaper_pool.n_free++] = r->ptr;
+			break;
+		case RETIRED_SLOT:
+			entry = r->ptr;
+			entry->stack = NULL;
+			entry->shaper = NULL;
+			rte_hash_free_key_with_position(flow_table, entry - flow_entries);
+			break;
+		case RETIRED_SLOT6:
+			entry = r->ptr;
+			entry->stack = NULL;
+			entry->shaper = NULL;
+			rte_hash_free_key_with_position(flow_table6, entry - flow_entries6);
+			break;
+		}
+		retired_head = (retired_head + 1) % retired_size;
+		retired_len--;
+	}
+}
+
+/*
+ * Makes sure that a rule update finds a free stack and a free shaper. Off
+ * the data cores, it waits for the grace period of the retired versions if
+ * needed. On a data core, the update fails instead.
+ * Returns 0 on success, -1 if no version is free.
+ */
+static int
+reserve_versions(void)
+{
+	reclaim_versions();
+	if (stack_pool.n_free != 0 && shaper_pool.n_free != 0)
+		return 0;
+	if (on_data_core() || retired_len == 0)
+		return -1;
+
+	sync_data_cores();
+	reclaim_versions();
+	return stack_pool.n_free != 0 && shaper_pool.n_free != 0 ? 0 : -1;
+}
+
+/*
+ * Adds a key to a matching table, and returns its position. The slots of
+ * the removed rules are only freed after a grace period, which is waited
+ * for when the table is full, off the data cores.
+ */
+static int32_t
+add_flow_key(struct rte_hash *table, const void *key)
+{
+	int32_t pos = -ENOSPC;
+
+	/* The table has more slots than rules, the keys are capped at max_rules */
+	if ((uint32_t) rte_hash_count(table) < max_rules)
+		pos = rte_hash_add_key(table, key);
+	if (pos == -ENOSPC && retired_len != 0 && !on_data_core()) {
+		sync_data_cores();
+		reclaim_versions();
+		if ((uint32_t) rte_hash_count(table) < max_rules)
+			pos = rte_hash_add_key(table, key);
+	}
+	return pos;
+}
+
+/*
+ * Fills a tag stack from a rule message.
+ */
+static void
+fill_stack(struct tag_stack *st, const struct rule_msg *msg)
+{
+	st->n_tags = msg->n_tags;
+	memset(st->tags, 0, sizeof(st->tags));
+	rte_memcpy(st->tags, msg->tags, msg->n_tags * sizeof(struct vlan_hdr));
+
+	/* The NIC inserts the outermost tag, or the two outermost ones with
+	 * QinQ, provided they use the TPIDs it is configured with. */
+	st->n_hw_tags = 0;
+	st->hw_ol_flags = 0;
+	st->vlan_tci = 0;
+	st->vlan_tci_outer = 0;
+	if ((vlan_insert_offloads & DEV_TX_OFFLOAD_QINQ_INSERT) && msg->n_tags >= 2 &&
+			msg->tags[0].eth_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_QINQ) &&
+			msg->tags[1].eth_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN)) {
+		st->n_hw_tags = 2;
+		st->hw_ol_flags = PKT_TX_VLAN | PKT_TX_QINQ;
+		st->vlan_tci_outer = rte_be_to_cpu_16(msg->tags[0].vlan_id);
+		st->vlan_tci = rte_be_to_cpu_16(msg->tags[1].vlan_id);
+	} else if ((vlan_insert_offloads & DEV_TX_OFFLOAD_VLAN_INSERT) && msg->n_tags >= 1 &&
+			msg->tags[0].eth_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN)) {
+		st->n_hw_tags = 1;
+		st->hw_ol_flags = PKT_TX_VLAN;
+		st->vlan_tci = rte_be_to_cpu_16(msg->tags[0].vlan_id);
+	}
+	st->write_tags = tag_writers[msg->n_tags - st->n_hw_tags];
+}
+
+/* Returns true if two shapers have the same parameters, whatever their state */
+static bool
+shaper_same_config(const struct shaper *a, const struct shaper *b)
+{
+	return a->algo == b->algo && a->rate_bps == b->rate_bps && a->burst_bits == b->burst_bits &&
+		a->peak_rate_bps == b->peak_rate_bps && a->peak_burst_bits == b->peak_burst_bits;
+}
+
+/*
+ * Publishes the tags of a rule message, and its shaper when it changed, in
+ * an entry. fresh is set when the entry did not hold the rule before. The
+ * state of the shaper, and the packets the pacer holds for the rule, are
+ * kept when only the tags change. The caller reserved the versions.
+ */
+static void
+publish_entry(struct tagging_entry *entry, const struct rule_msg *msg, const struct shaper *shaper, int fresh)
+{
+	struct tag_stack *st, *old_st;
+	struct shaper *s, *old_s;
+
+	st = stack_pool.free[--stack_pool.n_free];
+	fill_stack(st, msg);
+
+	old_s = entry->shaper;
+	if (fresh || old_s == NULL || !shaper_same_config(old_s, shaper)) {
+		s = shaper_pool.free[--shaper_pool.n_free];
+		*s = *shaper;
+		/* Packets queued by the pacer against the old bucket are dropped */
+		entry->generation++;
+		rte_smp_wmb();
+		entry->shaper = s;
+		if (old_s != NULL)
+			version_retire(RETIRED_SHAPER, old_s);
+	}
+
+	old_st = entry->stack;
+	rte_smp_wmb();
+	entry->stack = st;
+	if (old_st != NULL)
+		version_retire(RETIRED_STACK, old_st);
+}
+
+/*
+ * Removes a rule from the matching table or from the wildcard rules.
+ * A wildcard rule can still be matched until the classifier is rebuilt,
+ * its entry is hence only recycled by the builder, and keeps its versions
+ * until it is filled again.
+ */
+static void
+remove_rule(struct tagging_entry *entry)
+{
+	void *key6;
+
+	/* Packets still queued by the pacer for the rule are dropped */
+	entry->generation++;
+
+	if (entry->ipv6) {
+		if (rte_hash_get_key_with_position(flow_table6, entry - flow_entries6, &key6) == 0)
+			rte_hash_del_key(flow_table6, key6);
+	} else if (!entry->wildcard) {
+		rte_hash_del_key(flow_table, &entry->key);
+	} else {
+		rte_spinlock_lock(&acl_lock);
+		acl_defs[entry - acl_entries].state = ACL_RULE_DELETED;
+		acl_defs[entry - acl_entries].deleted_version = ++acl_version;
+		rte_spinlock_unlock(&acl_lock);
+		return;
+	}
+
+	version_retire(RETIRED_STACK, entry->stack);
+	version_retire(RETIRED_SHAPER, entry->shaper);
+	version_retire(entry->ipv6 ? RETIRED_SLOT6 : RETIRED_SLOT, entry);
+}
+
+/*
+ * Fills the classifier rule of a wildcard rule stored at idx in acl_entries.
+ */
+static void
+fill_acl_rule(struct acl_rule *rule, const struct flow_key *key, const struct rule_msg_ext *ext, uint32_t idx)
+{
+	memset(rule, 0, sizeof(*rule));
+	rule->data.category_mask = 1;
+	rule->data.priority = RTE_MIN(ext->priority, (uint32_t) RTE_ACL_MAX_PRIORITY);
+	rule->data.userdata = idx + 1;
+	acl_rule_set_fields(rule, key, ext->any_protocol, ext->src_prefix_len, ext->dst_prefix_len,
+			ext->src_port_max, ext->dst_port_max);
+}
+
+/*
+ * Adds a wildcard rule. It is matched once the builder has compiled it
+ * into a new classifier.
+ */
+static struct tagging_entry *
+add_wildcard_rule(const struct flow_key *key, uint8_t rule_id, const struct rule_msg *msg, const struct rule_msg_ext *ext,
+		const struct shaper *shaper)
+{
+	struct tagging_entry *entry;
+	uint32_t idx;
+
+	rte_spinlock_lock(&acl_lock);
+	if (acl_n_free == 0) {
+		rte_spinlock_unlock(&acl_lock);
+		return NULL;
+	}
+	idx = acl_free_list[--acl_n_free];
+
+	entry = &acl_entries[idx];
+	entry->key = *key;
+	entry->rule_id = rule_id;
+	entry->wildcard = 1;
+	publish_entry(entry, msg, shaper, 1);
+
+	fill_acl_rule(&acl_defs[idx].rule, key, ext, idx);
+	acl_defs[idx].state = ACL_RULE_ACTIVE;
+	acl_version++;
+	rte_spinlock_unlock(&acl_lock);
+
+	return entry;
+}
+
+/*
+ * Returns true if the extension of a rule message actually describes an
+ * exact rule, which then goes to the matching table.
+ */
+static inline bool
+is_exact_rule(const struct rule_msg *msg, const struct rule_msg_ext *ext)
+{
+	return ext == NULL || (ext->src_prefix_len >= 32 && ext->dst_prefix_len >= 32 &&
+			!ext->any_protocol &&
+			ext->src_port_max == msg->src_port && ext->dst_port_max == msg->dst_port);
+}
+
+/* Builds the key of an IPv6 rule */
+static void
+make_key6(struct flow_key6 *key6, const struct flow_key *key, const struct rule_msg_ext6 *ext6)
+{
+	memset(key6, 0, sizeof(*key6));
+	key6->vlan_tag = key->vlan_tag;
+	key6->protocol = key->protocol;
+	key6->src_port = key->src_port;
+	key6->dst_port = key->dst_port;
+	memcpy(key6->src_ip, ext6->src_ip, sizeof(key6->src_ip));
+	memcpy(key6->dst_ip, ext6->dst_ip, sizeof(key6->dst_ip));
+}
+
+/*
+ * Returns true if an installed entry matches the same packets as a rule
+ * message, key6 being NULL for an IPv4 rule. The rule is then updated in
+ * place, without going through the matching tables.
+ */
+static bool
+same_match(const struct tagging_entry *entry, const struct flow_key *key, const struct flow_key6 *key6,
+		const struct rule_msg *msg, const struct rule_msg_ext *ext)
+{
+	struct acl_rule rule;
+	void *stored_key6;
+
+	if (key6 != NULL)
+		return entry->ipv6 &&
+			rte_hash_get_key_with_position(flow_table6, entry - flow_entries6, &stored_key6) == 0 &&
+			memcmp(stored_key6, key6, sizeof(*key6)) == 0;
+	if (entry->ipv6)
+		return false;
+
+	if (is_exact_rule(msg, ext))
+		return !entry->wildcard && memcmp(&entry->key, key, sizeof(*key)) == 0;
+	if (!entry->wildcard)
+		return false;
+	fill_acl_rule(&rule, key, ext, entry - acl_entries);
+	return memcmp(&rule, &acl_defs[entry - acl_entries].rule, sizeof(rule)) == 0;
+}
+
+/*
+ * Adds an IPv6 rule to the IPv6 matching table.
+ */
+static struct tagging_entry *
+add_rule6(const struct flow_key *key, const struct flow_key6 *key6, uint8_t rule_id, const struct rule_msg *msg,
+		const struct shaper *shaper)
+{
+	struct tagging_entry *entry;
+	int32_t pos;
+
+	/* If another rule ID of this pool has the same five-tuple, it is replaced */
+	pos = rte_hash_lookup(flow_table6, key6);
+	if (pos >= 0) {
+		entry = &flow_entries6[pos];
+		rule_slots[key->vlan_tag][entry->rule_id] = NULL;
+		entry->rule_id = rule_id;
+		publish_entry(entry, msg, shaper, 0);
+		return entry;
+	}
+
+	pos = add_flow_key(flow_table6, key6);
+	if (pos < 0)
+		return NULL;
+	entry = &flow_entries6[pos];
+	entry->key = *key;
+	entry->key.src_ip = 0;
+	entry->key.dst_ip = 0;
+	entry->rule_id = rule_id;
+	entry->wildcard = 0;
+	entry->ipv6 = 1;
+	publish_entry(entry, msg, shaper, 1);
+	return entry;
+}
+
+/**
+ * Installs the rule sent by the control VM for a given pool and rule ID,
+ * replacing the rule previously installed with this ID.
+ * ext is NULL for an exact rule, ext6 is NULL for an IPv4 rule.
+ * Returns 0 on success, -1 if the rule could not be installed.
+ */
+static int
+set_rule(uint16_t vlan_tag, uint8_t rule_id, const struct rule_msg *msg, const struct rule_msg_ext *ext,
+		const struct rule_msg_ext6 *ext6, const struct rule_msg_ext_meter *meter)
+{
+	struct flow_key key;
+	struct flow_key6 key6;
+	struct tagging_entry *entry;
+	struct shaper shaper;
+	int32_t pos;
+
+	if (vlan_tag > MAX_VMS || msg->n_tags > N_TAGS) {
+		RTE_LOG(ERR, VHOST_DATA, "invalid rule %u for pool %u\n", rule_id, vlan_tag);
+		return -1;
+	}
+
+	/* Empty port ranges would never match */
+	if (ext != NULL && (rte_be_to_cpu_16(ext->src_port_max) < rte_be_to_cpu_16(msg->src_port) ||
+			rte_be_to_cpu_16(ext->dst_port_max) < rte_be_to_cpu_16(msg->dst_port))) {
+		RTE_LOG(ERR, VHOST_DATA, "invalid port range for rule %u of pool %u\n", rule_id, vlan_tag);
+		return -1;
+	}
+
+	if (msg->n_tags != 0 && shaper_config(&shaper, msg, meter) != 0) {
+		RTE_LOG(ERR, VHOST_DATA, "invalid shaper for rule %u of pool %u\n", rule_id, vlan_tag);
+		return -1;
+	}
+
+	if (reserve_versions() != 0) {
+		RTE_LOG(ERR, VHOST_DATA, "no free rule version, cannot install rule %u for pool %u\n", rule_id, vlan_tag);
+		return -1;
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.vlan_tag = vlan_tag;
+	key.protocol = msg->protocol;
+	key.src_ip = msg->src_ip;
+	key.dst_ip = msg->dst_ip;
+	key.src_port = msg->src_port;
+	key.dst_port = msg->dst_port;
+	if (ext6 != NULL)
+		make_key6(&key6, &key, ext6);
+
+	/* A rule matching the same packets is updated in place */
+	entry = rule_slots[vlan_tag][rule_id];
+	if (entry != NULL && msg->n_tags != 0 && same_match(entry, &key, ext6 != NULL ? &key6 : NULL, msg, ext)) {
+		publish_entry(entry, msg, &shaper, 0);
+		return 0;
+	}
+
+	/* Remove the rule previously installed with this ID */
+	if (entry != NULL) {
+		remove_rule(entry);
+		rule_slots[vlan_tag][rule_id] = NULL;
+		rte_smp_wmb();
+		rules_version++;
+	}
+
+	/* A rule without tags drops its packets, which is the same as no rule */
+	if (msg->n_tags == 0)
+		return 0;
+
+	if (ext6 != NULL) {
+		entry = add_rule6(&key, &key6, rule_id, msg, &shaper);
+		if (entry == NULL) {
+			RTE_LOG(ERR, VHOST_DATA, "IPv6 matching table full, cannot install rule %u for pool %u\n", rule_id, vlan_tag);
+			return -1;
+		}
+		rule_slots[vlan_tag][rule_id] = entry;
+		rte_smp_wmb();
+		rules_version++;
+		return 0;
+	}
+
+	if (!is_exact_rule(msg, ext)) {
+		entry = add_wildcard_rule(&key, rule_id, msg, ext, &shaper);
+		if (entry == NULL) {
+			RTE_LOG(ERR, VHOST_DATA, "wildcard table full, cannot install rule %u for pool %u\n", rule_id, vlan_tag);
+			return -1;
+		}
+		rule_slots[vlan_tag][rule_id] = entry;
+		return 0;
+	}
+
+	/* If another rule ID of this pool has the same five-tuple, it is replaced */
+	pos = rte_hash_lookup(flow_table, &key);
+	if (pos >= 0) {
+		entry = &flow_entries[pos];
+		rule_slots[vlan_tag][entry->rule_id] = NULL;
+		entry->rule_id = rule_id;
+		publish_entry(entry, msg, &shaper, 0);
+	} else {
+		pos = add_flow_key(flow_table, &key);
+		if (pos < 0) {
+			RTE_LOG(ERR, VHOST_DATA, "matching table full, cannot install rule %u for pool %u\n", rule_id, vlan_tag);
+			return -1;
+		}
+		entry = &flow_entries[pos];
+		entry->key = key;
+		entry->rule_id = rule_id;
+		entry->wildcard = 0;
+		entry->ipv6 = 0;
+		publish_entry(entry, msg, &shaper, 1);
+	}
+
+	rule_slots[vlan_tag][rule_id] = entry;
+	/* Flows cached as matching no rule may match this one */
+	rte_smp_wmb();
+	rules_version++;
+	return 0;
+}
+
+/*
+ * Configures the aggregate bucket of a VM, a rate and a burst of 0
+ * disable it.
+ */
+static int
+set_vm_shaper(uint16_t vlan_tag, const struct rule_msg *msg, const struct rule_msg_ext_meter *meter)
+{
+	struct shaper shaper, *s = NULL, *old_s;
+
+	if (vlan_tag > MAX_VMS) {
+		RTE_LOG(ERR, VHOST_DATA, "invalid aggregate for pool %u\n", vlan_tag);
+		return -1;
+	}
+
+	if (msg->rate_bps != 0 || msg->burst_bits != 0) {
+		if (shaper_config(&shaper, msg, meter) != 0) {
+			RTE_LOG(ERR, VHOST_DATA, "invalid aggregate shaper for pool %u\n", vlan_tag);
+			return -1;
+		}
+		if (reserve_versions() != 0) {
+			RTE_LOG(ERR, VHOST_DATA, "no free rule version, cannot set the aggregate of pool %u\n", vlan_tag);
+			return -1;
+		}
+		s = shaper_pool.free[--shaper_pool.n_free];
+		*s = shaper;
+	}
+
+	/* The TX core of the VM may use the old bucket until its next quiescent state */
+	old_s = vm_shapers[vlan_tag];
+	rte_smp_wmb();
+	vm_shapers[vlan_tag] = s;
+	if (old_s != NULL)
+		version_retire(RETIRED_SHAPER, old_s);
+	return 0;
+}
+
+/* Rule message of the control VM or of the management socket, parsed */
+struct rule_req {
+	uint8_t vlan_tag;
+	uint8_t rule_id;
+	const struct rule_msg *msg;
+	const struct rule_msg_ext *ext;
+	const struct rule_msg_ext6 *ext6;
+	const struct rule_msg_ext_meter *meter;
+	int aggregate;
+};
+
+/* Rule message of a deletion: a rule without tags is removed */
+static const struct rule_msg no_rule;
+
+/* Requests of a bulk request or of a batched control frame being applied */
+static struct rule_req rule_reqs[MGMT_MAX_MSG / sizeof(struct mgmt_req)];
+
+/*
+ * Parses a rule message of len bytes: the pool, the rule ID, the rule and
+ * its extensions.
+ * Returns 0 on success, -1 if the message is truncated.
+ */
+static int
+parse_rule_msg(const uint8_t *data, uint32_t len, struct rule_req *req)
+{
+	const struct rule_msg *msg = (const struct rule_msg *) &data[2];
+	uint32_t ext_offset;
+	uint32_t ext_size;
+	uint8_t ext_type;
+
+	memset(req, 0, sizeof(*req));
+	if (len < 2 + offsetof(struct rule_msg, tags) || msg->n_tags > N_TAGS)
+		return -1;
+	ext_offset = 2 + offsetof(struct rule_msg, tags) + msg->n_tags * sizeof(struct vlan_hdr);
+	if (len < ext_offset)
+		return -1;
+	req->vlan_tag = data[0];
+	req->rule_id = data[1];
+	req->msg = msg;
+
+	/* Wildcard/IPv6 and meter extensions may follow the tags, one after the other */
+	while (len > ext_offset) {
+		ext_type = data[ext_offset];
+		if (ext_type == RULE_EXT_WILDCARD)
+			ext_size = sizeof(struct rule_msg_ext);
+		else if (ext_type == RULE_EXT_IPV6)
+			ext_size = sizeof(struct rule_msg_ext6);
+		else if (ext_type == RULE_EXT_METER)
+			ext_size = sizeof(struct rule_msg_ext_meter);
+		else if (ext_type == RULE_EXT_AGGREGATE)
+			ext_size = sizeof(struct rule_msg_ext_aggregate);
+		else
+			break;
+		if (len < ext_offset + ext_size)
+			break;
+
+		if (ext_type == RULE_EXT_WILDCARD)
+			req->ext = (const struct rule_msg_ext *) &data[ext_offset];
+		else if (ext_type == RULE_EXT_IPV6)
+			req->ext6 = (const struct rule_msg_ext6 *) &data[ext_offset];
+		else if (ext_type == RULE_EXT_METER)
+			req->meter = (const struct rule_msg_ext_meter *) &data[ext_offset];
+		else
+			req->aggregate = 1;
+		ext_offset += ext_size;
+	}
+	return 0;
+}
+
+/*
+ * Installs a parsed rule message. Only called by the main lcore, the
+ * single writer of the rules.
+ */
+static int
+apply_rule_req(const struct rule_req *req)
+{
+	if (req->aggregate)
+		return set_vm_shaper(req->vlan_tag, req->msg, req->meter);
+	return set_rule(req->vlan_tag, req->rule_id, req->msg, req->ext, req->ext6, req->meter);
+}
+
+/*
+ * Appends to buf the SET_RULE request that installs an entry again, and
+ * returns its length, 0 if it does not fit in room bytes.
+ */
+static uint32_t
+mgmt_encode_rule(uint8_t *buf, uint32_t room, uint16_t vlan_tag, uint8_t rule_id, const struct tagging_entry *e)
+{
+	struct mgmt_req *req = (struct mgmt_req *) buf;
+	const struct tag_stack *st = e->stack;
+	const struct shaper *s = e->shaper;
+	const struct acl_rule *r;
+	struct rule_msg *msg;
+	struct rule_msg_ext *ext;
+	struct rule_msg_ext6 *ext6;
+	struct rule_msg_ext_meter *meter;
+	const struct flow_key6 *key6;
+	void *stored_key6;
+	uint32_t len;
+
+	len = 2 + offsetof(struct rule_msg, tags) + st->n_tags * sizeof(struct vlan_hdr);
+	if (e->wildcard)
+		len += sizeof(*ext);
+	if (e->ipv6)
+		len += sizeof(*ext6);
+	if (s->algo != SHAPER_TOKEN_BUCKET)
+		len += sizeof(*meter);
+	if (room < sizeof(*req) + len)
+		return 0;
+
+	req->op = MGMT_OP_SET_RULE;
+	req->pad = 0;
+	req->len = len;
+	req->data[0] = vlan_tag;
+	req->data[1] = rule_id;
+	msg = (struct rule_msg *) &req->data[2];
+	memset(msg, 0, offsetof(struct rule_msg, tags));
+	msg->protocol = e->key.protocol;
+	msg->src_ip = e->key.src_ip;
+	msg->dst_ip = e->key.dst_ip;
+	msg->src_port = e->key.src_port;
+	msg->dst_port = e->key.dst_port;
+	msg->rate_bps = s->rate_bps;
+	msg->burst_bits = s->burst_bits;
+	msg->n_tokens = s->burst_bits;
+	msg->n_tags = st->n_tags;
+	memcpy(msg->tags, st->tags, st->n_tags * sizeof(struct vlan_hdr));
+	len = 2 + offsetof(struct rule_msg, tags) + st->n_tags * sizeof(struct vlan_hdr);
+
+	if (e->wildcard) {
+		r = &acl_defs[e - acl_entries].rule;
+		ext = (struct rule_msg_ext *) &req->data[len];
+		ext->type = RULE_EXT_WILDCARD;
+		ext->src_prefix_len = r->field[ACL_FIELD_SRC].mask_range.u32;
+		ext->dst_prefix_len = r->field[ACL_FIELD_DST].mask_range.u32;
+		ext->any_protocol = r->field[ACL_FIELD_PROTO].mask_range.u8 == 0;
+		ext->src_port_max = rte_cpu_to_be_16(r->field[ACL_FIELD_SRCP].mask_range.u16);
+		ext->dst_port_max = rte_cpu_to_be_16(r->field[ACL_FIELD_DSTP].mask_range.u16);
+		ext->priority = r->data.priority;
+		len += sizeof(*ext);
+	}
+	if (e->ipv6) {
+		ext6 = (struct rule_msg_ext6 *) &req->data[len];
+		ext6->type = RULE_EXT_IPV6;
+		memset(ext6->src_ip, 0, sizeof(ext6->src_ip));
+		memset(ext6->dst_ip, 0, sizeof(ext6->dst_ip));
+		if (rte_hash_get_key_with_position(flow_table6, e - flow_entries6, &stored_key6) == 0) {
+			key6 = stored_key6;
+			memcpy(ext6->src_ip, key6->src_ip, sizeof(ext6->src_ip));
+			memcpy(ext6->dst_ip, key6->dst_ip, sizeof(ext6->dst_ip));
+		}
+		len += sizeof(*ext6);
+	}
+	if (s->algo != SHAPER_TOKEN_BUCKET) {
+		meter = (struct rule_msg_ext_meter *) &req->data[len];
+		meter->type = RULE_EXT_METER;
+		meter->algorithm = s->algo;
+		meter->peak_rate_bps = s->peak_rate_bps;
+		meter->peak_burst_bits = s->peak_burst_bits;
+		len += sizeof(*meter);
+	}
+
+	return sizeof(*req) + len;
+}
+
+/* Fills the statistics of the devices in buf, returns their length */
+static uint32_t
+mgmt_encode_stats(uint8_t *buf, uint32_t room)
+{
+	struct mgmt_dev_stats *ds = (struct mgmt_dev_stats *) buf;
+	struct vhost_dev *vdev;
+	uint32_t n = 0;
+
+	/* Devices are added and removed with the lock held */
+	rte_spinlock_lock(&tx_balance_lock);
+	TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+		if ((n + 1) * sizeof(*ds) > room)
+			break;
+		ds[n].vid = vdev->vid;
+		ds[n].vlan_tag = vdev->vlan_tag;
+		ds[n].tx_coreid = vdev->tx_coreid;
+		ds[n].rx_coreid = vdev->rxq[0].coreid;
+		memcpy(ds[n].mac_address, vdev->mac_address.addr_bytes, RTE_ETHER_ADDR_LEN);
+		ds[n].rx_total = rte_atomic64_read(&vdev->stats.rx_total_atomic);
+		ds[n].rx_success = rte_atomic64_read(&vdev->stats.rx_success_atomic);
+		ds[n].tx_total = vdev->stats.tx_total;
+		ds[n].tx_success = vdev->stats.tx_success;
+		ds[n].tx_tagged = vdev->stats.tx_tagged;
+		ds[n].tx_dropped = vdev->stats.tx_dropped;
+		ds[n].tx_vm_dropped = vdev->stats.tx_vm_dropped;
+		ds[n].tx_paced = vdev->stats.tx_paced;
+		ds[n].tx_pacing_dropped = vdev->stats.tx_pacing_dropped;
+		n++;
+	}
+	rte_spinlock_unlock(&tx_balance_lock);
+	return n * sizeof(*ds);
+}
+
+/*
+ * Checks the SET_RULE/DEL_RULE requests of a bulk request, and parses the
+ * rule messages in reqs. Returns their number, -1 if one is malformed.
+ */
+static int
+mgmt_parse_bulk(const uint8_t *data, uint32_t len, struct rule_req *reqs, uint32_t max_reqs)
+{
+	const struct mgmt_req *req;
+	uint32_t offset = 0;
+	uint32_t n = 0;
+
+	while (offset < len) {
+		req = (const struct mgmt_req *) &data[offset];
+		if (n == max_reqs || len - offset < sizeof(*req) || len - offset - sizeof(*req) < req->len)
+			return -1;
+		if (req->op == MGMT_OP_SET_RULE) {
+			if (parse_rule_msg(req->data, req->len, &reqs[n]) != 0)
+				return -1;
+		} else if (req->op == MGMT_OP_DEL_RULE && req->len >= 2) {
+			memset(&reqs[n], 0, sizeof(reqs[n]));
+			reqs[n].vlan_tag = req->data[0];
+			reqs[n].rule_id = req->data[1];
+			reqs[n].msg = &no_rule;
+		} else {
+			return -1;
+		}
+		offset += sizeof(*req) + req->len;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Applies parsed rule requests in order, the ones that fail do not prevent
+ * the next ones from being applied. The indexes of the first max_failed
+ * failed ones are stored in failed. Returns the number of failed requests.
+ */
+static uint16_t
+apply_rule_reqs(const struct rule_req *reqs, uint16_t n_reqs, uint16_t *failed, uint16_t max_failed)
+{
+	uint16_t i, n_failed = 0;
+
+	for (i = 0; i < n_reqs; i++) {
+		if (apply_rule_req(&reqs[i]) != 0 && n_failed++ < max_failed)
+			failed[n_failed - 1] = i;
+	}
+	return n_failed;
+}
+
+/*
+ * Handles a management request of len bytes and fills its reply.
+ * A bulk request is checked as a whole before any of its rules is applied;
+ * they are then all applied in order, and the reply is a struct ctrl_ack
+ * listing every failed one like the ack of a batched control frame.
+ */
+static void
+mgmt_handle(const uint8_t *buf, uint32_t len, struct mgmt_reply *reply)
+{
+	const struct mgmt_req *req = (const struct mgmt_req *) buf;
+	struct ctrl_ack *ack = (struct ctrl_ack *) reply->data;
+	struct tagging_entry *e;
+	uint32_t room = MGMT_MAX_MSG - sizeof(*reply);
+	uint32_t n, rule_id;
+	int n_reqs;
+
+	reply->status = -1;
+	reply->len = 0;
+	if (len < sizeof(*req) || len - sizeof(*req) < req->len)
+		return;
+
+	switch (req->op) {
+	case MGMT_OP_SET_RULE:
+	case MGMT_OP_DEL_RULE:
+	case MGMT_OP_BULK:
+		if (req->op == MGMT_OP_BULK)
+			n_reqs = mgmt_parse_bulk(req->data, req->len, rule_reqs, RTE_DIM(rule_reqs));
+		else
+			n_reqs = mgmt_parse_bulk(buf, sizeof(*req) + req->len, rule_reqs, 1);
+		if (n_reqs < 0)
+			return;
+		/* Room for every index, a bulk request holds at most 16K rules */
+		ack->n_failed = apply_rule_reqs(rule_reqs, n_reqs, (uint16_t *) (ack + 1),
+				(room - sizeof(*ack)) / sizeof(uint16_t));
+		reply->status = ack->n_failed == 0 ? 0 : -1;
+		if (req->op == MGMT_OP_BULK) {
+			ack->status = ack->n_failed == 0 ? CTRL_ACK_OK : CTRL_ACK_PARTIAL;
+			ack->pad = 0;
+			ack->n_applied = n_reqs - ack->n_failed;
+			reply->len = sizeof(*ack) + ack->n_failed * sizeof(uint16_t);
+		}
+		return;
+	case MGMT_OP_LIST_RULES:
+		if (req->len < 1)
+			return;
+		for (rule_id = 0; rule_id < N_RULE_IDS_PER_VHOST; rule_id++) {
+			e = rule_slots[req->data[0]][rule_id];
+			if (e == NULL)
+				continue;
+			n = mgmt_encode_rule(&reply->data[reply->len], room - reply->len, req->data[0], rule_id, e);
+			if (n == 0)
+				return;
+			reply->len += n;
+		}
+		reply->status = 0;
+		return;
+	case MGMT_OP_STATS:
+		reply->len = mgmt_encode_stats(reply->data, room);
+		reply->status = 0;
+		return;
+	}
+}
+
+/* Creates the listening management socket */
+static int
+mgmt_listen(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, mgmt_socket_path, sizeof(addr.sun_path));
+	unlink(mgmt_socket_path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, MGMT_MAX_CLIENTS) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Serves a request of a management client.
+ * Returns -1 when the client is gone or must be dropped.
+ */
+static int
+mgmt_serve(int fd)
+{
+	static uint8_t req_buf[MGMT_MAX_MSG];
+	static uint8_t reply_buf[MGMT_MAX_MSG];
+	struct mgmt_reply *reply = (struct mgmt_reply *) reply_buf;
+	ssize_t len;
+
+	/* MSG_TRUNC gives the real length of a request too long for the buffer.
+	 * The main lcore never waits for a client: one whose reply does not fit
+	 * in its socket, as it does not read them, is dropped. */
+	len = recv(fd, req_buf, sizeof(req_buf), MSG_TRUNC | MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (len <= 0)
+		return -1;
+	if ((size_t) len > sizeof(req_buf)) {
+		reply->status = -1;
+		reply->len = 0;
+	} else {
+		mgmt_handle(req_buf, len, reply);
+	}
+	if (send(fd, reply, sizeof(*reply) + reply->len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+		return -1;
+	return 0;
+}
+
+/* Queues the ack of a batched control frame for the control VM */
+static void
+send_ctrl_ack(const struct rte_ether_hdr *req_eth, const struct ctrl_hdr *req_hdr, uint8_t status,
+		uint16_t n_applied, uint16_t n_failed, const uint16_t *failed)
+{
+	struct rte_ether_hdr *eth_hdr;
+	struct ctrl_hdr *hdr;
+	struct ctrl_ack *ack;
+	struct rte_mbuf *m;
+	uint16_t n_listed = RTE_MIN(n_failed, CTRL_ACK_MAX_FAILED);
+
+	m = rte_pktmbuf_alloc(mbuf_pools[rte_socket_id()]);
+	if (m == NULL)
+		return;
+	eth_hdr = (struct rte_ether_hdr *) rte_pktmbuf_append(m, sizeof(*eth_hdr) + sizeof(*hdr) + sizeof(*ack) +
+			n_listed * sizeof(uint16_t));
+	if (eth_hdr == NULL) {
+		rte_pktmbuf_free(m);
+		return;
+	}
+	rte_ether_addr_copy(&req_eth->s_addr, &eth_hdr->d_addr);
+	rte_eth_macaddr_get(used_port_id, &eth_hdr->s_addr);
+	eth_hdr->ether_type = rte_cpu_to_be_16(CTRL_ETHER_TYPE_BATCH);
+
+	hdr = (struct ctrl_hdr *) (eth_hdr + 1);
+	hdr->version = CTRL_BATCH_VERSION;
+	hdr->flags = CTRL_FLAG_ACK;
+	hdr->seq = req_hdr->seq;
+	hdr->n_ops = req_hdr->n_ops;
+
+	ack = (struct ctrl_ack *) hdr->ops;
+	ack->status = status;
+	ack->pad = 0;
+	ack->n_applied = n_applied;
+	ack->n_failed = n_failed;
+	memcpy(ack->failed, failed, n_listed * sizeof(uint16_t));
+
+	if (rte_ring_enqueue(ack_ring, m) != 0)
+		rte_pktmbuf_free(m);
+}
+
+/*
+ * Applies the operations of a batched control frame and acks it. The ones
+ * that fail do not prevent the next ones from being applied. A frame sent
+ * again is acked with the result of the first copy.
+ */
+static void
+apply_ctrl_batch(const struct rte_ether_hdr *eth_hdr, uint32_t len)
+{
+	const struct ctrl_hdr *hdr = (const struct ctrl_hdr *) (eth_hdr + 1);
+	struct ctrl_ack_entry *ce;
+	uint16_t *failed;
+	uint16_t n_applied = 0, n_failed = 0;
+	uint8_t status;
+	uint32_t crc;
+	int n_reqs;
+
+	if (len < sizeof(*hdr) || (hdr->flags & CTRL_FLAG_ACK))
+		return;
+
+	crc = rte_hash_crc(hdr, len, 0);
+	ce = &ctrl_acks[hdr->seq % CTRL_ACK_WINDOW];
+	if (ce->len == len && ce->seq == hdr->seq && ce->crc == crc) {
+		send_ctrl_ack(eth_hdr, hdr, ce->status, ce->n_applied, ce->n_failed, ce->failed);
+		return;
+	}
+	failed = ce->failed;
+
+	n_reqs = -1;
+	if (hdr->version == CTRL_BATCH_VERSION)
+		n_reqs = mgmt_parse_bulk(hdr->ops, len - sizeof(*hdr), rule_reqs, RTE_DIM(rule_reqs));
+	if (hdr->version != CTRL_BATCH_VERSION) {
+		status = CTRL_ACK_BAD_VERSION;
+	} else if (n_reqs != hdr->n_ops) {
+		RTE_LOG(ERR, VHOST_DATA, "malformed control frame %u\n", hdr->seq);
+		status = CTRL_ACK_MALFORMED;
+	} else {
+		n_failed = apply_rule_reqs(rule_reqs, n_reqs, failed, CTRL_ACK_MAX_FAILED);
+		n_applied = n_reqs - n_failed;
+		status = n_failed == 0 ? CTRL_ACK_OK : CTRL_ACK_PARTIAL;
+	}
+
+	ce->len = len;
+	ce->crc = crc;
+	ce->seq = hdr->seq;
+	ce->status = status;
+	ce->n_applied = n_applied;
+	ce->n_failed = n_failed;
+	send_ctrl_ack(eth_hdr, hdr, status, n_applied, n_failed, failed);
+}
+
+static inline void update_table(struct rte_mbuf *packet) {
+	/* Check that it is one of our ctrl packets */
 	struct rte_ether_hdr *eth_hdr;
+	struct rule_req req;
+	uint32_t len;
+	if (rte_pktmbuf_data_len(packet) < sizeof(*eth_hdr))
+		return;
 	eth_hdr = rte_pktmbuf_mtod(packet, struct rte_ether_hdr *);
-	
+	len = rte_pktmbuf_data_len(packet) - sizeof(*eth_hdr);
+
+	/* Batch of operations */
+	if (eth_hdr->ether_type == rte_cpu_to_be_16(CTRL_ETHER_TYPE_BATCH)) {
+		apply_ctrl_batch(eth_hdr, len);
+		return;
+	}
+
 	/* Check if the frame has our Ether type */
 	if(eth_hdr->ether_type == 0xbebe) {
 		/* Skip Ethernet header and check data */
-		uint8_t* data = (uint8_t*)(eth_hdr + 1);
-		matching_table[data[0]][data[1]] = *((struct tagging_entry*) &data[2]); 
-		/* we override last time stamp with the current one */
-		matching_table[data[0]][data[1]].last_tsc = rte_rdtsc();
-		/* in order to avoid using floats or doubles, number of tokens is multiplied with cpu_freq */ 
-		matching_table[data[0]][data[1]].n_tokens = cpu_freq*matching_table[data[0]][data[1]].n_tokens;
+		if (parse_rule_msg((const uint8_t *) (eth_hdr + 1), len, &req) != 0) {
+			RTE_LOG(ERR, VHOST_DATA, "truncated control frame\n");
+			return;
+		}
+		apply_rule_req(&req);
 	}
 }
 
-static __rte_always_inline void
-drain_virtio_tx(struct vhost_dev *vdev)
+/*
+ * Loop of the main lcore, the only writer of the rules: applies the rule
+ * messages of the control VM queued by its TX core, and serves the
+ * management socket if any. Never returns.
+ */
+static void
+control_loop(void)
+{
+	struct pollfd fds[1 + MGMT_MAX_CLIENTS];
+	struct rte_mbuf *pkts[MAX_PKT_BURST];
+	unsigned n_fds = 0, n_clients_fd, i, n;
+	int fd;
+
+	if (mgmt_socket_path[0] != '\0') {
+		fds[0].fd = mgmt_listen();
+		if (fds[0].fd < 0)
+			rte_exit(EXIT_FAILURE, "Cannot create management socket %s\n", mgmt_socket_path);
+		fds[0].events = POLLIN;
+		n_fds = 1;
+		RTE_LOG(INFO, VHOST_CONFIG, "Management socket %s ready\n", mgmt_socket_path);
+	}
+
+	while (1) {
+		if (dump_requested) {
+			dump_requested = 0;
+			print_table();
+			print_stats();
+		}
+
+		n = rte_ring_dequeue_burst(ctrl_ring, (void **) pkts, MAX_PKT_BURST, NULL);
+		for (i = 0; i < n; i++) {
+			update_table(pkts[i]);
+			rte_pktmbuf_free(pkts[i]);
+		}
+
+		/* Sleeps 1 ms between the bursts of the control VM when idle */
+		if (poll(fds, n_fds, n == MAX_PKT_BURST ? 0 : 1) <= 0)
+			continue;
+
+		n_clients_fd = n_fds;
+		for (i = 1; i < n_clients_fd; i++) {
+			if (fds[i].revents == 0)
+				continue;
+			if (!(fds[i].revents & POLLIN) || mgmt_serve(fds[i].fd) != 0) {
+				close(fds[i].fd);
+				fds[i].fd = -1;
+			}
+		}
+		/* Compact the closed clients out */
+		for (i = 1; i < n_fds; ) {
+			if (fds[i].fd < 0)
+				fds[i] = fds[--n_fds];
+			else
+				i++;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			fd = accept(fds[0].fd, NULL, NULL);
+			if (fd >= 0 && n_fds == RTE_DIM(fds)) {
+				RTE_LOG(ERR, VHOST_CONFIG, "Too many management clients\n");
+				close(fd);
+			} else if (fd >= 0) {
+				fds[n_fds].fd = fd;
+				fds[n_fds].events = POLLIN;
+				fds[n_fds].revents = 0;
+				n_fds++;
+			}
+		}
+	}
+}
+
+/*
+ * Compiles the wildcard rules into a new classifier whenever they change,
+ * and swaps it with the one used by the data cores. Runs in a control
+ * thread so that building never stalls the data cores.
+ */
+static void *
+acl_builder(__rte_unused void *arg)
+{
+	struct acl_rule *rules;
+	struct rte_acl_ctx *ctx, *old_ctx;
+	struct rte_acl_param param;
+	struct rte_acl_config cfg;
+	char name[RTE_ACL_NAMESIZE];
+	uint32_t built_version = 0, version, n_rules, i;
+	int ret;
+
+	rules = rte_malloc("acl rules", max_acl_rules * sizeof(struct acl_rule), 0);
+	if (rules == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot allocate wildcard rules\n");
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.num_categories = 1;
+	cfg.num_fields = ACL_NUM_FIELDS;
+	memcpy(cfg.defs, acl_field_defs, sizeof(acl_field_defs));
+
+	while (1) {
+		if (acl_version == built_version) {
+			usleep(1000);
+			continue;
+		}
+
+		/* Snapshot the active rules */
+		n_rules = 0;
+		rte_spinlock_lock(&acl_lock);
+		version = acl_version;
+		for (i = 0; i < max_acl_rules; i++) {
+			if (acl_defs[i].state == ACL_RULE_ACTIVE)
+				rules[n_rules++] = acl_defs[i].rule;
+		}
+		rte_spinlock_unlock(&acl_lock);
+
+		ctx = NULL;
+		if (n_rules > 0) {
+			snprintf(name, sizeof(name), "acl_%u", version);
+			param.name = name;
+			param.socket_id = rte_socket_id();
+			param.rule_size = RTE_ACL_RULE_SZ(ACL_NUM_FIELDS);
+			param.max_rule_num = n_rules;
+
+			ctx = rte_acl_create(&param);
+			if (ctx == NULL) {
+				RTE_LOG(ERR, VHOST_CONFIG, "Cannot create wildcard classifier\n");
+				usleep(1000);
+				continue;
+			}
+			ret = rte_acl_add_rules(ctx, (struct rte_acl_rule *) rules, n_rules);
+			if (ret == 0)
+				ret = rte_acl_build(ctx, &cfg);
+			if (ret != 0) {
+				RTE_LOG(ERR, VHOST_CONFIG, "Cannot build wildcard classifier: %s\n", strerror(-ret));
+				rte_acl_free(ctx);
+				usleep(1000);
+				continue;
+			}
+		}
+
+		/* Publish it and wait for the data cores to stop using the old one */
+		old_ctx = acl_ctx;
+		rte_smp_wmb();
+		acl_ctx = ctx;
+		rte_smp_wmb();
+		rules_version++;
+		sync_data_cores();
+		if (old_ctx != NULL)
+			rte_acl_free(old_ctx);
+
+		/* Deleted rules cannot be matched anymore, recycle their entries */
+		rte_spinlock_lock(&acl_lock);
+		for (i = 0; i < max_acl_rules; i++) {
+			if (acl_defs[i].state == ACL_RULE_DELETED && (int32_t) (version - acl_defs[i].deleted_version) >= 0) {
+				acl_defs[i].state = ACL_RULE_FREE;
+				acl_free_list[acl_n_free++] = i;
+			}
+		}
+		rte_spinlock_unlock(&acl_lock);
+
+		built_version = version;
+		RTE_LOG(INFO, VHOST_CONFIG, "Wildcard classifier rebuilt with %u rules\n", n_rules);
+	}
+
+	return NULL;
+}
+
+/*
+ * Drains the guest virtio TX queue. tag and shape are compile time
+ * constants of each worker loop instance, see switch_worker().
+ * Returns the number of packets dequeued, and of acks sent.
+ */
+static __rte_always_inline uint16_t
+drain_virtio_tx(struct vhost_dev *vdev, uint16_t queue_id, const int tag, const int shape)
 {
 	struct rte_mbuf *pkts[MAX_PKT_BURST];
+	struct tagging_entry *entries[MAX_PKT_BURST];
+	struct vhost_dev *dsts[MAX_PKT_BURST];
+	struct rte_mbuf *local_pkts[MAX_PKT_BURST];
+	struct vhost_dev *local_dsts[MAX_PKT_BURST];
 	struct mbuf_table *tx_q = &lcore_tx_queue[rte_lcore_id()];
 	uint16_t count;
 	uint16_t i;
-	uint8_t n_tags = 0;
+	uint16_t n_tags = 0;
+	uint16_t n_local = 0;
+	uint32_t conforming = 0;
+	uint32_t local = 0;
+	uint64_t current_tsc = 0;
+
+	/* Get packets from vHost */
+	count = rte_vhost_dequeue_burst(vdev->vid, queue_id, mbuf_pools[rte_socket_id()], pkts, MAX_PKT_BURST);
+
+	/* setup VMDq for the first packet */
+	if (unlikely(vdev->ready == DEVICE_MAC_LEARNING) && count) {
+		if (vdev->remove || link_vmdq(vdev, pkts[0]) == -1)
+			free_pkts(pkts, count);
+	}
+
+	/* Control processing, left to the main lcore */
+	if(unlikely(vdev->ready == DEVICE_CONTROL)) {
+		for (i = 0; i < count; ++i) {
+			vdev->stats.tx_total += 1;
+			if (in_band_control && rte_ring_enqueue(ctrl_ring, pkts[i]) == 0) {
+				vdev->stats.tx_tagged += 1;
+				continue;
+			}
+			vdev->stats.tx_dropped += 1;
+			rte_pktmbuf_free(pkts[i]);
+		}
+
+		/* Acks of the batched control frames applied meanwhile */
+		if (queue_id == VIRTIO_TXQ) {
+			i = rte_ring_dequeue_burst(ack_ring, (void **) pkts, MAX_PKT_BURST, NULL);
+			if (i != 0) {
+				rte_vhost_enqueue_burst(vdev->vid, VIRTIO_RXQ, pkts, i);
+				free_pkts(pkts, i);
+				count += i;
+			}
+		}
+	}
+	/* Data processing */
+	else if(likely(vdev->ready == DEVICE_DATA_RX)) {
+		/* Match the whole burst at once */
+		if(tag)
+			classify_burst(pkts, count, vdev->vlan_tag, entries);
+
+		/* Shape the burst at once, with a single clock read */
+		if(tag && shape != SHAPE_NONE) {
+			current_tsc = rte_rdtsc();
+			conforming = shape_burst(pkts, count, entries, vdev, current_tsc, shape);
+		}
+
+		/* The packets for the VMs of the host skip the NIC */
+		if (local_switch)
+			local = find_local(pkts, count, vdev, dsts);
+
+		for (i = 0; i < count; ++i) {
+			vdev->stats.tx_total++;
+			if(tag) {
+				n_tags = 0;
+				if (entries[i] != NULL)
+					n_tags = tag_packet(&pkts[i], vdev, entries[i], shape,
+							(conforming >> i) & 1, current_tsc, !((local >> i) & 1));
+				/* The pacer sends it later */
+				if (n_tags == TAG_QUEUED)
+					continue;
+				/* If packet tag packet returned zero tags, it means: */
+				/* 1. Packet didn't match any rule in the table, */
+		        	/* 2. Packet is maybe dropped by shaper, */
+				/* 3. Other memory issues. */
+				if (n_tags == 0) {
+					/* Free pkt memory as we are dropping it. */
+					rte_pktmbuf_free(pkts[i]);
+					continue;
+				}
+			}
+			/* If we dont tag, we forward everything (?). */
+			vdev->stats.tx_tagged++;
+			if (unlikely((local >> i) & 1)) {
+				local_pkts[n_local] = pkts[i];
+				local_dsts[n_local++] = dsts[i];
+			} else
+				/* Add packet to the TX queue */
+				tx_enqueue(vdev, tx_q, pkts[i]);
+		}
+		
+		/* Drain table */	
+		if(likely(tx_q->len > 0)) {
+			vdev->stats.tx_success += (uint64_t)do_drain_mbuf_table(tx_q);
+		}
+		if (n_local != 0)
+			send_local(vdev, queue_id / VIRTIO_QNUM, local_pkts, local_dsts, n_local);
+	}
+
+	return count;
+}
+
+/* Reads the kicks of a virtio queue that woke up a sleeping core */
+static void
+drain_kick(int fd, void *arg __rte_unused)
+{
+	eventfd_t value;
+
+	eventfd_read(fd, &value);
+}
+
+/* Enables/disables the kicks of the guest on the virtio TX queues of a device */
+static void
+set_tx_notification(struct vhost_dev *vdev, int enable)
+{
+	uint16_t q;
+
+	for (q = 0; q < vdev->nr_qpairs; q++)
+		rte_vhost_enable_guest_notification(vdev->vid, q * VIRTIO_QNUM + VIRTIO_TXQ, enable);
+}
+
+/*
+ * Arms the RX interrupts and the kicks of the queues of an idle data core,
+ * in a new epoll instance. Returns -1 when the core has to keep polling:
+ * its pacer holds packets, acks are waiting or a device is being moved.
+ */
+static int
+arm_sleep(unsigned lcore_id)
+{
+	struct lcore_sleep *sl = lcore_info[lcore_id].sleep;
+	struct pacer *pacer = lcore_info[lcore_id].pacer;
+	struct vhost_rxq *rxq;
+	struct vhost_dev *vdev;
+	struct rte_vhost_vring vring;
+	struct rte_epoll_event *ev;
+	uint16_t q, queue_id;
+	unsigned i;
+
+	if (pacer != NULL) {
+		if (pacer->flush_requested != pacer->flush_done)
+			return -1;
+		for (i = 0; i < PACING_WHEEL_SLOTS; i++) {
+			if (pacer->slots[i] != NULL)
+				return -1;
+		}
+	}
+	if (!rte_ring_empty(ack_ring))
+		return -1;
+	TAILQ_FOREACH(vdev, &lcore_info[lcore_id].tx_vdev_list, tx_lcore_vdev_entry) {
+		if (vdev->tx_move != TX_MOVE_NONE)
+			return -1;
+	}
 
-	/* Get packets from vHost */
-	count = rte_vhost_dequeue_burst(vdev->vid, VIRTIO_TXQ, mbuf_pool, pkts, MAX_PKT_BURST);
+	sl->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (sl->epfd < 0)
+		return -1;
 
-	/* setup VMDq for the first packet */
-	if (unlikely(vdev->ready == DEVICE_MAC_LEARNING) && count) {
-		if (vdev->remove || link_vmdq(vdev, pkts[0]) == -1)
-			free_pkts(pkts, count);
+	sl->n_rx_intr = 0;
+	if (rx_intr && sw_demux) {
+		queue_id = lcore_info[lcore_id].nic_rxq;
+		if (lcore_info[lcore_id].nic_rxq >= 0 &&
+				rte_eth_dev_rx_intr_ctl_q(used_port_id, queue_id, sl->epfd, RTE_INTR_EVENT_ADD, NULL) == 0) {
+			rte_eth_dev_rx_intr_enable(used_port_id, queue_id);
+			sl->rx_intr[sl->n_rx_intr++] = queue_id;
+		}
+	} else if (rx_intr) {
+		TAILQ_FOREACH(rxq, &lcore_info[lcore_id].rxq_list, lcore_rxq_entry) {
+			if (rxq->vdev->ready != DEVICE_DATA_RX || sl->n_rx_intr == SLEEP_MAX_FDS)
+				continue;
+			queue_id = rxq->vdev->vmdq_rx_q + rxq->index;
+			if (rte_eth_dev_rx_intr_ctl_q(used_port_id, queue_id, sl->epfd, RTE_INTR_EVENT_ADD, NULL) != 0)
+				continue;
+			rte_eth_dev_rx_intr_enable(used_port_id, queue_id);
+			sl->rx_intr[sl->n_rx_intr++] = queue_id;
+		}
 	}
 
-	/* Control processing */
-	if(unlikely(vdev->ready == DEVICE_CONTROL)) {
-		for (i = 0; i < count; ++i) {
-			vdev->stats.tx_total += 1;
-			update_table(pkts[i]);
-			vdev->stats.tx_tagged += 1;
-			rte_pktmbuf_free(pkts[i]);
+	sl->n_kicks = 0;
+	TAILQ_FOREACH(vdev, &lcore_info[lcore_id].tx_vdev_list, tx_lcore_vdev_entry) {
+		for (q = 0; q < vdev->nr_qpairs && sl->n_kicks < SLEEP_MAX_FDS; q++) {
+			queue_id = q * VIRTIO_QNUM + VIRTIO_TXQ;
+			if (rte_vhost_get_vhost_vring(vdev->vid, queue_id, &vring) != 0 || vring.kickfd < 0)
+				continue;
+			ev = &sl->kicks[sl->n_kicks];
+			memset(ev, 0, sizeof(*ev));
+			ev->epdata.cb_fun = drain_kick;
+			if (rte_epoll_ctl(sl->epfd, EPOLL_CTL_ADD, vring.kickfd, ev) != 0)
+				continue;
+			rte_vhost_enable_guest_notification(vdev->vid, queue_id, 1);
+			sl->n_kicks++;
 		}
 	}
-	/* Data processing */
-	else if(likely(vdev->ready == DEVICE_DATA_RX)) {
-		for (i = 0; i < count; ++i) {
-			vdev->stats.tx_total++;
-			if(likely(do_tag)) {
-				n_tags = tag_packet(pkts[i], vdev);			
-				/* If packet tag packet returned zero tags, it means: */
-				/* 1. Packet didn't match any rule in the table, */
-		        	/* 2. Packet is maybe dropped by shaper, */
-				/* 3. Other memory issues. */
-				if (n_tags != 0) {
-					/* Add packet to the TX queue */
-					tx_q->m_table[tx_q->len++] = pkts[i];
-					vdev->stats.tx_tagged++;
-				} 
-				else
-				{
-					/* Free pkt memory as we are dropping it. */
-					rte_pktmbuf_free(pkts[i]);
-				}
-			}
-			else
-			{
-				/* If we dont tag, we forward everything (?). */
-				vdev->stats.tx_tagged++; 
-				tx_q->m_table[tx_q->len++] = pkts[i];
-			}
 
-			/* Fully send buffer if it's full */
-			if (unlikely(tx_q->len == MAX_PKT_BURST))
-				vdev->stats.tx_success += (uint64_t)do_drain_mbuf_table(tx_q);
+	/* The guest checks the flags after publishing its buffers, the next
+	 * poll reads the rings after setting them */
+	rte_smp_mb();
+	return 0;
+}
 
-		}
-		
-		/* Drain table */	
-		if(likely(tx_q->len > 0)) {
-			vdev->stats.tx_success += (uint64_t)do_drain_mbuf_table(tx_q);
-		}
+/*
+ * Disarms what arm_sleep() armed. The kicks are disabled on the devices
+ * still handled by the core, the others are gone with their vrings or
+ * disabled when they were moved. Closing the epoll instance unregisters the
+ * kick file descriptors.
+ */
+static void
+disarm_sleep(unsigned lcore_id)
+{
+	struct lcore_sleep *sl = lcore_info[lcore_id].sleep;
+	struct vhost_dev *vdev;
+	uint32_t i;
+
+	for (i = 0; i < sl->n_rx_intr; i++) {
+		rte_eth_dev_rx_intr_disable(used_port_id, sl->rx_intr[i]);
+		rte_eth_dev_rx_intr_ctl_q(used_port_id, sl->rx_intr[i], sl->epfd, RTE_INTR_EVENT_DEL, NULL);
 	}
+	TAILQ_FOREACH(vdev, &lcore_info[lcore_id].tx_vdev_list, tx_lcore_vdev_entry)
+		set_tx_notification(vdev, 0);
+
+	close(sl->epfd);
+	sl->epfd = -1;
+}
+
+/*
+ * Sleeps until an armed queue fires or max_sleep_ms elapses, then goes back
+ * to polling. The core is offline meanwhile, so that the configuration core
+ * does not wait for it.
+ */
+static void
+worker_sleep(unsigned lcore_id)
+{
+	struct lcore_sleep *sl = lcore_info[lcore_id].sleep;
+	struct rte_epoll_event events[SLEEP_WAIT_EVENTS];
+	uint64_t start, end, cycles;
+	int n;
+
+	rte_rcu_qsbr_thread_offline(data_qsbr, lcore_id);
+	start = rte_rdtsc();
+	n = rte_epoll_wait(sl->epfd, events, SLEEP_WAIT_EVENTS, max_sleep_ms);
+	end = rte_rdtsc();
+	rte_rcu_qsbr_thread_online(data_qsbr, lcore_id);
+	disarm_sleep(lcore_id);
+
+	sl->sleeps++;
+	if (n > 0)
+		sl->woken++;
+	else
+		sl->timeouts++;
+	sl->slept_cycles += end - start;
+	cycles = rte_rdtsc() - end;
+	sl->wake_cycles += cycles;
+	if (cycles > sl->wake_cycles_max)
+		sl->wake_cycles_max = cycles;
 }
 
 /*
@@ -1127,12 +4872,88 @@ drain_virtio_tx(struct vhost_dev *vdev)
  *      physical eth dev.
  * }
  */
+static __rte_always_inline void
+switch_worker_loop(unsigned lcore_id, const int tag, const int shape)
+{
+	struct vhost_dev *vdev;
+	struct vhost_rxq *rxq;
+	uint16_t q;
+	uint32_t n, idle = 0;
+
+	while(1) {
+		/* Inform the configuration core that we have exited the
+		 * linked lists and no longer use what was unlinked before. */
+		rte_rcu_qsbr_quiescent(data_qsbr, lcore_id);
+		n = 0;
+ 		
+		/* Process the NIC RX queue of the core, or each RX vhost queue */
+		if (sw_demux) {
+			if (lcore_info[lcore_id].nic_rxq >= 0)
+				n += drain_eth_rx_demux(lcore_id, lcore_info[lcore_id].nic_rxq);
+		} else {
+			TAILQ_FOREACH(rxq, &lcore_info[lcore_id].rxq_list, lcore_rxq_entry) {
+				/* control channel does not need to drain eth */
+				if (likely(rxq->vdev->ready == DEVICE_DATA_RX))
+					n += drain_eth_rx(rxq);
+			}
+		}
+		
+		/* Process each TX vhost device */
+		TAILQ_FOREACH(vdev, &lcore_info[lcore_id].tx_vdev_list, tx_lcore_vdev_entry) {
+			if (unlikely(vdev->tx_move != TX_MOVE_NONE)) {
+				/* The queued packets are dropped, so that the rules
+				 * of the device are only shaped by its new core */
+				if (vdev->tx_move == TX_MOVE_REQUEST) {
+					if (shape == SHAPE_PACE)
+						pacer_flush_vdev(lcore_info[lcore_id].pacer, vdev);
+					/* Its kicks may be armed, see arm_sleep() */
+					if (idle_polls)
+						set_tx_notification(vdev, 0);
+					vdev->tx_move = TX_MOVE_ACK;
+				}
+				continue;
+			}
+			/* All the queues of a device are shaped by its TX core */
+			for (q = 0; q < vdev->nr_qpairs; q++)
+				n += drain_virtio_tx(vdev, q * VIRTIO_QNUM + VIRTIO_TXQ, tag, shape);
+		}
+
+		/* Send the queued packets that conform again */
+		if (shape == SHAPE_PACE)
+			pacer_run(lcore_info[lcore_id].pacer, &lcore_tx_queue[lcore_id]);
+
+		/* Send again the packets held while a ring was full */
+		if (hold_cycles != 0) {
+			if (unlikely(lcore_tx_queue[lcore_id].hold != NULL && lcore_tx_queue[lcore_id].hold->len != 0)) {
+				n += lcore_tx_queue[lcore_id].hold->len;
+				do_drain_mbuf_table(&lcore_tx_queue[lcore_id]);
+			}
+			n += flush_rx_holds(lcore_id);
+		}
+
+		/* Adaptive polling: arm the interrupts once idle, and sleep if the
+		 * next poll finds nothing either */
+		if (idle_polls != 0) {
+			if (n != 0) {
+				if (unlikely(lcore_info[lcore_id].sleep->epfd >= 0))
+					disarm_sleep(lcore_id);
+				idle = 0;
+			} else if (unlikely(++idle >= idle_polls)) {
+				if (lcore_info[lcore_id].sleep->epfd >= 0) {
+					worker_sleep(lcore_id);
+					idle = 0;
+				} else if (arm_sleep(lcore_id) != 0)
+					idle = 0;
+			}
+		}
+	}
+}
+
 static int
 switch_worker(void *arg __rte_unused)
 {
 	unsigned i;
 	unsigned lcore_id = rte_lcore_id();
-	struct vhost_dev *vdev;
 	struct mbuf_table *tx_q;
 
 	tx_q = &lcore_tx_queue[lcore_id];
@@ -1143,52 +4964,230 @@ switch_worker(void *arg __rte_unused)
 		}
 	}
 	
+	rte_rcu_qsbr_thread_register(data_qsbr, lcore_id);
+	rte_rcu_qsbr_thread_online(data_qsbr, lcore_id);
+
 	RTE_LOG(INFO, VHOST_DATA, "Processing started on core %u\n", lcore_id);
-	cpu_freq = rte_get_tsc_hz();	
 
-	while(1) {
-		/* Inform the configuration core that we have exited the
-		 * linked list and that no devices are in use if requested. */
-		if (lcore_info[lcore_id].dev_removal_flag == REQUEST_DEV_REMOVAL)
-			lcore_info[lcore_id].dev_removal_flag = ACK_DEV_REMOVAL;
- 		
-		/* Process each RX vhost device */
-		TAILQ_FOREACH(vdev, &lcore_info[lcore_id].rx_vdev_list, rx_lcore_vdev_entry) {
-			if (unlikely(vdev->remove)) {
-				unlink_vmdq(vdev);
-				continue;
+	/* One instance of the loop per mode, so that the per packet path
+	 * does not test the options. */
+	if (do_tag && do_shape && pacing_depth)
+		switch_worker_loop(lcore_id, 1, SHAPE_PACE);
+	else if (do_tag && do_shape)
+		switch_worker_loop(lcore_id, 1, SHAPE_DROP);
+	else if (do_tag)
+		switch_worker_loop(lcore_id, 1, SHAPE_NONE);
+	else
+		switch_worker_loop(lcore_id, 0, SHAPE_NONE);
+
+	return 0;
+}
+
+static inline int
+is_tx_lcore(unsigned lcore)
+{
+	return nb_tx_lcores == 0 || tx_lcores[lcore];
+}
+
+/* The RX queues go to the cores which are not TX cores, or to all of them if they all are */
+static inline int
+is_rx_lcore(unsigned lcore)
+{
+	return !is_tx_lcore(lcore) || nb_tx_lcores == 0 || nb_tx_lcores >= rte_lcore_count() - 1;
+}
+
+/*
+ * Whether a TX/RX core may poll a device of the given NUMA node: only the
+ * cores of the node do, unless it has none or is unknown.
+ */
+static int
+lcore_near(unsigned lcore, int node, int tx)
+{
+	unsigned l;
+
+	if (node < 0 || rte_lcore_to_socket_id(lcore) == (unsigned) node)
+		return 1;
+	RTE_LCORE_FOREACH_SLAVE(l) {
+		if ((tx ? is_tx_lcore(l) : is_rx_lcore(l)) && rte_lcore_to_socket_id(l) == (unsigned) node)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Moves the TX of a device to another core. Its old core gives it up, after
+ * dropping its queued packets, before the new one gets it: the state of its
+ * rules always has a single writer.
+ * Called with tx_balance_lock held, never from a data core.
+ */
+static void
+move_tx_device(struct vhost_dev *vdev, unsigned lcore)
+{
+	unsigned old_lcore = vdev->tx_coreid;
+
+	vdev->tx_move = TX_MOVE_REQUEST;
+	while (vdev->tx_move != TX_MOVE_ACK)
+		rte_pause();
+
+	TAILQ_REMOVE(&lcore_info[old_lcore].tx_vdev_list, vdev, tx_lcore_vdev_entry);
+	sync_data_cores();
+	lcore_info[old_lcore].tx_device_num--;
+	lcore_info[old_lcore].tx_pps -= RTE_MIN(vdev->tx_pps, lcore_info[old_lcore].tx_pps);
+
+	vdev->tx_coreid = lcore;
+	vdev->tx_move = TX_MOVE_NONE;
+	lcore_info[lcore].tx_device_num++;
+	lcore_info[lcore].tx_pps += vdev->tx_pps;
+	rte_smp_wmb();
+	TAILQ_INSERT_TAIL(&lcore_info[lcore].tx_vdev_list, vdev, tx_lcore_vdev_entry);
+
+	RTE_LOG(INFO, VHOST_DATA, "(%d) TX moved from lcore %u to lcore %u\n", vdev->vid, old_lcore, lcore);
+}
+
+/*
+ * Finds the TX cores of a NUMA node with the most and the least devices, or
+ * load if by_load.
+ */
+static void
+tx_lcores_extremes(int by_load, unsigned node, unsigned *busiest, unsigned *idlest)
+{
+	unsigned lcore;
+	uint64_t load, max = 0, min = UINT64_MAX;
+
+	*busiest = *idlest = RTE_MAX_LCORE;
+	RTE_LCORE_FOREACH_SLAVE(lcore) {
+		if (!is_tx_lcore(lcore) || rte_lcore_to_socket_id(lcore) != node)
+			continue;
+		load = by_load ? lcore_info[lcore].tx_pps : lcore_info[lcore].tx_device_num;
+		if (*busiest == RTE_MAX_LCORE || load > max) {
+			max = load;
+			*busiest = lcore;
+		}
+		if (*idlest == RTE_MAX_LCORE || load < min) {
+			min = load;
+			*idlest = lcore;
+		}
+	}
+}
+
+/*
+ * Evens the number of devices of the TX cores of each NUMA node, once a
+ * device is gone. Devices are never moved to another node.
+ * Called with tx_balance_lock held.
+ */
+static void
+balance_tx_devices(void)
+{
+	unsigned node, busiest, idlest;
+	struct vhost_dev *vdev, *v;
+
+	for (node = 0; node < RTE_MAX_NUMA_NODES; node++) {
+		while (1) {
+			tx_lcores_extremes(0, node, &busiest, &idlest);
+			if (busiest == RTE_MAX_LCORE ||
+					lcore_info[busiest].tx_device_num <= lcore_info[idlest].tx_device_num + 1)
+				break;
+			/* Move the least loaded device */
+			vdev = TAILQ_FIRST(&lcore_info[busiest].tx_vdev_list);
+			TAILQ_FOREACH(v, &lcore_info[busiest].tx_vdev_list, tx_lcore_vdev_entry) {
+				if (v->tx_pps < vdev->tx_pps)
+					vdev = v;
 			}
+			move_tx_device(vdev, idlest);
+		}
+	}
+}
+
+/*
+ * Samples the TX load of the devices and of their cores every
+ * TX_BALANCE_INTERVAL_US. When a core sends more than tx_rebalance_pps, the
+ * device that best evens it with the least loaded core of its NUMA node is
+ * moved there, one device per node and interval so that the loads are
+ * sampled again in between.
+ */
+static void *
+tx_balancer(__rte_unused void *arg)
+{
+	struct vhost_dev *vdev, *best;
+	unsigned lcore, node, busiest, idlest;
+	uint64_t tx_total, gap;
 
-			/* control channel does not need to drain eth */
-			if (likely(vdev->ready == DEVICE_DATA_RX))
-				drain_eth_rx(vdev);
+	while (1) {
+		usleep(TX_BALANCE_INTERVAL_US);
+
+		rte_spinlock_lock(&tx_balance_lock);
+		RTE_LCORE_FOREACH_SLAVE(lcore)
+			lcore_info[lcore].tx_pps = 0;
+		TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+			tx_total = vdev->stats.tx_total;
+			/* The statistics may have been reset in between */
+			if (tx_total < vdev->tx_total_sampled)
+				vdev->tx_total_sampled = 0;
+			vdev->tx_pps = (tx_total - vdev->tx_total_sampled) * US_PER_S / TX_BALANCE_INTERVAL_US;
+			vdev->tx_total_sampled = tx_total;
+			lcore_info[vdev->tx_coreid].tx_pps += vdev->tx_pps;
 		}
-		
-		/* Process each TX vhost device */
-		TAILQ_FOREACH(vdev, &lcore_info[lcore_id].tx_vdev_list, tx_lcore_vdev_entry) {
-			drain_virtio_tx(vdev);
-			if (unlikely(vdev->remove)) {
-				vdev->ready = DEVICE_SAFE_REMOVE;
+
+		for (node = 0; node < RTE_MAX_NUMA_NODES; node++) {
+			tx_lcores_extremes(1, node, &busiest, &idlest);
+			if (busiest == RTE_MAX_LCORE || busiest == idlest ||
+					lcore_info[busiest].tx_pps <= tx_rebalance_pps)
 				continue;
+			/* Moving a device of load l leaves max(busiest - l, idlest + l),
+			 * the nearest l to half the gap is the best */
+			gap = lcore_info[busiest].tx_pps - lcore_info[idlest].tx_pps;
+			best = NULL;
+			TAILQ_FOREACH(vdev, &lcore_info[busiest].tx_vdev_list, tx_lcore_vdev_entry) {
+				if (vdev->tx_pps == 0 || vdev->tx_pps >= gap)
+					continue;
+				if (best == NULL || RTE_MAX(vdev->tx_pps, gap - vdev->tx_pps) <
+						RTE_MAX(best->tx_pps, gap - best->tx_pps))
+					best = vdev;
 			}
+			if (best != NULL)
+				move_tx_device(best, idlest);
 		}
+		rte_spinlock_unlock(&tx_balance_lock);
 	}
 
-	return 0;
+	return NULL;
+}
+
+/*
+ * Frees the removed devices once the pacer of their TX core no longer holds
+ * packets of theirs.
+ */
+static void
+free_removed_devices(void)
+{
+	struct vhost_dev *vdev, *next;
+	struct pacer *pacer;
+
+	for (vdev = TAILQ_FIRST(&removed_vdev_list); vdev != NULL; vdev = next) {
+		next = TAILQ_NEXT(vdev, global_vdev_entry);
+		pacer = lcore_info[vdev->tx_coreid].pacer;
+		if ((int32_t) (pacer->flush_done - vdev->flush_ticket) < 0)
+			continue;
+		TAILQ_REMOVE(&removed_vdev_list, vdev, global_vdev_entry);
+		rte_free(vdev->rx_hold);
+		rte_free(vdev);
+	}
 }
 
 /*
- * Remove a device from the specific data core linked list and from the
+ * Remove a device from the specific data core linked lists and from the
  * main linked list.
- * Synchonization occurs through the use of the lcore dev_removal_flag.
- * Device is made volatile here to avoid re-ordering of dev->remove=1
- * which can cause an infinite loop in the rte_pause loop.
+ * The vrings of the device are released when returning, so the data cores
+ * must have gone through a quiescent state, but the device itself is only
+ * freed once the packets its TX core was pacing are dropped.
  */
 static void
 destroy_device(int vid)
 {
 	struct vhost_dev *vdev = NULL;
-	int lcore;
+	struct vhost_rxq *rxq;
+	struct pacer *pacer;
+	unsigned i;
 
 	TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
 		if (vdev->vid == vid)
@@ -1197,36 +5196,48 @@ destroy_device(int vid)
 	if (!vdev)
 		return;
 	
-	/* Set the remove flag and wait */
-	vdev->remove = 1;
-	while(vdev->ready != DEVICE_SAFE_REMOVE) {
-		rte_pause();
-	}
+	rte_spinlock_lock(&tx_balance_lock);
 
-	print_stats();
+	vdev->remove = 1;
 	TAILQ_REMOVE(&lcore_info[vdev->tx_coreid].tx_vdev_list, vdev, tx_lcore_vdev_entry);
-	TAILQ_REMOVE(&lcore_info[vdev->rx_coreid].rx_vdev_list, vdev, rx_lcore_vdev_entry);
+	for (i = 0; i < rxq_per_device; i++) {
+		rxq = &vdev->rxq[i];
+		if (rxq->coreid != RTE_MAX_LCORE)
+			TAILQ_REMOVE(&lcore_info[rxq->coreid].rxq_list, rxq, lcore_rxq_entry);
+	}
 	TAILQ_REMOVE(&vhost_dev_list, vdev, global_vdev_entry);
 
+	/* Once each core has gone through the start of its loop, we can be
+	 * sure that they can no longer access the device removed from the
+	 * linked lists and that the devices are no longer in use. */
+	sync_data_cores();
 
-	/* Set the dev_removal_flag on each lcore */
-	RTE_LCORE_FOREACH_SLAVE(lcore)
-		lcore_info[lcore].dev_removal_flag = REQUEST_DEV_REMOVAL;
-
-	/* Once each core has set the dev_removal_flag to ACK_DEV_REMOVAL
-	 * we can be sure that they can no longer access the device removed
-	 * from the linked lists and that the devices are no longer in use. */
-	RTE_LCORE_FOREACH_SLAVE(lcore) {
-		while (lcore_info[lcore].dev_removal_flag != ACK_DEV_REMOVAL)
-			rte_pause();
+	lcore_info[vdev->tx_coreid].tx_device_num--;
+	lcore_info[vdev->tx_coreid].tx_pps -= RTE_MIN(vdev->tx_pps, lcore_info[vdev->tx_coreid].tx_pps);
+	for (i = 0; i < rxq_per_device; i++) {
+		if (vdev->rxq[i].coreid != RTE_MAX_LCORE)
+			lcore_info[vdev->rxq[i].coreid].device_num--;
 	}
+	unlink_vmdq(vdev);
 
-	lcore_info[vdev->tx_coreid].device_num--;
-	lcore_info[vdev->rx_coreid].device_num--;
+	/* Give a device of a busier core to the one left */
+	balance_tx_devices();
+	rte_spinlock_unlock(&tx_balance_lock);
 
 	RTE_LOG(INFO, VHOST_DATA, "(%d) device has been removed\n", vdev->vid);
 
-	rte_free(vdev);
+	/* The pacer drops the packets of the device at its next run */
+	pacer = lcore_info[vdev->tx_coreid].pacer;
+	if (do_tag && do_shape && pacer != NULL) {
+		vdev->flush_ticket = pacer->flush_requested + 1;
+		rte_smp_wmb();
+		pacer->flush_requested = vdev->flush_ticket;
+		TAILQ_INSERT_TAIL(&removed_vdev_list, vdev, global_vdev_entry);
+	} else {
+		rte_free(vdev->rx_hold);
+		rte_free(vdev);
+	}
+	free_removed_devices();
 }
 
 /*
@@ -1239,17 +5250,73 @@ destroy_device(int vid)
 static int
 new_device(int vid)
 {
-	int lcore, core_add = 0;
+	int lcore, core_add = -1;
 	uint32_t device_num_min = num_virtio_devices;
 	struct vhost_dev *vdev;
+	struct vhost_rxq *rxq;
+	uint64_t features;
+	unsigned i;
+	int node;
 
-	vdev = rte_zmalloc("vhost device", sizeof(*vdev), RTE_CACHE_LINE_SIZE);
+	/* The device is allocated and polled on the NUMA node of the guest memory */
+	node = rte_vhost_get_numa_node(vid);
+	vdev = rte_zmalloc_socket("vhost device", sizeof(*vdev), RTE_CACHE_LINE_SIZE, node);
+	if (vdev == NULL && node >= 0)
+		vdev = rte_zmalloc("vhost device", sizeof(*vdev), RTE_CACHE_LINE_SIZE);
 	if (vdev == NULL) {
 		RTE_LOG(INFO, VHOST_DATA, "(%d) couldn't allocate memory for vhost dev\n", vid);
 		return -1;
 	}
+	if (hold_cycles != 0) {
+		vdev->rx_hold = rte_zmalloc_socket("rx hold", MAX_RXQ_PER_DEVICE * sizeof(struct hold_buffer),
+				RTE_CACHE_LINE_SIZE, node);
+		if (vdev->rx_hold == NULL && node >= 0)
+			vdev->rx_hold = rte_zmalloc("rx hold", MAX_RXQ_PER_DEVICE * sizeof(struct hold_buffer),
+					RTE_CACHE_LINE_SIZE);
+		if (vdev->rx_hold == NULL) {
+			RTE_LOG(INFO, VHOST_DATA, "(%d) couldn't allocate memory for vhost dev\n", vid);
+			rte_free(vdev);
+			return -1;
+		}
+	}
 	
+	free_removed_devices();
+
 	vdev->vid = vid;
+	vdev->numa_node = node;
+	vdev->nr_qpairs = RTE_MAX(rte_vhost_get_vring_num(vid) / VIRTIO_QNUM, 1);
+	/* The first queue pair is always used. Without the protocol features,
+	 * the guest does not enable the vrings, they all are. */
+	vdev->rx_enabled = 1;
+	if (vid >= 0 && vid < MAX_VHOST_VIDS)
+		vdev->rx_enabled |= vid_rx_enabled[vid];
+	if (rte_vhost_get_negotiated_features(vid, &features) == 0 &&
+			!(features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+		vdev->rx_enabled = UINT32_MAX;
+	for (i = 0; i < MAX_RXQ_PER_DEVICE; i++)
+		rte_spinlock_init(&vdev->rx_lock[i]);
+
+	rte_spinlock_lock(&tx_balance_lock);
+
+	/* Find suitable lcores to add the device */
+	
+	/* For TX, use the TX core of the node with the least devices, then the least loaded */
+	RTE_LCORE_FOREACH_SLAVE(lcore) {
+		if (!is_tx_lcore(lcore) || !lcore_near(lcore, node, 1))
+			continue;
+		if (core_add == -1 ||
+				lcore_info[lcore].tx_device_num < lcore_info[core_add].tx_device_num ||
+				(lcore_info[lcore].tx_device_num == lcore_info[core_add].tx_device_num &&
+				 lcore_info[lcore].tx_pps < lcore_info[core_add].tx_pps))
+			core_add = lcore;
+	}
+	if (core_add == -1) {
+		rte_spinlock_unlock(&tx_balance_lock);
+		RTE_LOG(ERR, VHOST_DATA, "(%d) no TX lcore for the device\n", vid);
+		rte_free(vdev->rx_hold);
+		rte_free(vdev);
+		return -1;
+	}
 
 	TAILQ_INSERT_TAIL(&vhost_dev_list, vdev, global_vdev_entry);
 
@@ -1257,38 +5324,84 @@ new_device(int vid)
 	vdev->ready = DEVICE_MAC_LEARNING;
 	vdev->remove = 0;
 
-	/* Find suitable lcores to add the device */
-	
-	/* For TX, use the same core for everyone: the first one */
-	RTE_LCORE_FOREACH_SLAVE(lcore) {
-		core_add = lcore;
-		break;
-	}
 	vdev->tx_coreid = core_add;
-	lcore_info[vdev->tx_coreid].device_num++;
+	lcore_info[vdev->tx_coreid].tx_device_num++;
 	TAILQ_INSERT_TAIL(&lcore_info[vdev->tx_coreid].tx_vdev_list, vdev, tx_lcore_vdev_entry);
+
+	rte_spinlock_unlock(&tx_balance_lock);
 	
-	/* For RX, balance the remaining ports among the devices */
-	device_num_min = num_virtio_devices;
-	RTE_LCORE_FOREACH_SLAVE(lcore) {
-		/* Skip the TX core */
-		if(lcore == vdev->tx_coreid)
-			continue;
-		if (lcore_info[lcore].device_num < device_num_min) {
-			device_num_min = lcore_info[lcore].device_num;
-			core_add = lcore;
+	/* For RX, balance the queues among the RX cores of the node. With
+	 * software demux, the RX cores poll the NIC for all the devices. */
+	for (i = 0; i < rxq_per_device && !sw_demux; i++) {
+		device_num_min = UINT32_MAX;
+		RTE_LCORE_FOREACH_SLAVE(lcore) {
+			if (!is_rx_lcore(lcore) || !lcore_near(lcore, node, 0))
+				continue;
+			if (lcore_info[lcore].device_num < device_num_min) {
+				device_num_min = lcore_info[lcore].device_num;
+				core_add = lcore;
+			}
 		}
+		rxq = &vdev->rxq[i];
+		rxq->vdev = vdev;
+		rxq->index = i;
+		rxq->coreid = core_add;
+		lcore_info[rxq->coreid].device_num++;
+		TAILQ_INSERT_TAIL(&lcore_info[rxq->coreid].rxq_list, rxq, lcore_rxq_entry);
 	}
-	vdev->rx_coreid = core_add;
-	lcore_info[vdev->rx_coreid].device_num++;
-	TAILQ_INSERT_TAIL(&lcore_info[vdev->rx_coreid].rx_vdev_list, vdev, rx_lcore_vdev_entry);
+	for (; i < MAX_RXQ_PER_DEVICE; i++)
+		vdev->rxq[i].coreid = RTE_MAX_LCORE;
 
 	/* Disable notifications */
-	rte_vhost_enable_guest_notification(vid, VIRTIO_RXQ, 0);
-	rte_vhost_enable_guest_notification(vid, VIRTIO_TXQ, 0);
+	for (i = 0; i < (unsigned) vdev->nr_qpairs * VIRTIO_QNUM; i++)
+		rte_vhost_enable_guest_notification(vid, i, 0);
+
+	RTE_LOG(INFO, VHOST_DATA, "(%d) device added on node %d: TX lcore %d, RX lcore %d, %u queue pairs\n", vid, node,
+			vdev->tx_coreid, vdev->rxq[0].coreid, vdev->nr_qpairs);
+
+	return 0;
+}
+
+/*
+ * Keeps track of the RX queues the guest enables, the packets of the disabled
+ * ones are sent to the first queue. The guest may enable them before the
+ * device is added.
+ */
+static int
+vring_state_changed(int vid, uint16_t queue_id, int enable)
+{
+	struct vhost_dev *vdev;
+	uint16_t qpair = queue_id / VIRTIO_QNUM;
+
+	if (queue_id % VIRTIO_QNUM != VIRTIO_RXQ || qpair == 0 || qpair >= 32)
+		return 0;
 
-	RTE_LOG(INFO, VHOST_DATA, "(%d) device added: TX lcore %d, RX lcore %d\n", vid, vdev->tx_coreid, vdev->rx_coreid);
+	if (vid >= 0 && vid < MAX_VHOST_VIDS) {
+		if (enable)
+			vid_rx_enabled[vid] |= 1U << qpair;
+		else
+			vid_rx_enabled[vid] &= ~(1U << qpair);
+	}
+
+	TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
+		if (vdev->vid != vid)
+			continue;
+		if (enable)
+			vdev->rx_enabled |= 1U << qpair;
+		else
+			vdev->rx_enabled &= ~(1U << qpair);
+		break;
+	}
+
+	return 0;
+}
 
+/* A new guest connection reuses the id of a closed one, with no vring enabled */
+static int
+new_connection(int vid)
+{
+	if (vid >= 0 && vid < MAX_VHOST_VIDS)
+		vid_rx_enabled[vid] = 0;
 	return 0;
 }
 
@@ -1300,6 +5413,8 @@ static const struct vhost_device_ops virtio_net_device_ops =
 {
 	.new_device =  new_device,
 	.destroy_device = destroy_device,
+	.vring_state_changed = vring_state_changed,
+	.new_connection = new_connection,
 };
 
 static void
@@ -1318,18 +5433,32 @@ unregister_drivers(int socket_num)
 static void
 signal_handler(int signum)
 {
-	/* When we receive a USR1 signal, print stats and table */
-	if (signum == SIGUSR1) {
-		print_table();
-		print_stats();
-	}
+	/* When we receive a USR1 signal, have the main lcore print stats and table */
+	if (signum == SIGUSR1)
+		dump_requested = 1;
 
 	/* When we receive a USR2 signal, reset stats */
 	if (signum == SIGUSR2) {
 		struct vhost_dev *vdev;
+		unsigned lcore;
 		TAILQ_FOREACH(vdev, &vhost_dev_list, global_vdev_entry) {
 			memset(&vdev->stats, 0, sizeof(struct device_statistics));
 		}	
+		RTE_LCORE_FOREACH_SLAVE(lcore) {
+			lcore_info[lcore].flow_cache->hits = 0;
+			lcore_info[lcore].flow_cache->misses = 0;
+			lcore_info[lcore].rx_unknown = 0;
+			lcore_tx_queue[lcore].held = 0;
+			lcore_tx_queue[lcore].ring_dropped = 0;
+			if (idle_polls) {
+				lcore_info[lcore].sleep->sleeps = 0;
+				lcore_info[lcore].sleep->woken = 0;
+				lcore_info[lcore].sleep->timeouts = 0;
+				lcore_info[lcore].sleep->slept_cycles = 0;
+				lcore_info[lcore].sleep->wake_cycles = 0;
+				lcore_info[lcore].sleep->wake_cycles_max = 0;
+			}
+		}
 	
 		RTE_LOG(INFO, VHOST_DATA, "** Statistics have been reset **\n");
 		return;
@@ -1354,6 +5483,11 @@ main(int argc, char *argv[])
 	int ret, i;
 	uint16_t portid;
 	uint64_t flags = 0;
+	uint32_t n_versions;
+	uint32_t lcores_per_socket[RTE_MAX_NUMA_NODES] = {0};
+	unsigned socket;
+	char pool_name[RTE_MEMPOOL_NAMESIZE];
+	pthread_t acl_builder_thread, tx_balancer_thread;
 
 	/* Associate signal_hanlder function with signals */
 	signal(SIGUSR1, signal_handler);
@@ -1374,7 +5508,7 @@ main(int argc, char *argv[])
 		rte_exit(EXIT_FAILURE, "Invalid argument\n");
 
 	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
-		TAILQ_INIT(&lcore_info[lcore_id].rx_vdev_list);
+		TAILQ_INIT(&lcore_info[lcore_id].rxq_list);
 		TAILQ_INIT(&lcore_info[lcore_id].tx_vdev_list);
 
 		if (rte_lcore_is_enabled(lcore_id))
@@ -1415,12 +5549,173 @@ main(int argc, char *argv[])
 	nr_mbufs_per_core  = (mtu + RTE_MBUF_DEFAULT_BUF_SIZE) * MAX_PKT_BURST / (RTE_MBUF_DEFAULT_BUF_SIZE - RTE_PKTMBUF_HEADROOM);
 	nr_mbufs_per_core += RTE_TEST_RX_DESC_DEFAULT;
 
-	nr_mbufs  = MAX_VIRTIO_DEVICES * RTE_TEST_RX_DESC_DEFAULT * 2;
-	nr_mbufs += nr_mbufs_per_core * (rte_lcore_count() - 1);
+	/* The mempool of the node of the NIC also fills its RX descriptors */
+	nic_socket = rte_eth_dev_socket_id(used_port_id);
+	if (nic_socket < 0)
+		nic_socket = rte_socket_id();
+	RTE_LCORE_FOREACH(lcore_id) {
+		lcores_per_socket[rte_lcore_to_socket_id(lcore_id)]++;
+		if (rte_lcore_to_socket_id(lcore_id) != (unsigned) nic_socket && lcore_id != rte_get_master_lcore())
+			RTE_LOG(INFO, VHOST_CONFIG, "lcore %u is not on the NUMA node %d of port %u\n",
+				lcore_id, nic_socket, used_port_id);
+	}
+
+	for (socket = 0; socket < RTE_MAX_NUMA_NODES; socket++) {
+		if (lcores_per_socket[socket] == 0 && socket != (unsigned) nic_socket)
+			continue;
+
+		nr_mbufs = nr_mbufs_per_core * lcores_per_socket[socket];
+		if (socket == (unsigned) nic_socket)
+			nr_mbufs += MAX_VIRTIO_DEVICES * RTE_TEST_RX_DESC_DEFAULT * 2;
+		snprintf(pool_name, sizeof(pool_name), "MBUF_POOL_%u", socket);
+		mbuf_pools[socket] = rte_pktmbuf_pool_create(pool_name, nr_mbufs, 128, 0, RTE_MBUF_DEFAULT_BUF_SIZE, socket);
+		if (mbuf_pools[socket] == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot create mbuf pool on node %u\n", socket);
+
+		if (lcores_per_socket[socket] == 0)
+			continue;
+
+		/* Segments of the TSO packets in flight */
+		if (sw_gso) {
+			snprintf(pool_name, sizeof(pool_name), "GSO_DIRECT_POOL_%u", socket);
+			gso_direct_pools[socket] = rte_pktmbuf_pool_create(pool_name, GSO_MBUFS_PER_CORE * lcores_per_socket[socket],
+				128, 0, RTE_PKTMBUF_HEADROOM + GSO_DIRECT_MBUF_DATA_SIZE, socket);
+			snprintf(pool_name, sizeof(pool_name), "GSO_INDIRECT_POOL_%u", socket);
+			gso_indirect_pools[socket] = rte_pktmbuf_pool_create(pool_name, GSO_MBUFS_PER_CORE * lcores_per_socket[socket],
+				128, 0, 0, socket);
+			if (gso_direct_pools[socket] == NULL || gso_indirect_pools[socket] == NULL)
+				rte_exit(EXIT_FAILURE, "Cannot create GSO mbuf pools on node %u\n", socket);
+		}
+
+		/* A header segment and a clone per zero copy packet in flight */
+		if (dequeue_zero_copy) {
+			snprintf(pool_name, sizeof(pool_name), "HDR_POOL_%u", socket);
+			hdr_pools[socket] = rte_pktmbuf_pool_create(pool_name, 2 * nr_mbufs_per_core * lcores_per_socket[socket],
+				128, 0, RTE_PKTMBUF_HEADROOM + HDR_MBUF_DATA_SIZE, socket);
+			if (hdr_pools[socket] == NULL)
+				rte_exit(EXIT_FAILURE, "Cannot create header mbuf pool on node %u\n", socket);
+		}
+	}
+
+	/* Create the matching table */
+	struct rte_hash_parameters flow_table_params = {
+		.name = "flow_table",
+		.entries = FLOW_TABLE_ENTRIES,
+		.key_len = sizeof(struct flow_key),
+		.hash_func = rte_hash_crc,
+		.hash_func_init_val = 0,
+		.socket_id = rte_socket_id(),
+		/* Lock-free lookups while the rules are updated. The slots of the
+		 * deleted keys are freed by reclaim_versions(). */
+		.extra_flag = RTE_HASH_EXTRA_FLAGS_RW_CONCURRENCY_LF,
+	};
+	flow_table = rte_hash_create(&flow_table_params);
+	if (flow_table == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot create matching table\n");
+	flow_entries = rte_zmalloc("flow entries", FLOW_TABLE_ENTRIES * sizeof(struct tagging_entry), RTE_CACHE_LINE_SIZE);
+	if (flow_entries == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot allocate matching table entries\n");
+
+	/* Same for IPv6 */
+	flow_table_params.name = "flow_table6";
+	flow_table_params.key_len = sizeof(struct flow_key6);
+	flow_table6 = rte_hash_create(&flow_table_params);
+	if (flow_table6 == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot create IPv6 matching table\n");
+	flow_entries6 = rte_zmalloc("flow entries6", FLOW_TABLE_ENTRIES * sizeof(struct tagging_entry), RTE_CACHE_LINE_SIZE);
+	if (flow_entries6 == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot allocate IPv6 matching table entries\n");
+	RTE_LOG(INFO, VHOST_CONFIG, "Matching tables created for %u rules\n", max_rules);
+
+	/* Create the flow cache of each data core */
+	RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+		lcore_info[lcore_id].flow_cache = rte_zmalloc_socket("flow cache", sizeof(struct flow_cache),
+				RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore_id));
+		if (lcore_info[lcore_id].flow_cache == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot allocate flow cache\n");
+	}
+
+	/* Create the pacer of each data core, all its queues are free */
+	if (pacing_depth) {
+		uint32_t tick_shift = rte_log2_u32(rte_get_tsc_hz() / PACING_TICKS_PER_SEC);
+
+		RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+			struct pacer *pacer = rte_zmalloc_socket("pacer", sizeof(struct pacer),
+					RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore_id));
+			if (pacer == NULL)
+				rte_exit(EXIT_FAILURE, "Cannot allocate pacer\n");
+			pacer->tick_shift = tick_shift;
+			pacer->cur_tick = rte_rdtsc() >> tick_shift;
+			for (i = 0; i < PACING_MAX_QUEUES; i++) {
+				pacer->queues[i].pacer = pacer;
+				pacer->queues[i].next = pacer->free;
+				pacer->free = &pacer->queues[i];
+			}
+			lcore_info[lcore_id].pacer = pacer;
+		}
+	}
 
-	mbuf_pool = rte_pktmbuf_pool_create("MBUF_POOL", nr_mbufs, 128, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
-	if (mbuf_pool == NULL)
-		rte_exit(EXIT_FAILURE, "Cannot create mbuf pool\n");
+	/* Create the sleep state of each data core, with adaptive polling */
+	if (idle_polls) {
+		RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+			struct lcore_sleep *sleep = rte_zmalloc_socket("sleep", sizeof(struct lcore_sleep),
+					RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore_id));
+			if (sleep == NULL)
+				rte_exit(EXIT_FAILURE, "Cannot allocate sleep state\n");
+			sleep->epfd = -1;
+			lcore_info[lcore_id].sleep = sleep;
+		}
+	}
+
+	/* Create the holding buffer of the TX queue of each data core. With
+	 * dequeue zero copy, the packets of a guest must not outlive its
+	 * device, they are dropped when the NIC queue is full. */
+	hold_cycles = rte_get_tsc_hz() / US_PER_S * hold_us;
+	if (hold_us && !dequeue_zero_copy) {
+		RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+			lcore_tx_queue[lcore_id].hold = rte_zmalloc_socket("tx hold", sizeof(struct hold_buffer),
+					RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore_id));
+			if (lcore_tx_queue[lcore_id].hold == NULL)
+				rte_exit(EXIT_FAILURE, "Cannot allocate TX holding buffer\n");
+		}
+	}
+
+	/* Create the wildcard table, all its entries are free */
+	acl_entries = rte_zmalloc("acl entries", max_acl_rules * sizeof(struct tagging_entry), RTE_CACHE_LINE_SIZE);
+	acl_defs = rte_zmalloc("acl defs", max_acl_rules * sizeof(struct acl_rule_def), RTE_CACHE_LINE_SIZE);
+	acl_free_list = rte_malloc("acl free list", max_acl_rules * sizeof(uint32_t), 0);
+	if (acl_entries == NULL || acl_defs == NULL || acl_free_list == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot allocate wildcard table\n");
+	for (acl_n_free = 0; acl_n_free < max_acl_rules; acl_n_free++)
+		acl_free_list[acl_n_free] = max_acl_rules - 1 - acl_n_free;
+
+	/* Create the rule versions, one of each per entry plus the retired ones */
+	n_versions = 2 * max_rules + max_acl_rules + VERSION_POOL_SLACK;
+	retired_size = 2 * n_versions + 2 * max_rules;
+	retired = rte_malloc("retired versions", retired_size * sizeof(struct retired_version), 0);
+	if (retired == NULL ||
+			version_pool_init(&stack_pool, "tag stacks", n_versions, sizeof(struct tag_stack)) != 0 ||
+			version_pool_init(&shaper_pool, "shapers", n_versions, sizeof(struct shaper)) != 0)
+		rte_exit(EXIT_FAILURE, "Cannot allocate rule versions\n");
+
+	/* Create the VM registry, and with software demux a NIC RX queue per RX core */
+	struct rte_hash_parameters mac_table_params = {
+		.name = "mac_table",
+		.entries = 2 * (MAX_VMS + 1),
+		.key_len = sizeof(struct rte_ether_addr),
+		.hash_func = rte_hash_crc,
+		.hash_func_init_val = 0,
+		.socket_id = rte_socket_id(),
+		.extra_flag = RTE_HASH_EXTRA_FLAGS_RW_CONCURRENCY_LF,
+	};
+	mac_table = rte_hash_create(&mac_table_params);
+	if (mac_table == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot create VM registry\n");
+	RTE_LCORE_FOREACH(lcore_id) {
+		lcore_info[lcore_id].nic_rxq = -1;
+		if (sw_demux && lcore_id != rte_get_master_lcore() && is_rx_lcore(lcore_id))
+			lcore_info[lcore_id].nic_rxq = nb_rx_queues++;
+	}
 
 	/* Enable VT loop back to let NIC send back packets sent by guests to other guests */
 	vmdq_conf_default.rx_adv_conf.vmdq_rx_conf.enable_loop_back = 1;
@@ -1437,11 +5732,35 @@ main(int argc, char *argv[])
 		if (port_init(portid) != 0)
 			rte_exit(EXIT_FAILURE, "Cannot initialize network ports\n");
 	}
+	rx_shared = sw_demux || rxq_per_device != 1 || local_switch;
+
+	/* Track the quiescent states of the data cores */
+	data_qsbr = rte_zmalloc("data cores QSBR", rte_rcu_qsbr_get_memsize(RTE_MAX_LCORE), RTE_CACHE_LINE_SIZE);
+	if (data_qsbr == NULL || rte_rcu_qsbr_init(data_qsbr, RTE_MAX_LCORE) != 0)
+		rte_exit(EXIT_FAILURE, "Cannot create the QSBR variable of the data cores\n");
+
+	/* Rule messages of the control VM queued by its TX core, and their acks */
+	ctrl_ring = rte_ring_create("ctrl_ring", CTRL_RING_SIZE, rte_socket_id(), RING_F_SC_DEQ);
+	ack_ring = rte_ring_create("ack_ring", CTRL_RING_SIZE, rte_socket_id(), RING_F_SP_ENQ);
+	if (ctrl_ring == NULL || ack_ring == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot create control rings\n");
 
 	/* Launch all data cores */
 	RTE_LCORE_FOREACH_SLAVE(lcore_id)
 		rte_eal_remote_launch(switch_worker, NULL, lcore_id);
 
+	/* Build the wildcard classifier in the background */
+	ret = rte_ctrl_thread_create(&acl_builder_thread, "acl-builder", NULL, acl_builder, NULL);
+	if (ret != 0)
+		rte_exit(EXIT_FAILURE, "Cannot create the wildcard classifier builder thread\n");
+
+	/* Watch the load of the TX cores */
+	if (tx_rebalance_pps) {
+		ret = rte_ctrl_thread_create(&tx_balancer_thread, "tx-balancer", NULL, tx_balancer, NULL);
+		if (ret != 0)
+			rte_exit(EXIT_FAILURE, "Cannot create the TX balancer thread\n");
+	}
+
 	/* Register vhost user driver to handle vhost messages. */
 	if (client_mode)
 		flags |= RTE_VHOST_USER_CLIENT;
@@ -1457,6 +5776,10 @@ main(int argc, char *argv[])
 
 		rte_vhost_driver_disable_features(file, 1ULL << VIRTIO_NET_F_MRG_RXBUF);
 
+		/* Only the first queue pair is polled without multiqueue */
+		if (!multiqueue)
+			rte_vhost_driver_disable_features(file, 1ULL << VIRTIO_NET_F_MQ);
+
 		if (enable_tx_csum == 0) {
 			rte_vhost_driver_disable_features(file, 1ULL << VIRTIO_NET_F_CSUM);
 		}
@@ -1475,8 +5798,8 @@ main(int argc, char *argv[])
 		}
 	}
 
-	RTE_LCORE_FOREACH_SLAVE(lcore_id)
-		rte_eal_wait_lcore(lcore_id);
+	/* The main lcore applies the rule updates from now on */
+	control_loop();
 
 	return 0;
 
@@ -0,0 +1,209 @@
+/**
+ * Shaping algorithms of the rules, shared with the tests.
+ */
+#ifndef _SHAPER_H_
+#define _SHAPER_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <rte_branch_prediction.h>
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_meter.h>
+
+/*
+ * Shaper engine: each rule holds the state of one shaping algorithm.
+ * - token bucket: tokens are bits in fixed point with SHAPER_FP_SHIFT
+ *   fractional bits, refilled from the TSC with a single multiply. The
+ *   burst is capped so that a refill can never overflow.
+ * - srTCM (RFC 2697) and trTCM (RFC 2698) from rte_meter: green packets
+ *   pass, yellow ones pass with the DEI of their outermost tag set and red
+ *   ones are dropped.
+ */
+#define SHAPER_FP_SHIFT 32
+#define SHAPER_MAX_BURST_BITS (UINT64_C(1) << 30)
+
+enum shaper_algo {
+	SHAPER_TOKEN_BUCKET = 0,
+	SHAPER_SRTCM,
+	SHAPER_TRTCM,
+	SHAPER_N_ALGOS,
+};
+
+enum shaper_verdict {
+	SHAPER_PASS,
+	SHAPER_MARK,
+	SHAPER_DROP,
+};
+
+struct shaper {
+	uint8_t algo; /* enum shaper_algo */
+	uint64_t rate_bps; /* committed rate in bps, as configured */
+	uint64_t burst_bits; /* committed burst in bits, as configured */
+	uint64_t peak_rate_bps; /* meter extension, as configured */
+	uint64_t peak_burst_bits;
+	union {
+		struct {
+			uint64_t tokens; /* fixed point bits */
+			uint64_t burst; /* fixed point bits */
+			uint64_t rate; /* fixed point bits per TSC cycle */
+			uint64_t max_delta; /* cycles filling the bucket from empty */
+			uint64_t last_tsc;
+		} tb;
+		struct {
+			struct rte_meter_srtcm_profile profile;
+			struct rte_meter_srtcm meter;
+		} srtcm;
+		struct {
+			struct rte_meter_trtcm_profile profile;
+			struct rte_meter_trtcm meter;
+		} trtcm;
+	};
+};
+
+/* Returns (a << SHAPER_FP_SHIFT) / b without overflowing, for b < 2^63 */
+static inline uint64_t
+shaper_fp_div(uint64_t a, uint64_t b)
+{
+	uint64_t q = a / b;
+	uint64_t r = a % b;
+	unsigned i;
+
+	for (i = 0; i < SHAPER_FP_SHIFT; i++) {
+		q <<= 1;
+		r <<= 1;
+		if (r >= b) {
+			q |= 1;
+			r -= b;
+		}
+	}
+	return q;
+}
+
+/*
+ * Configures a shaper. The burst of a token bucket is capped at
+ * SHAPER_MAX_BURST_BITS, and n_tokens of it are available at first.
+ * Returns -1 if the parameters are not valid for the algorithm.
+ */
+static inline int
+shaper_init(struct shaper *s, uint8_t algo, uint64_t rate_bps, uint64_t burst_bits, uint64_t n_tokens,
+		uint64_t peak_rate_bps, uint64_t peak_burst_bits)
+{
+	uint64_t hz = rte_get_tsc_hz();
+	uint64_t tb_burst_bits = RTE_MIN(burst_bits, SHAPER_MAX_BURST_BITS);
+	uint64_t init_bits = RTE_MIN(n_tokens, tb_burst_bits);
+
+	memset(s, 0, sizeof(*s));
+	s->algo = algo;
+	s->rate_bps = rate_bps;
+	s->burst_bits = burst_bits;
+	s->peak_rate_bps = peak_rate_bps;
+	s->peak_burst_bits = peak_burst_bits;
+
+	switch (s->algo) {
+	case SHAPER_TOKEN_BUCKET:
+		s->tb.burst = tb_burst_bits << SHAPER_FP_SHIFT;
+		s->tb.tokens = init_bits << SHAPER_FP_SHIFT;
+		s->tb.rate = shaper_fp_div(rate_bps, hz);
+		s->tb.max_delta = s->tb.rate != 0 ? s->tb.burst / s->tb.rate + 1 : UINT64_MAX;
+		s->tb.last_tsc = rte_rdtsc();
+		return 0;
+	case SHAPER_SRTCM: {
+		struct rte_meter_srtcm_params params = {
+			.cir = rate_bps / 8,
+			.cbs = burst_bits / 8,
+			.ebs = peak_burst_bits / 8,
+		};
+		if (rte_meter_srtcm_profile_config(&s->srtcm.profile, &params) != 0)
+			return -1;
+		return rte_meter_srtcm_config(&s->srtcm.meter, &s->srtcm.profile);
+	}
+	case SHAPER_TRTCM: {
+		struct rte_meter_trtcm_params params = {
+			.cir = rate_bps / 8,
+			.pir = peak_rate_bps / 8,
+			.cbs = burst_bits / 8,
+			.pbs = peak_burst_bits / 8,
+		};
+		if (rte_meter_trtcm_profile_config(&s->trtcm.profile, &params) != 0)
+			return -1;
+		return rte_meter_trtcm_config(&s->trtcm.meter, &s->trtcm.profile);
+	}
+	default:
+		return -1;
+	}
+}
+
+/* Adds to a token bucket the tokens generated since its last refill */
+static __rte_always_inline void
+shaper_tb_refill(struct shaper *s, uint64_t current_tsc)
+{
+	uint64_t delta_cycles = current_tsc - s->tb.last_tsc;
+
+	s->tb.last_tsc = current_tsc;
+	/* Past max_delta the bucket is full whatever it held, which also
+	 * bounds the product below */
+	if (unlikely(delta_cycles >= s->tb.max_delta)) {
+		s->tb.tokens = s->tb.burst;
+		return;
+	}
+	s->tb.tokens = RTE_MIN(s->tb.tokens + delta_cycles * s->tb.rate, s->tb.burst);
+}
+
+/* Token bucket cost of a packet of the given size on line, in fixed point */
+static __rte_always_inline uint64_t
+shaper_tb_cost(uint32_t size)
+{
+	return (uint64_t) size * 8 << SHAPER_FP_SHIFT;
+}
+
+/* Whether a packet of the given size can ever conform to a token bucket */
+static __rte_always_inline int
+shaper_tb_fits(const struct shaper *s, uint32_t size)
+{
+	return shaper_tb_cost(size) < s->tb.burst;
+}
+
+/* Verdict of a shaper for a packet of the given size on line */
+static __rte_always_inline enum shaper_verdict
+shaper_check(struct shaper *s, uint32_t size, uint64_t current_tsc)
+{
+	enum rte_color color;
+	uint64_t cost;
+
+	if (likely(s->algo == SHAPER_TOKEN_BUCKET)) {
+		shaper_tb_refill(s, current_tsc);
+		cost = shaper_tb_cost(size);
+		if (s->tb.tokens > cost) {
+			s->tb.tokens -= cost;
+			return SHAPER_PASS;
+		}
+		return SHAPER_DROP;
+	}
+
+	if (s->algo == SHAPER_SRTCM)
+		color = rte_meter_srtcm_color_blind_check(&s->srtcm.meter, &s->srtcm.profile, current_tsc, size);
+	else
+		color = rte_meter_trtcm_color_blind_check(&s->trtcm.meter, &s->trtcm.profile, current_tsc, size);
+	if (color == RTE_COLOR_GREEN)
+		return SHAPER_PASS;
+	return color == RTE_COLOR_YELLOW ? SHAPER_MARK : SHAPER_DROP;
+}
+
+/* Gives back to a token bucket the tokens taken by a packet */
+static __rte_always_inline void
+shaper_refund(struct shaper *s, uint32_t size)
+{
+	if (s->algo == SHAPER_TOKEN_BUCKET)
+		s->tb.tokens = RTE_MIN(s->tb.tokens + shaper_tb_cost(size), s->tb.burst);
+}
+
+/* Time at which a token bucket holds the tokens of a packet of the given size */
+static inline uint64_t
+shaper_tb_release_tsc(const struct shaper *s, uint32_t size, uint64_t current_tsc)
+{
+	return current_tsc + (shaper_tb_cost(size) - s->tb.tokens) / s->tb.rate + 1;
+}
+
+#endif /* _SHAPER_H_ */
@@ -3,10 +3,11 @@
 # This script starts the DPDK app that implements the Chameleon
 # virtual switch.
 # 
-# Note: the 3 cores on which the app should run are hardcoded in
-# this script. Change at will. Ideally, these 3 cores should
-# also be passed to the 'isolcpus' kernel parameter to ensure
-# that no other process uses them.
+# Note: the app runs on N_LCORES cores (3 by default) of the NUMA
+# node of the NIC, picked from its local_cpulist, one per physical
+# core and the isolated ones first. Ideally, these cores should be
+# passed to the 'isolcpus' kernel parameter to ensure that no other
+# process uses them. LCORES overrides the list, e.g. LCORES=14,16,18.
 # 
 # Author: Amaury Van Bemten <amaury.van-bemten@tum.de>
 
@@ -29,41 +30,47 @@ if [ $? != 0 ]; then
 	exit -1
 fi
  
-# root@hazard:~/dpdk-stable/usertools# ./cpu_layout.py 
-# ======================================================================
-# Core and Socket Information (as reported by '/sys/devices/system/cpu')
-# ======================================================================
-#  
-# cores =  [0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13]
-# sockets =  [0, 1]
-#
-#         Socket 0    Socket 1   
-#         --------    --------   
-# Core 0  [0]         [1]        
-# Core 1  [2]         [3]        
-# Core 2  [4]         [5]        
-# Core 3  [6]         [7]        
-# Core 4  [8]         [9]        
-# Core 5  [10]        [11]       
-# Core 8  [12]        [13]       
-# Core 9  [14]        [15]       
-# Core 10 [16]        [17]       
-# Core 11 [18]        [19]       
-# Core 12 [20]        [21]       
-# Core 13 [22]        [23]
-#
-# The NIC is on socket 0:
+# Expands a cpulist such as 0,2,4-6 into one CPU per line
+expand_cpulist() {
+	for range in $(echo $1 | tr ',' ' '); do
+		seq ${range%-*} ${range#*-}
+	done
+}
+
+# Example of a host, as reported by usertools/cpu_layout.py: the even CPUs
+# are on socket 0, with the NIC, the odd ones on socket 1.
 # root@hazard:/# cat /sys/class/net/enp4s0f0/device/local_cpulist
 # 0,2,4,6,8,10,12,14,16,18,20,22
-# root@hazard:/# cat /sys/class/net/enp4s0f1/device/local_cpulist
-# 0,2,4,6,8,10,12,14,16,18,20,22
-#
-# -l: Use ports 14, 16, 18 for DPDK. They are on the same socket as the NIC and
-#     different cores.
-# Note that we use the kernel parameter "isolcpus" to prevent the kernel from using
-# lcores 14,16,18 to ensure our DPDK threads are not bothered.
+# root@hazard:/# cat /sys/devices/system/cpu/isolated
+# 14,16,18
+# The app then runs on lcores 14,16,18.
+N_LCORES=${N_LCORES:-3}
+if [ -z "$LCORES" ]; then
+	LOCAL_CPUS=$(expand_cpulist $(cat /sys/bus/pci/devices/$PORT/local_cpulist))
+	ISOLATED_CPUS=$(expand_cpulist $(cat /sys/devices/system/cpu/isolated))
+	USED_CORES=" "
+	N=0
+	for cpu in $(echo "$ISOLATED_CPUS" | grep -x -F "$LOCAL_CPUS") $LOCAL_CPUS; do
+		topology=/sys/devices/system/cpu/cpu$cpu/topology
+		core=$(cat $topology/physical_package_id)-$(cat $topology/core_id)
+		if [[ "$USED_CORES" == *" $core "* ]] || [ $N -eq $N_LCORES ]; then
+			continue
+		fi
+		USED_CORES="$USED_CORES$core "
+		LCORES=$LCORES${LCORES:+,}$cpu
+		N=$((N + 1))
+	done
+	if [ $N -lt $N_LCORES ]; then
+		echo "Only $N cores of the NUMA node of $PORT are available ($LCORES)!"
+		exit -1
+	fi
+fi
+echo "Using lcores $LCORES"
+
+# One GB of memory on each NUMA node, for the mempool and the devices of its cores
+SOCKET_MEM=$(ls -d /sys/devices/system/node/node[0-9]* | sed 's/.*/1024/' | paste -s -d ,)
 
-./app/build/dpdk-tagging -l 14,16,18 -n 4 --log-level 8 --socket-mem 1024 -- --socket-file /tmp/sock0 -p 0 
+./app/build/dpdk-tagging -l $LCORES -n 4 --log-level 8 --socket-mem $SOCKET_MEM -- --socket-file /tmp/sock0 -p 0 
 
 # Connect the interfaces back to the kernel
 $RTE_SDK/usertools/dpdk-devbind.py --bind=ixgbe $PORT
@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2010-2014 Intel Corporation
+ */
+
+/*
+ * Classifies known flow keys against wildcard rules built the way the
+ * switch builds them, to check the field layout of the classifier.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <rte_common.h>
+#include <rte_eal.h>
+#include <rte_ip.h>
+#include <rte_lcore.h>
+
+#include "flow_key.h"
+
+static struct flow_key
+make_key(uint16_t vlan_tag, uint8_t protocol, uint32_t src_ip, uint32_t dst_ip, uint16_t src_port, uint16_t dst_port)
+{
+	struct flow_key key;
+
+	memset(&key, 0, sizeof(key));
+	key.vlan_tag = vlan_tag;
+	key.protocol = protocol;
+	key.src_ip = rte_cpu_to_be_32(src_ip);
+	key.dst_ip = rte_cpu_to_be_32(dst_ip);
+	key.src_port = rte_cpu_to_be_16(src_port);
+	key.dst_port = rte_cpu_to_be_16(dst_port);
+	return key;
+}
+
+static void
+make_rule(struct acl_rule *rule, uint32_t userdata, const struct flow_key *key, int any_protocol,
+		uint8_t src_prefix_len, uint8_t dst_prefix_len, uint16_t src_port_max, uint16_t dst_port_max)
+{
+	memset(rule, 0, sizeof(*rule));
+	rule->data.category_mask = 1;
+	rule->data.priority = 1;
+	rule->data.userdata = userdata;
+	acl_rule_set_fields(rule, key, any_protocol, src_prefix_len, dst_prefix_len,
+			rte_cpu_to_be_16(src_port_max), rte_cpu_to_be_16(dst_port_max));
+}
+
+static const struct {
+	const char *name;
+	struct flow_key key;
+	uint32_t expected;
+} cases[] = {
+	{ "udp flow in all ranges", { .vlan_tag = 3, .protocol = IPPROTO_UDP }, 1 },
+	{ "other pool", { .vlan_tag = 4, .protocol = IPPROTO_UDP }, 0 },
+	{ "pool with the same low byte", { .vlan_tag = 0x103, .protocol = IPPROTO_UDP }, 0 },
+	{ "other protocol", { .vlan_tag = 3, .protocol = IPPROTO_TCP }, 0 },
+	{ "source outside the prefix", { .vlan_tag = 3, .protocol = IPPROTO_UDP }, 0 },
+	{ "destination outside the prefix", { .vlan_tag = 3, .protocol = IPPROTO_UDP }, 0 },
+	{ "destination port above the range", { .vlan_tag = 3, .protocol = IPPROTO_UDP }, 0 },
+	{ "any protocol in the second pool", { .vlan_tag = 0x105, .protocol = IPPROTO_TCP }, 2 },
+	{ "second rule, other pool", { .vlan_tag = 5, .protocol = IPPROTO_TCP }, 0 },
+};
+
+int
+main(int argc, char **argv)
+{
+	struct flow_key keys[RTE_DIM(cases)];
+	const uint8_t *data[RTE_DIM(cases)];
+	uint32_t results[RTE_DIM(cases)];
+	struct acl_rule rules[2];
+	struct flow_key rule_key;
+	struct rte_acl_param param;
+	struct rte_acl_config cfg;
+	struct rte_acl_ctx *ctx;
+	unsigned int i, failed = 0;
+	int ret;
+
+	ret = rte_eal_init(argc, argv);
+	if (ret < 0)
+		rte_exit(EXIT_FAILURE, "Invalid EAL arguments\n");
+
+	/* UDP from 10.0.0.0/8 to 192.168.1.0/24, any source port, ports 1000-2000 */
+	rule_key = make_key(3, IPPROTO_UDP, RTE_IPV4(10, 0, 0, 0), RTE_IPV4(192, 168, 1, 0), 0, 1000);
+	make_rule(&rules[0], 1, &rule_key, 0, 8, 24, UINT16_MAX, 2000);
+	/* Everything of pool 0x105 */
+	rule_key = make_key(0x105, 0, 0, 0, 0, 0);
+	make_rule(&rules[1], 2, &rule_key, 1, 0, 0, UINT16_MAX, UINT16_MAX);
+
+	for (i = 0; i < RTE_DIM(cases); i++) {
+		keys[i] = make_key(cases[i].key.vlan_tag, cases[i].key.protocol,
+				RTE_IPV4(10, 1, 2, 3), RTE_IPV4(192, 168, 1, 7), 5555, 1500);
+		data[i] = (const uint8_t *) &keys[i];
+	}
+	keys[4].src_ip = rte_cpu_to_be_32(RTE_IPV4(11, 1, 2, 3));
+	keys[5].dst_ip = rte_cpu_to_be_32(RTE_IPV4(192, 168, 2, 7));
+	keys[6].dst_port = rte_cpu_to_be_16(2001);
+
+	memset(&param, 0, sizeof(param));
+	param.name = "test_acl";
+	param.socket_id = rte_socket_id();
+	param.rule_size = RTE_ACL_RULE_SZ(ACL_NUM_FIELDS);
+	param.max_rule_num = RTE_DIM(rules);
+	ctx = rte_acl_create(&param);
+	if (ctx == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot create the classifier\n");
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.num_categories = 1;
+	cfg.num_fields = ACL_NUM_FIELDS;
+	memcpy(cfg.defs, acl_field_defs, sizeof(acl_field_defs));
+	ret = rte_acl_add_rules(ctx, (struct rte_acl_rule *) rules, RTE_DIM(rules));
+	if (ret == 0)
+		ret = rte_acl_build(ctx, &cfg);
+	if (ret != 0)
+		rte_exit(EXIT_FAILURE, "Cannot build the classifier: %s\n", strerror(-ret));
+
+	ret = rte_acl_classify(ctx, data, results, RTE_DIM(cases), 1);
+	if (ret != 0)
+		rte_exit(EXIT_FAILURE, "Cannot classify: %s\n", strerror(-ret));
+
+	for (i = 0; i < RTE_DIM(cases); i++) {
+		if (results[i] != cases[i].expected) {
+			printf("FAIL %s: matched rule %u instead of %u\n", cases[i].name,
+					results[i], cases[i].expected);
+			failed++;
+		}
+	}
+
+	rte_acl_free(ctx);
+	printf("test_acl: %u/%u passed\n", (unsigned int) RTE_DIM(cases) - failed, (unsigned int) RTE_DIM(cases));
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,212 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2010-2014 Intel Corporation
+ */
+
+/*
+ * Offers each shaping algorithm twice its rate for a simulated time, and
+ * checks that the packets it lets through match the configured rate and
+ * burst in the long run. Also checks the cap of the token bucket burst and
+ * the refill of large rates after a long idle time.
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_eal.h>
+
+#include "shaper.h"
+
+/* Size on line of the offered packets, in bytes */
+#define PKT_SIZE 1538
+/* Relative error allowed on the long-run rate: the token bucket is exact
+ * but for the fixed point rate, rte_meter rounds its refill period */
+#define TB_TOLERANCE 0.001
+#define METER_TOLERANCE 0.02
+/* The simulated time makes the rate weigh this much more than the burst */
+#define RATE_OVER_BURST 100
+
+static const struct {
+	const char *name;
+	uint8_t algo;
+	uint64_t rate_bps;
+	uint64_t burst_bits;
+	uint64_t peak_rate_bps;
+	uint64_t peak_burst_bits;
+} cases[] = {
+	{ "token bucket 1 Mbps", SHAPER_TOKEN_BUCKET, 1000000, 100000, 0, 0 },
+	{ "token bucket 1 Gbps", SHAPER_TOKEN_BUCKET, 1000000000, 1000000, 0, 0 },
+	{ "token bucket 100 Gbps", SHAPER_TOKEN_BUCKET, 100000000000, 10000000, 0, 0 },
+	{ "token bucket 1 Tbps", SHAPER_TOKEN_BUCKET, 1000000000000, 100000000, 0, 0 },
+	{ "token bucket, burst above the cap", SHAPER_TOKEN_BUCKET, 10000000000, UINT64_C(1) << 40, 0, 0 },
+	{ "srTCM 10 Mbps", SHAPER_SRTCM, 10000000, 1000000, 0, 1000000 },
+	{ "srTCM 10 Gbps", SHAPER_SRTCM, 10000000000, 10000000, 0, 10000000 },
+	{ "trTCM 10 Mbps/20 Mbps", SHAPER_TRTCM, 10000000, 1000000, 20000000, 1000000 },
+	{ "trTCM 10 Gbps/40 Gbps", SHAPER_TRTCM, 10000000000, 10000000, 40000000000, 10000000 },
+};
+
+/* Returns true if measured is within tolerance of expected, give or take a packet */
+static int
+close_to(double measured, double expected, double tolerance)
+{
+	double slack = expected * tolerance + PKT_SIZE * 8;
+
+	return measured >= expected - slack && measured <= expected + slack;
+}
+
+/*
+ * Offers twice the highest rate of a shaper, and checks the bits it passes
+ * and marks against what its rates and bursts allow.
+ */
+static int
+test_long_run_rate(unsigned int c)
+{
+	struct shaper s;
+	uint64_t hz = rte_get_tsc_hz();
+	uint64_t max_rate = RTE_MAX(cases[c].rate_bps, cases[c].peak_rate_bps);
+	uint64_t burst = RTE_MIN(cases[c].burst_bits, SHAPER_MAX_BURST_BITS);
+	double tolerance = cases[c].algo == SHAPER_TOKEN_BUCKET ? TB_TOLERANCE : METER_TOLERANCE;
+	double seconds, expected_passed, expected_marked;
+	double passed = 0, marked = 0;
+	uint64_t start, interval, n_pkts, i;
+	int ok;
+
+	if (shaper_init(&s, cases[c].algo, cases[c].rate_bps, cases[c].burst_bits, cases[c].burst_bits,
+			cases[c].peak_rate_bps, cases[c].peak_burst_bits) != 0) {
+		printf("FAIL %s: cannot configure\n", cases[c].name);
+		return 0;
+	}
+
+	/* One packet every interval cycles, at least twice the highest rate */
+	interval = RTE_MAX((uint64_t) PKT_SIZE * 8 * hz / (2 * max_rate), UINT64_C(1));
+	seconds = RTE_MAX(1.0, (double) RATE_OVER_BURST * RTE_MAX(burst, cases[c].peak_burst_bits) /
+			cases[c].rate_bps);
+	n_pkts = seconds * hz / interval;
+	seconds = (double) n_pkts * interval / hz;
+
+	start = rte_rdtsc();
+	for (i = 0; i < n_pkts; i++) {
+		switch (shaper_check(&s, PKT_SIZE, start + i * interval)) {
+		case SHAPER_PASS:
+			passed += PKT_SIZE * 8;
+			break;
+		case SHAPER_MARK:
+			marked += PKT_SIZE * 8;
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* Green packets conform to the committed rate and burst. Yellow ones
+	 * of srTCM only come from the excess burst, those of trTCM make up
+	 * the peak rate with the green ones. */
+	expected_passed = burst + cases[c].rate_bps * seconds;
+	switch (cases[c].algo) {
+	case SHAPER_TOKEN_BUCKET:
+		ok = close_to(passed, expected_passed, tolerance) && marked == 0;
+		expected_marked = 0;
+		break;
+	case SHAPER_SRTCM:
+		expected_marked = cases[c].peak_burst_bits;
+		ok = close_to(passed, expected_passed, tolerance) && marked <= expected_marked + PKT_SIZE * 8;
+		break;
+	default:
+		expected_marked = cases[c].peak_burst_bits + cases[c].peak_rate_bps * seconds - expected_passed;
+		ok = close_to(passed, expected_passed, tolerance) &&
+			close_to(passed + marked, expected_passed + expected_marked, tolerance);
+		break;
+	}
+	if (!ok)
+		printf("FAIL %s: %.0f bits passed and %.0f marked in %.3f s, expected %.0f and %.0f\n",
+				cases[c].name, passed, marked, seconds, expected_passed, expected_marked);
+	return ok;
+}
+
+/* A burst above the cap only lets SHAPER_MAX_BURST_BITS through at once */
+static int
+test_burst_cap(void)
+{
+	struct shaper s;
+	uint64_t now, passed = 0;
+
+	shaper_init(&s, SHAPER_TOKEN_BUCKET, 1000000000, UINT64_C(1) << 40, UINT64_C(1) << 40, 0, 0);
+	now = s.tb.last_tsc;
+	while (shaper_check(&s, PKT_SIZE, now) == SHAPER_PASS)
+		passed += PKT_SIZE * 8;
+	if (passed > SHAPER_MAX_BURST_BITS || passed + PKT_SIZE * 8 < SHAPER_MAX_BURST_BITS) {
+		printf("FAIL burst cap: %" PRIu64 " bits passed at once, expected %" PRIu64 "\n",
+				passed, SHAPER_MAX_BURST_BITS);
+		return 0;
+	}
+	return 1;
+}
+
+/* A packet of the size of the burst never conforms, a smaller one does */
+static int
+test_fits(void)
+{
+	struct shaper s;
+	uint64_t now;
+
+	shaper_init(&s, SHAPER_TOKEN_BUCKET, 1000000000, PKT_SIZE * 8, PKT_SIZE * 8, 0, 0);
+	now = s.tb.last_tsc + s.tb.max_delta;
+	if (shaper_tb_fits(&s, PKT_SIZE) || shaper_check(&s, PKT_SIZE, now) == SHAPER_PASS ||
+			!shaper_tb_fits(&s, PKT_SIZE - 1) || shaper_check(&s, PKT_SIZE - 1, now) != SHAPER_PASS) {
+		printf("FAIL fits: a %u-byte burst must only let smaller packets through\n", PKT_SIZE);
+		return 0;
+	}
+	return 1;
+}
+
+/* An empty bucket of a large rate is exactly full after any long idle time */
+static int
+test_idle_refill(void)
+{
+	static const uint64_t rates[] = { 100000000000, 1000000000000, UINT64_C(1) << 50 };
+	struct shaper s;
+	uint64_t idle[3], now;
+	unsigned int i, j;
+	int ok = 1;
+
+	for (i = 0; i < RTE_DIM(rates); i++) {
+		shaper_init(&s, SHAPER_TOKEN_BUCKET, rates[i], SHAPER_MAX_BURST_BITS, 0, 0, 0);
+		idle[0] = s.tb.max_delta - 1;
+		idle[1] = s.tb.max_delta;
+		idle[2] = UINT64_C(1) << 40;
+		for (j = 0; j < RTE_DIM(idle); j++) {
+			s.tb.tokens = 0;
+			now = s.tb.last_tsc + idle[j];
+			shaper_tb_refill(&s, now);
+			/* Just below max_delta, the bucket may miss a cycle of tokens */
+			if (s.tb.tokens > s.tb.burst || s.tb.tokens + s.tb.rate < s.tb.burst) {
+				printf("FAIL idle refill at %" PRIu64 " bps after %" PRIu64 " cycles: %" PRIu64
+						" tokens, burst %" PRIu64 "\n", rates[i], idle[j], s.tb.tokens, s.tb.burst);
+				ok = 0;
+			}
+		}
+	}
+	return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int i, n_tests = 0, n_passed = 0;
+	int ret;
+
+	ret = rte_eal_init(argc, argv);
+	if (ret < 0)
+		rte_exit(EXIT_FAILURE, "Invalid EAL arguments\n");
+
+	for (i = 0; i < RTE_DIM(cases); i++, n_tests++)
+		n_passed += test_long_run_rate(i);
+	n_passed += test_burst_cap();
+	n_passed += test_idle_refill();
+	n_passed += test_fits();
+	n_tests += 3;
+
+	printf("test_shaper: %u/%u passed\n", n_passed, n_tests);
+	return n_passed == n_tests ? EXIT_SUCCESS : EXIT_FAILURE;
+}